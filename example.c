@@ -1,3 +1,4 @@
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -42,8 +43,8 @@ static int sim_loop(void *ptr) {
   }
 }
 
-static void sim_write(void *userdata, const uint8_t *bytes, size_t len) {
-  ssize_t amt = write(to_fds[1], bytes, len);
+static void sim_writev(void *userdata, const struct iovec *iov, int iovcnt) {
+  ssize_t amt = writev(to_fds[1], iov, iovcnt);
 }
 
 static void do_sim(struct protocol *p, const char *path) {
@@ -57,7 +58,7 @@ static void do_sim(struct protocol *p, const char *path) {
     execv(path, argv);
   }
 
-  viaems_set_write_fn(p, sim_write, NULL);
+  viaems_set_writev_fn(p, sim_writev, NULL);
   thrd_create(&sim_thread, sim_loop, p);
 }
   
@@ -117,22 +118,35 @@ static void dump_structure(const struct structure_node *node, size_t level) {
 }
 
 
-static int doer(void *ptr) {
-  struct protocol *p = ptr;
-
+/* Issue many gets at once and collect them from the completion queue on
+ * this thread */
+static void run_gets(struct protocol *p, size_t n_gets) {
   struct structure_node *root;
   if (!viaems_get_structure(p, &root)) {
     fprintf(stderr, "failed: viaems_get_structure\n");
-    return 0;
+    return;
   }
 
   struct structure_node *n = &root->map.list[0].map.list[2];
-  struct config_value val;
-  if (!viaems_send_get(p, n, &val)) {
-    fprintf(stderr, "failed: viaems_send_get\n");
-    return 0;
+  size_t outstanding = 0;
+  for (size_t i = 0; i < n_gets; i++) {
+    if (viaems_send_get_async(p, n, NULL, NULL)) {
+      outstanding++;
+    }
   }
-  return 0;
+
+  struct pollfd pfd = { .fd = viaems_completion_fd(p), .events = POLLIN };
+  while (outstanding > 0 && poll(&pfd, 1, -1) > 0) {
+    struct viaems_completion completions[16];
+    size_t n_completions = viaems_poll_completions(p, completions, 16);
+    for (size_t i = 0; i < n_completions; i++) {
+      if (completions[i].status != REQUEST_OK) {
+        fprintf(stderr, "failed: get %u\n", completions[i].id);
+      }
+    }
+    outstanding -= n_completions;
+  }
+  structure_destroy(root);
 }
 
 
@@ -148,13 +162,7 @@ int main(void) {
   vp_usb_connect(usb, p);
 //  do_sim(p, "/home/user/dev/viaems/obj/hosted/viaems");
 
-  thrd_t threads[50];
-  for (int i = 0; i < 50; i++) {
-    thrd_create(&threads[i], doer, p);
-  }
-  for (int i = 0; i < 50; i++) {
-    thrd_join(threads[i], NULL);
-  }
+  run_gets(p, 50);
   fprintf(stderr, "completed!\n");
 //  thrd_join(sim_thread, NULL);
   sleep(10);
@@ -0,0 +1,87 @@
+/* viaems-allocbench: check that steady state feed decoding does not allocate
+ *
+ * usage: viaems-allocbench
+ *
+ * Decodes a synthetic feed, alternating array and packed frames, with
+ * allocation tracking on. Once the description has been seen a steady feed
+ * must not allocate; exits nonzero if it does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "viaems-c.h"
+
+#define BENCH_FIELDS 64
+#define BENCH_FRAMES 100000
+
+static void die(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static size_t count = 0;
+
+static void new_feed_data(size_t n_fields, const struct field_key *keys, const union field_value *values) {
+  count += 1;
+}
+
+int main(void) {
+  struct protocol *p;
+  if (!viaems_create_protocol(&p)) {
+    die("viaems_create_protocol");
+  }
+  viaems_set_feed_cb(p, new_feed_data);
+
+  char names[BENCH_FIELDS][16];
+  struct field_key keys[BENCH_FIELDS];
+  union field_value values[BENCH_FIELDS];
+  for (int i = 0; i < BENCH_FIELDS; i++) {
+    snprintf(names[i], sizeof(names[i]), "field%d", i);
+    keys[i] = (struct field_key){ .name = names[i], .type = i % 2 ? FIELD_FLOAT : FIELD_UINT32 };
+    if (keys[i].type == FIELD_FLOAT) {
+      values[i].as_float = i * 0.5f;
+    } else {
+      values[i].as_uint32 = i * 1000;
+    }
+  }
+
+  uint8_t desc[4096], array[2048], packed[1024];
+  size_t desc_len = viaems_encode_description(desc, sizeof(desc), BENCH_FIELDS, keys);
+  size_t array_len = viaems_encode_feed(array, sizeof(array), BENCH_FIELDS, keys, values, false);
+  size_t packed_len = viaems_encode_feed(packed, sizeof(packed), BENCH_FIELDS, keys, values, true);
+  if (!desc_len || !array_len || !packed_len) {
+    die("viaems_encode_feed");
+  }
+
+  viaems_new_data(p, desc, desc_len);
+  viaems_new_data(p, array, array_len);
+  viaems_set_alloc_tracking(p, true);
+  count = 0;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < BENCH_FRAMES; i++) {
+    if (i % 2) {
+      viaems_new_data(p, packed, packed_len);
+    } else {
+      viaems_new_data(p, array, array_len);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  struct viaems_metrics m;
+  viaems_get_metrics(p, &m);
+  viaems_destroy_protocol(&p);
+
+  double elapsed_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+  fprintf(stderr, "feed: %zu of %d frames in %.1f ms, %lu allocations\n",
+      count, BENCH_FRAMES, elapsed_ms, (unsigned long)m.allocations[MESSAGE_FEED]);
+  if (count != BENCH_FRAMES) {
+    die("failed: not every frame was decoded");
+  }
+  if (m.allocations[MESSAGE_FEED] != 0) {
+    die("failed: steady state feed decoding allocated");
+  }
+  return 0;
+}
@@ -0,0 +1,549 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cbor.h"
+#include "viaems-batch.h"
+#include "viaems-log.h"
+
+#define DEFAULT_CHUNK_BYTES (1 << 20)
+#define NO_DESCRIPTION SIZE_MAX
+
+/* A resync candidate must start this many well formed messages in a row
+ * (or run to the end of the input) to be taken as a message boundary */
+#define RESYNC_MESSAGES 4
+
+static void check_thrd(int val) {
+  assert(val == thrd_success);
+}
+
+/* Rows decoded under one description, row-major */
+struct batch_segment {
+  size_t n_fields;
+  struct field_key *keys;
+  size_t n_rows;
+  size_t capacity;
+  union field_value *values;
+};
+
+/* Chunks are cut at fixed byte offsets, [start, end). A chunk owns the
+ * messages that begin inside it; its scan finds the first of them by
+ * resyncing, then walks to the end of the last */
+struct batch_chunk {
+  size_t start;
+  size_t end;
+
+  /* Set by the scan, and corrected when linking if the resync disagreed
+   * with where the previous chunk's last message ended */
+  bool scanned;
+  size_t first;
+  size_t last_end;
+  bool broken; /* A message could not be framed, last_end is where */
+  size_t last_desc_start; /* Last description in the chunk, or NO_DESCRIPTION */
+  size_t last_desc_len;
+
+  /* Set when linking: the description active at first */
+  size_t desc_start;
+  size_t desc_len;
+
+  bool done;
+  uint64_t messages;
+  size_t n_segments;
+  struct batch_segment *segments;
+};
+
+struct batch {
+  const uint8_t *data;
+  size_t len;
+  size_t n_chunks;
+  struct batch_chunk *chunks;
+  size_t window; /* Chunks decoded ahead of the merge */
+  uint8_t empty_desc[64]; /* Primes chunks that no description precedes */
+  size_t empty_desc_len;
+
+  mtx_t mtx; /* Protects everything below */
+  cnd_t work_cnd;
+  cnd_t done_cnd;
+  size_t next_scan;
+  size_t n_scanned;
+  bool linked;
+  size_t next_chunk;
+  size_t merged;
+  bool failed;
+};
+
+struct batch_worker {
+  struct batch *batch;
+  thrd_t thrd;
+  struct protocol *proto;
+  struct feed_listener listener;
+  struct batch_chunk *chunk;
+  bool failed;
+};
+
+/* Length of the complete CBOR item at the start of buf, 0 if truncated */
+static size_t message_length(const uint8_t *buf, size_t len, bool *is_description) {
+  CborParser parser;
+  CborValue root;
+  if (cbor_parser_init(buf, len, 0, &parser, &root) != CborNoError) {
+    return 0;
+  }
+  if (is_description) {
+    CborValue type;
+    bool match = false;
+    if (cbor_value_is_map(&root) &&
+        cbor_value_map_find_value(&root, "type", &type) == CborNoError &&
+        cbor_value_is_text_string(&type)) {
+      cbor_value_text_string_equals(&type, "description", &match);
+    }
+    *is_description = match;
+  }
+  if (cbor_value_advance(&root) != CborNoError) {
+    return 0;
+  }
+  return cbor_value_get_next_byte(&root) - buf;
+}
+
+/* Whether pos starts RESYNC_MESSAGES protocol messages, maps with a text
+ * "type", in a row */
+static bool is_boundary(const uint8_t *data, size_t len, size_t pos) {
+  for (int i = 0; i < RESYNC_MESSAGES && pos < len; i++) {
+    if ((data[pos] & 0xe0) != 0xa0) {
+      return false;
+    }
+    CborParser parser;
+    CborValue root;
+    CborValue type;
+    if (cbor_parser_init(data + pos, len - pos, 0, &parser, &root) != CborNoError ||
+        cbor_value_map_find_value(&root, "type", &type) != CborNoError ||
+        !cbor_value_is_text_string(&type)) {
+      return false;
+    }
+    size_t msglen = message_length(data + pos, len - pos, NULL);
+    if (msglen == 0) {
+      return false;
+    }
+    pos += msglen;
+  }
+  return true;
+}
+
+/* Frames messages from first while they begin before the chunk's end */
+static void walk_chunk(const struct batch *b, struct batch_chunk *chunk, size_t first) {
+  chunk->first = first;
+  chunk->broken = false;
+  chunk->last_desc_start = NO_DESCRIPTION;
+  chunk->last_desc_len = 0;
+  size_t pos = first;
+  while (pos < chunk->end) {
+    bool is_description;
+    size_t msglen = message_length(b->data + pos, b->len - pos, &is_description);
+    if (msglen == 0) {
+      chunk->broken = true;
+      break;
+    }
+    if (is_description) {
+      chunk->last_desc_start = pos;
+      chunk->last_desc_len = msglen;
+    }
+    pos += msglen;
+  }
+  chunk->last_end = pos;
+}
+
+static void scan_chunk(const struct batch *b, struct batch_chunk *chunk) {
+  size_t first = chunk->start;
+  if (chunk->start > 0) {
+    while (first < chunk->end && !is_boundary(b->data, b->len, first)) {
+      first++;
+    }
+  }
+  walk_chunk(b, chunk, first);
+}
+
+/* Chains the scans in input order, so that every message is decoded by
+ * exactly one chunk, and finds the description active at each chunk. A
+ * chunk whose resync did not land where the previous chunk's walk ended is
+ * walked again from there. After a message that could not be framed, the
+ * next chunk's resync is trusted, skipping the damage */
+static void link_chunks(struct batch *b) {
+  size_t desc_start = NO_DESCRIPTION;
+  size_t desc_len = 0;
+  size_t prev_end = 0;
+  bool prev_broken = false;
+  for (size_t i = 0; i < b->n_chunks; i++) {
+    struct batch_chunk *chunk = &b->chunks[i];
+    if (!prev_broken && chunk->first != prev_end) {
+      walk_chunk(b, chunk, prev_end);
+    }
+    chunk->desc_start = desc_start;
+    chunk->desc_len = desc_len;
+    if (chunk->last_desc_start != NO_DESCRIPTION) {
+      desc_start = chunk->last_desc_start;
+      desc_len = chunk->last_desc_len;
+    }
+    prev_end = chunk->last_end;
+    prev_broken = chunk->broken;
+  }
+}
+
+static bool split_chunks(struct batch *b, size_t chunk_bytes) {
+  b->n_chunks = (b->len + chunk_bytes - 1) / chunk_bytes;
+  b->chunks = calloc(b->n_chunks, sizeof(struct batch_chunk));
+  if (!b->chunks) {
+    return false;
+  }
+  for (size_t i = 0; i < b->n_chunks; i++) {
+    b->chunks[i].start = i * chunk_bytes;
+    b->chunks[i].end = i + 1 < b->n_chunks ? (i + 1) * chunk_bytes : b->len;
+  }
+  b->empty_desc_len = viaems_encode_description(b->empty_desc, sizeof(b->empty_desc), 0, NULL);
+  return b->empty_desc_len > 0;
+}
+
+static void segment_free(struct batch_segment *s) {
+  for (size_t i = 0; i < s->n_fields; i++) {
+    free(s->keys[i].name);
+  }
+  free(s->keys);
+  free(s->values);
+}
+
+static void batch_feed_schema(void *userdata, size_t n_fields, const struct field_key *keys) {
+  struct batch_worker *w = userdata;
+  struct batch_chunk *chunk = w->chunk;
+  struct batch_segment *segments = realloc(chunk->segments, (chunk->n_segments + 1) * sizeof(struct batch_segment));
+  if (!segments) {
+    w->failed = true;
+    return;
+  }
+  chunk->segments = segments;
+  struct batch_segment *s = &segments[chunk->n_segments++];
+  *s = (struct batch_segment){ 0 };
+  s->keys = calloc(n_fields ? n_fields : 1, sizeof(struct field_key));
+  if (!s->keys) {
+    w->failed = true;
+    return;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    s->keys[i].type = keys[i].type;
+    s->keys[i].name = strdup(keys[i].name);
+    if (!s->keys[i].name) {
+      w->failed = true;
+      return;
+    }
+    s->n_fields = i + 1;
+  }
+}
+
+static void batch_feed_frame(void *userdata, size_t n_fields, const struct field_key *keys, const union field_value *values) {
+  struct batch_worker *w = userdata;
+  struct batch_chunk *chunk = w->chunk;
+  if (chunk->n_segments == 0 || w->failed) {
+    return;
+  }
+  struct batch_segment *s = &chunk->segments[chunk->n_segments - 1];
+  if (s->n_rows == s->capacity) {
+    size_t capacity = s->capacity ? s->capacity * 2 : 1024;
+    union field_value *grown = realloc(s->values, capacity * s->n_fields * sizeof(union field_value));
+    if (!grown) {
+      w->failed = true;
+      return;
+    }
+    s->values = grown;
+    s->capacity = capacity;
+  }
+  memcpy(&s->values[s->n_rows * s->n_fields], values, s->n_fields * sizeof(union field_value));
+  s->n_rows += 1;
+}
+
+static void decode_chunk(struct batch_worker *w, struct batch_chunk *chunk) {
+  const struct batch *b = w->batch;
+  w->chunk = chunk;
+
+  /* Every chunk starts from the description active at its start. The
+   * worker's protocol is reused, and only reports a schema when it changes,
+   * so it is reset with an empty description first. The listener then sees
+   * a schema before the chunk's first frame */
+  viaems_new_data(w->proto, b->empty_desc, b->empty_desc_len);
+  if (chunk->desc_start != NO_DESCRIPTION) {
+    viaems_new_data(w->proto, b->data + chunk->desc_start, chunk->desc_len);
+  }
+
+  size_t pos = chunk->first;
+  while (pos < chunk->last_end) {
+    size_t msglen = message_length(b->data + pos, chunk->last_end - pos, NULL);
+    if (msglen == 0) {
+      break;
+    }
+    viaems_new_data(w->proto, b->data + pos, msglen);
+    chunk->messages += 1;
+    pos += msglen;
+  }
+}
+
+static int worker_loop(void *ptr) {
+  struct batch_worker *w = ptr;
+  struct batch *b = w->batch;
+
+  check_thrd(mtx_lock(&b->mtx));
+  while (!b->failed && b->next_scan < b->n_chunks) {
+    struct batch_chunk *chunk = &b->chunks[b->next_scan++];
+    check_thrd(mtx_unlock(&b->mtx));
+
+    scan_chunk(b, chunk);
+
+    check_thrd(mtx_lock(&b->mtx));
+    chunk->scanned = true;
+    b->n_scanned += 1;
+    check_thrd(cnd_broadcast(&b->done_cnd));
+  }
+  while (!b->failed && !b->linked) {
+    check_thrd(cnd_wait(&b->work_cnd, &b->mtx));
+  }
+
+  while (!b->failed && b->next_chunk < b->n_chunks) {
+    if (b->next_chunk >= b->merged + b->window) {
+      check_thrd(cnd_wait(&b->work_cnd, &b->mtx));
+      continue;
+    }
+    struct batch_chunk *chunk = &b->chunks[b->next_chunk++];
+    check_thrd(mtx_unlock(&b->mtx));
+
+    decode_chunk(w, chunk);
+
+    check_thrd(mtx_lock(&b->mtx));
+    chunk->done = true;
+    if (w->failed) {
+      b->failed = true;
+    }
+    check_thrd(cnd_broadcast(&b->done_cnd));
+  }
+  check_thrd(mtx_unlock(&b->mtx));
+  return 0;
+}
+
+/* A backwards step of a uint32 counter is a wrap when it is a short step
+ * forward modulo 2^32, and otherwise a reset of the counter */
+#define COUNTER_WRAP_WINDOW (UINT32_C(1) << 31)
+
+struct timestamp_state {
+  const char *field_name;
+  double scale_ns;
+  int field; /* In the current segment, -1 to number frames */
+  uint64_t frame;
+  bool has_last;
+  uint32_t last;
+  uint64_t base; /* Counter ticks before the last value: wraps and resets */
+  uint64_t resets;
+  uint64_t rejected;
+};
+
+/* Returns false for a timestamp that cannot be stored, such as a negative or
+ * non-finite float */
+static bool frame_timestamp(struct timestamp_state *t, const struct batch_segment *s, const union field_value *row, uint64_t *timestamp_ns) {
+  uint64_t frame = t->frame++;
+  if (t->field < 0) {
+    *timestamp_ns = frame;
+    return true;
+  }
+  double ns;
+  if (s->keys[t->field].type == FIELD_FLOAT) {
+    ns = row[t->field].as_float * t->scale_ns;
+  } else {
+    uint32_t value = row[t->field].as_uint32;
+    if (t->has_last && value < t->last) {
+      if ((uint32_t)(value - t->last) < COUNTER_WRAP_WINDOW) {
+        t->base += UINT64_C(1) << 32;
+      } else {
+        /* The counter restarted, continue the timeline one tick on */
+        t->base += (uint64_t)t->last + 1 - value;
+        t->resets += 1;
+      }
+    }
+    t->last = value;
+    t->has_last = true;
+    ns = (double)(t->base + value) * t->scale_ns;
+  }
+  if (!isfinite(ns) || ns < 0 || ns >= 0x1p64) {
+    t->rejected += 1;
+    return false;
+  }
+  *timestamp_ns = ns;
+  return true;
+}
+
+static bool merge_chunk(struct vp_log_writer *log, struct batch_chunk *chunk, struct timestamp_state *t) {
+  bool success = true;
+  for (size_t i = 0; i < chunk->n_segments; i++) {
+    const struct batch_segment *s = &chunk->segments[i];
+    success &= vp_log_writer_set_schema(log, s->n_fields, s->keys);
+    t->field = -1;
+    for (size_t f = 0; t->field_name && f < s->n_fields; f++) {
+      if (strcmp(s->keys[f].name, t->field_name) == 0) {
+        t->field = f;
+      }
+    }
+    for (size_t r = 0; r < s->n_rows; r++) {
+      const union field_value *row = &s->values[r * s->n_fields];
+      uint64_t timestamp_ns;
+      if (frame_timestamp(t, s, row, &timestamp_ns)) {
+        success &= vp_log_writer_append(log, timestamp_ns, row);
+      }
+    }
+  }
+  return success;
+}
+
+bool vp_batch_decode(const char *input_path, const char *output_path, const struct vp_batch_config *config, struct vp_batch_result *result) {
+  int fd = open(input_path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  size_t n_workers = config->n_workers;
+  if (n_workers == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_workers = cpus > 0 ? cpus : 1;
+  }
+
+  struct batch b = {
+    .data = map,
+    .len = st.st_size,
+    .window = n_workers * 4,
+  };
+  mtx_init(&b.mtx, mtx_plain);
+  cnd_init(&b.work_cnd);
+  cnd_init(&b.done_cnd);
+
+  struct vp_log_writer *log = NULL;
+  struct batch_worker *workers = calloc(n_workers, sizeof(struct batch_worker));
+  size_t n_started = 0;
+  bool success = workers && split_chunks(&b, config->chunk_bytes ? config->chunk_bytes : DEFAULT_CHUNK_BYTES);
+  if (success) {
+    log = vp_log_writer_create(output_path);
+    success = log != NULL;
+  }
+  if (success) {
+    vp_log_writer_set_blocking(log, true);
+    for (; n_started < n_workers; n_started++) {
+      struct batch_worker *w = &workers[n_started];
+      w->batch = &b;
+      w->listener = (struct feed_listener){
+        .schema = batch_feed_schema,
+        .frame = batch_feed_frame,
+        .userdata = w,
+      };
+      if (!viaems_create_protocol(&w->proto) ||
+          !viaems_add_feed_listener(w->proto, &w->listener) ||
+          thrd_create(&w->thrd, worker_loop, w) != thrd_success) {
+        if (w->proto) {
+          viaems_destroy_protocol(&w->proto);
+        }
+        break;
+      }
+    }
+    success = n_started > 0;
+  }
+
+  /* Merge in input order as chunks complete */
+  struct timestamp_state t = {
+    .field_name = config->timestamp_field,
+    .scale_ns = config->timestamp_scale_ns,
+  };
+  *result = (struct vp_batch_result){ 0 };
+  if (success) {
+    check_thrd(mtx_lock(&b.mtx));
+    while (b.n_scanned < b.n_chunks && !b.failed) {
+      check_thrd(cnd_wait(&b.done_cnd, &b.mtx));
+    }
+    success = !b.failed;
+    check_thrd(mtx_unlock(&b.mtx));
+  }
+  if (success) {
+    link_chunks(&b);
+    check_thrd(mtx_lock(&b.mtx));
+    b.linked = true;
+    check_thrd(cnd_broadcast(&b.work_cnd));
+    check_thrd(mtx_unlock(&b.mtx));
+  }
+  for (size_t i = 0; success && i < b.n_chunks; i++) {
+    struct batch_chunk *chunk = &b.chunks[i];
+    check_thrd(mtx_lock(&b.mtx));
+    while (!chunk->done && !b.failed) {
+      check_thrd(cnd_wait(&b.done_cnd, &b.mtx));
+    }
+    success = !b.failed;
+    check_thrd(mtx_unlock(&b.mtx));
+    if (!success) {
+      break;
+    }
+
+    success = merge_chunk(log, chunk, &t);
+    result->messages += chunk->messages;
+    for (size_t s = 0; s < chunk->n_segments; s++) {
+      result->frames += chunk->segments[s].n_rows;
+      segment_free(&chunk->segments[s]);
+    }
+    free(chunk->segments);
+    chunk->segments = NULL;
+    chunk->n_segments = 0;
+
+    check_thrd(mtx_lock(&b.mtx));
+    b.merged = i + 1;
+    check_thrd(cnd_broadcast(&b.work_cnd));
+    check_thrd(mtx_unlock(&b.mtx));
+  }
+
+  check_thrd(mtx_lock(&b.mtx));
+  if (!success) {
+    b.failed = true;
+  }
+  check_thrd(cnd_broadcast(&b.work_cnd));
+  check_thrd(mtx_unlock(&b.mtx));
+  for (size_t i = 0; i < n_started; i++) {
+    thrd_join(workers[i].thrd, NULL);
+    struct viaems_metrics m;
+    viaems_get_metrics(workers[i].proto, &m);
+    viaems_destroy_protocol(&workers[i].proto);
+    for (int e = 0; e < N_PARSE_ERRORS; e++) {
+      result->parse_errors += m.parse_errors[e];
+    }
+    result->feed_length_mismatches += m.feed_length_mismatches;
+  }
+  result->timestamp_resets = t.resets;
+  result->rejected_timestamps = t.rejected;
+
+  if (log && !vp_log_writer_close(log)) {
+    success = false;
+  }
+  for (size_t i = 0; i < b.n_chunks; i++) {
+    for (size_t s = 0; s < b.chunks[i].n_segments; s++) {
+      segment_free(&b.chunks[i].segments[s]);
+    }
+    free(b.chunks[i].segments);
+  }
+  free(b.chunks);
+  free(workers);
+  cnd_destroy(&b.work_cnd);
+  cnd_destroy(&b.done_cnd);
+  mtx_destroy(&b.mtx);
+  munmap(map, st.st_size);
+  return success;
+}
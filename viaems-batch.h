@@ -0,0 +1,51 @@
+#ifndef VIAEMS_BATCH_H
+#define VIAEMS_BATCH_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Offline decoding of recorded sessions into a columnar log (see
+ * viaems-log.h).
+ *
+ * The input is a file of concatenated protocol messages as received from
+ * the ECU. It is cut into chunks at fixed byte offsets, and workers scan the
+ * chunks in parallel, each resyncing to the first message boundary in its
+ * chunk and noting the descriptions it passes. Once the scans are chained
+ * together in input order, workers decode the chunks in parallel, each with
+ * one protocol instance reused across chunks and primed with the
+ * description active at the chunk's start, and the results are merged in
+ * input order into the output.
+ */
+
+struct vp_batch_config {
+  size_t n_workers;   /* 0 uses every online CPU */
+  size_t chunk_bytes; /* Input per work item, 0 for a default */
+
+  /* Frame timestamps come from this feed field, unwrapped if it is a
+   * wrapping uint32 counter and scaled to nanoseconds. A counter that jumps
+   * back by more than half its range was reset, and its timeline continues
+   * from the last value. Frames with a negative or non-finite timestamp are
+   * dropped. With no field, frames are numbered from 0 */
+  const char *timestamp_field;
+  double timestamp_scale_ns;
+};
+
+struct vp_batch_result {
+  uint64_t messages;
+  uint64_t frames;
+  uint64_t parse_errors;
+  uint64_t feed_length_mismatches;
+  uint64_t timestamp_resets;
+  uint64_t rejected_timestamps; /* Frames dropped, their timestamp could not be stored */
+};
+
+bool vp_batch_decode(const char *input_path, const char *output_path, const struct vp_batch_config *, struct vp_batch_result *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
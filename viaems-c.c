@@ -1,11 +1,15 @@
 #include <assert.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <threads.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "cbor.h"
 #include "viaems-c.h"
+#include "viaems-derived.h"
 
 
 typedef enum {
@@ -14,12 +18,41 @@ typedef enum {
   SET,
 } request_type;
 
+/* A leaf's pre-encoded request, shared by the leaf and any requests sent from
+ * it so a replay does not depend on the tree still being alive. The leaf's
+ * request pointer is data */
+struct request_skeleton {
+  atomic_size_t refs;
+  size_t len;
+  uint8_t data[];
+};
+
+static struct request_skeleton *request_skeleton_of(uint8_t *request) {
+  return (struct request_skeleton *)(request - offsetof(struct request_skeleton, data));
+}
+
+static struct request_skeleton *request_skeleton_retain(struct request_skeleton *skeleton) {
+  atomic_fetch_add_explicit(&skeleton->refs, 1, memory_order_relaxed);
+  return skeleton;
+}
+
+static void request_skeleton_release(struct request_skeleton *skeleton) {
+  if (atomic_fetch_sub_explicit(&skeleton->refs, 1, memory_order_acq_rel) == 1) {
+    free(skeleton);
+  }
+}
+
 struct request {
   bool active;
   uint32_t id;
   request_type type;
-  struct structure_node *node;
-  struct config_value value;
+  struct structure_node *node; /* Only handed back, the node may be gone */
+  config_value_type value_type; /* Captured at send time, node may move */
+  struct config_value set_value; /* Kept for replay, a string is a private copy */
+  struct request_skeleton *skeleton; /* Shared with the leaf, kept for replay */
+  uint64_t sent_ns;
+  uint64_t deadline_ns; /* CLOCK_MONOTONIC */
+  size_t heap_index;
   void *userdata;
   union {
     structure_callback structure_cb;
@@ -27,320 +60,1381 @@ struct request {
   };
 };
 
-#define MAX_KEYS 64
+struct atomic_histogram {
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum_ns;
+  _Atomic uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
+/* Mirrors struct viaems_metrics, updated with relaxed atomics so that
+ * viaems_get_metrics never contends with the receive thread */
+struct protocol_metrics {
+  _Atomic uint64_t bytes_received;
+  _Atomic uint64_t bytes_sent;
+  _Atomic uint64_t messages[N_MESSAGE_TYPES];
+  _Atomic uint64_t message_bytes[N_MESSAGE_TYPES];
+  _Atomic uint64_t parse_errors[N_PARSE_ERRORS];
+  _Atomic uint64_t feed_length_mismatches;
+  _Atomic uint64_t requests_sent;
+  _Atomic uint64_t orphan_responses;
+  _Atomic uint64_t timeouts;
+  struct atomic_histogram decode_time[N_MESSAGE_TYPES];
+  struct atomic_histogram request_latency;
+  _Atomic uint64_t allocations[N_MESSAGE_TYPES];
+  _Atomic uint64_t request_allocations;
+};
+
+/* Outstanding requests live in a fixed table. A request id carries its slot
+ * in the low bits and a per-slot generation in the high bits, so responses
+ * are matched in constant time and a late response to a reused slot is
+ * recognized as an orphan */
+#define REQUEST_SLOT_BITS 12
+#define MAX_REQUESTS (1 << REQUEST_SLOT_BITS)
+#define DEFAULT_REQUEST_TIMEOUT_MS 1000
+
+typedef enum {
+  SCHEMA_UNCHECKED,
+  SCHEMA_NAMES_MATCH, /* Types are only known once a frame arrives */
+  SCHEMA_MATCH,
+  SCHEMA_MISMATCH,
+} schema_state;
+
+#define MAX_FEED_LISTENERS 8
+
+struct listener_slot {
+  struct feed_listener listener;
+  bool schema_pending; /* Not yet told about the current description */
+  bool removed; /* Removed by a callback, dropped once dispatch finishes */
+};
+
+/* Buffers for joining a message for a plain write_fn. Larger buffers are
+ * freed after use rather than pooled */
+#define ENCODE_POOL_SIZE 4
+#define ENCODE_POOL_MAX_CAPACITY (64 * 1024)
+
+struct encode_buffer {
+  uint8_t *data;
+  size_t capacity;
+};
+
+/* Copies of string set values are kept in fixed slots, so a set does not
+ * allocate. Longer strings go to the allocator */
+#define STRING_POOL_SLOTS 32
+#define STRING_POOL_SLOT_LEN 64
+
 struct protocol {
+  struct viaems_allocator allocator;
+  _Atomic bool track_allocations;
+
+  /* Sized from each description and reused for every frame. Capacity only
+   * grows, so a steady feed never allocates */
   size_t n_feed_fields;
-  struct field_key field_keys[MAX_KEYS];
+  size_t feed_capacity;
+  struct field_key *field_keys;
+  union field_value *feed_values;
   feed_callback feed_cb;
 
+  /* Held across listener dispatch, so that a remove from another thread
+   * waits for a running callback. Recursive, since a callback may add or
+   * remove listeners itself */
+  mtx_t listener_mtx;
+  struct listener_slot feed_listeners[MAX_FEED_LISTENERS];
+  size_t n_feed_listeners;
+  bool dispatching_listeners;
+  bool feed_types_known; /* Field types are set, as packed frames require */
+  bool schema_changed; /* Keys or types differ from what listeners were last told */
+
+  /* Derived fields follow the described fields in field_keys. Their names
+   * are owned by the derived program */
+  struct derived_program *derived;
+  size_t n_derived_fields;
+
+  const struct feed_schema *typed_schema;
+  typed_feed_callback typed_feed_cb;
+  void *typed_feed_userdata;
+  schema_state typed_schema_state;
+
   write_fn write;
+  writev_fn writev;
   void *write_userdata;
 
-  mtx_t request_client_mtx; /* Used to lock all api client access to commands */
-  mtx_t request_mtx; /* Used to block access to request structure */
-  cnd_t request_wakeup_cnd;
-  struct request request;
+  mtx_t pool_mtx; /* Protects encode_pool and the string pool */
+  struct encode_buffer encode_pool[ENCODE_POOL_SIZE];
+  size_t n_encode_pool;
+  char *string_pool; /* STRING_POOL_SLOTS slots of STRING_POOL_SLOT_LEN */
+  uint8_t free_strings[STRING_POOL_SLOTS];
+  size_t n_free_strings;
+
+  bool lazy_structure;
+
+  mtx_t request_mtx; /* Used to block access to request structures and completions */
+  uint32_t request_timeout_ms;
+  struct request requests[MAX_REQUESTS];
+  uint16_t free_slots[MAX_REQUESTS];
+  size_t n_free_slots;
+
+  /* Min-heap of outstanding request slots ordered by deadline, serviced by
+   * deadline_thrd */
+  uint16_t deadline_heap[MAX_REQUESTS];
+  size_t n_deadlines;
+  cnd_t deadline_cnd;
+  thrd_t deadline_thrd;
+  bool running;
+
+  /* Ring of completions for requests issued without a callback, see
+   * viaems_poll_completions */
+  struct viaems_completion *completions;
+  size_t completions_head;
+  size_t n_completions;
+  size_t completions_capacity;
+  size_t n_completions_reserved;
+  int completion_fd;
+
+  struct protocol_metrics metrics;
 };
 
 static void check_thrd(int val) {
   assert(val == thrd_success);
 }
 
-bool viaems_create_protocol(struct protocol **dest) {
-  assert(dest);
-  *dest = (struct protocol *)malloc(sizeof(struct protocol));
-  if (!*dest) {
-    return false;
-  }
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  memset(*dest, 0, sizeof(struct protocol));
-  mtx_init(&(*dest)->request_mtx, mtx_plain);
-  mtx_init(&(*dest)->request_client_mtx, mtx_plain);
-  cnd_init(&(*dest)->request_wakeup_cnd);
-  return true;
+static void metric_add(_Atomic uint64_t *counter, uint64_t amount) {
+  atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
 }
 
-void viaems_destroy_protocol(struct protocol **proto) {
+static void metric_parse_error(struct protocol *p, parse_error reason) {
+  metric_add(&p->metrics.parse_errors[reason], 1);
+}
 
-  for (int i = 0; i < (*proto)->n_feed_fields; i++) {
-    free((*proto)->field_keys[i].name);
+/* Set by viaems_new_data while a message is decoded, so that allocations
+ * can be attributed to its type */
+static _Thread_local struct protocol *decoding_protocol;
+static _Thread_local message_type decoding_type;
+
+static void track_alloc(struct protocol *p) {
+  if (!atomic_load_explicit(&p->track_allocations, memory_order_relaxed)) {
+    return;
+  }
+  if (decoding_protocol == p) {
+    metric_add(&p->metrics.allocations[decoding_type], 1);
+  } else {
+    metric_add(&p->metrics.request_allocations, 1);
   }
-  free(*proto);
-  *proto = NULL;
 }
 
-void viaems_set_feed_cb(struct protocol *p, feed_callback cb) {
-  p->feed_cb = cb;
+static void *protocol_alloc(struct protocol *p, size_t size) {
+  track_alloc(p);
+  return p->allocator.alloc(p->allocator.userdata, size);
 }
 
-void viaems_set_write_fn(struct protocol *p, write_fn wfn, void *ud) {
-  p->write_userdata = ud;
-  p->write = wfn;
+static void protocol_free(struct protocol *p, void *ptr, size_t size) {
+  if (ptr) {
+    p->allocator.free(p->allocator.userdata, ptr, size);
+  }
 }
 
-static void handle_desc_message(struct protocol *p, CborValue *msg) {
-  CborValue keys;
-  if (cbor_value_map_find_value(msg, "keys", &keys) != CborNoError) {
-    /* TODO: handle */
-    return;
+/* Moves the contents to a new allocation. On failure the old one is left
+ * in place */
+static void *protocol_realloc(struct protocol *p, void *ptr, size_t old_size, size_t size) {
+  void *moved = protocol_alloc(p, size);
+  if (!moved) {
+    return NULL;
+  }
+  if (ptr) {
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+    protocol_free(p, ptr, old_size);
   }
+  return moved;
+}
 
-  if (!cbor_value_is_array(&keys)) {
-    return;
+/* Structure trees and string values belong to the caller and come from the
+ * C heap, but are counted against the message that produced them */
+static void track_result_alloc(void) {
+  if (decoding_protocol) {
+    track_alloc(decoding_protocol);
   }
+}
 
-  CborValue i;
-  size_t n_keys = 0;
-  cbor_value_enter_container(&keys, &i);
-  while(!cbor_value_at_end(&i)) {
-    if (n_keys >= MAX_KEYS) {
-      return;
-    }
-    if (!cbor_value_is_text_string(&i)) {
-      return;
-    }
+static void *result_malloc(size_t size) {
+  track_result_alloc();
+  return malloc(size);
+}
 
-    struct field_key *k = &p->field_keys[n_keys];
-    if (k->name) {
-      /* Already exists, check for change */
-      bool match;
-      cbor_value_text_string_equals(&i, k->name, &match);
-      if (!match) {
-        free(k->name);
-        k->name = NULL;
-      }
+static void *result_calloc(size_t n, size_t size) {
+  track_result_alloc();
+  return calloc(n, size);
+}
+
+static char *string_copy(struct protocol *p, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = NULL;
+  if (len <= STRING_POOL_SLOT_LEN) {
+    check_thrd(mtx_lock(&p->pool_mtx));
+    if (p->n_free_strings > 0) {
+      copy = p->string_pool + (size_t)p->free_strings[--p->n_free_strings] * STRING_POOL_SLOT_LEN;
     }
-    if (!k->name) {
-      size_t len;
-      if (cbor_value_calculate_string_length(&i, &len) != CborNoError) {
-        return;
-      }
-      len += 1; /* Account for null byte */
-      k->name = malloc(len);
-      if (!k->name) {
-        return;
-      }
-      if (cbor_value_copy_text_string(&i, k->name, &len, &i) != CborNoError) {
-        return;
-      }
-    } else {
-      cbor_value_advance(&i);
+    check_thrd(mtx_unlock(&p->pool_mtx));
+  }
+  if (!copy) {
+    copy = protocol_alloc(p, len);
+    if (!copy) {
+      return NULL;
     }
-    n_keys += 1;
   }
-
-  p->n_feed_fields = n_keys;
+  memcpy(copy, str, len);
+  return copy;
 }
 
-static void handle_feed_message(struct protocol *p, CborValue *msg) {
-  CborValue cbor_values;
-  union field_value feed_values[MAX_KEYS];
-  if (cbor_value_map_find_value(msg, "values", &cbor_values) != CborNoError) {
-    /* TODO: handle */
-    return;
+static void string_release(struct protocol *p, char *str) {
+  if (p->string_pool && str >= p->string_pool &&
+      str < p->string_pool + STRING_POOL_SLOTS * STRING_POOL_SLOT_LEN) {
+    check_thrd(mtx_lock(&p->pool_mtx));
+    p->free_strings[p->n_free_strings++] = (str - p->string_pool) / STRING_POOL_SLOT_LEN;
+    check_thrd(mtx_unlock(&p->pool_mtx));
+  } else if (str) {
+    protocol_free(p, str, strlen(str) + 1);
   }
+}
 
-  if (!cbor_value_is_array(&cbor_values)) {
-    return;
+static void release_field_name(struct protocol *p, struct field_key *k) {
+  if (k->name) {
+    protocol_free(p, k->name, strlen(k->name) + 1);
+    k->name = NULL;
   }
+}
 
-  CborValue i;
-  size_t n_values = 0;
-  cbor_value_enter_container(&cbor_values, &i);
-  while(!cbor_value_at_end(&i)) {
-    if (n_values >= MAX_KEYS) {
-      return;
-    }
-
-    struct field_key *k = &p->field_keys[n_values];
-
-    if (cbor_value_is_unsigned_integer(&i)) {
-      k->type = FIELD_UINT32;
-      uint64_t val;
-      cbor_value_get_uint64(&i, &val);
-      feed_values[n_values].as_uint32 = val;
-    } else if (cbor_value_is_float(&i)) {
-      k->type = FIELD_FLOAT;
-      float val;
-      cbor_value_get_float(&i, &val);
-      feed_values[n_values].as_float = val;
-    } else {
-      return;
-    }
-    n_values += 1;
-    cbor_value_advance_fixed(&i);
+static void histogram_record(struct atomic_histogram *h, uint64_t ns) {
+  size_t bucket = 0;
+  if (ns > 0) {
+    bucket = 63 - __builtin_clzll(ns);
   }
-  if (n_values != p->n_feed_fields) {
-    return;
+  if (bucket >= METRICS_HISTOGRAM_BUCKETS) {
+    bucket = METRICS_HISTOGRAM_BUCKETS - 1;
   }
-  if (p->feed_cb) {
-    p->feed_cb(n_values, p->field_keys, feed_values);
+  metric_add(&h->buckets[bucket], 1);
+  metric_add(&h->sum_ns, ns);
+  metric_add(&h->count, 1);
+}
+
+static void histogram_snapshot(struct metrics_histogram *dest, struct atomic_histogram *h) {
+  dest->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+  dest->sum_ns = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+  for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+    dest->buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
   }
 }
 
-static size_t calculate_container_length(const CborValue *value) {
-  CborValue i;
-  if (cbor_value_enter_container(value, &i) != CborNoError) {
-    return 0;
+void viaems_get_metrics(struct protocol *p, struct viaems_metrics *dest) {
+  struct protocol_metrics *m = &p->metrics;
+  dest->bytes_received = atomic_load_explicit(&m->bytes_received, memory_order_relaxed);
+  dest->bytes_sent = atomic_load_explicit(&m->bytes_sent, memory_order_relaxed);
+  for (int i = 0; i < N_MESSAGE_TYPES; i++) {
+    dest->messages[i] = atomic_load_explicit(&m->messages[i], memory_order_relaxed);
+    dest->message_bytes[i] = atomic_load_explicit(&m->message_bytes[i], memory_order_relaxed);
+    histogram_snapshot(&dest->decode_time[i], &m->decode_time[i]);
   }
-  size_t count = 0;
-  while(!cbor_value_at_end(&i)) {
-    cbor_value_advance(&i);
-    count += 1;
+  for (int i = 0; i < N_PARSE_ERRORS; i++) {
+    dest->parse_errors[i] = atomic_load_explicit(&m->parse_errors[i], memory_order_relaxed);
   }
-  return count;// no call to leave container, leave `value` unaltered
+  dest->feed_length_mismatches = atomic_load_explicit(&m->feed_length_mismatches, memory_order_relaxed);
+  dest->requests_sent = atomic_load_explicit(&m->requests_sent, memory_order_relaxed);
+  dest->orphan_responses = atomic_load_explicit(&m->orphan_responses, memory_order_relaxed);
+  dest->timeouts = atomic_load_explicit(&m->timeouts, memory_order_relaxed);
+  for (int i = 0; i < N_MESSAGE_TYPES; i++) {
+    dest->allocations[i] = atomic_load_explicit(&m->allocations[i], memory_order_relaxed);
+  }
+  dest->request_allocations = atomic_load_explicit(&m->request_allocations, memory_order_relaxed);
+  histogram_snapshot(&dest->request_latency, &m->request_latency);
 }
 
-static bool parse_cbor_structure_into_node(struct structure_node *dest, struct path_element **path, CborValue *entry);
+static bool deadline_before(struct protocol *p, size_t a, size_t b) {
+  return p->requests[p->deadline_heap[a]].deadline_ns <
+         p->requests[p->deadline_heap[b]].deadline_ns;
+}
 
+static void deadline_swap(struct protocol *p, size_t a, size_t b) {
+  uint16_t tmp = p->deadline_heap[a];
+  p->deadline_heap[a] = p->deadline_heap[b];
+  p->deadline_heap[b] = tmp;
+  p->requests[p->deadline_heap[a]].heap_index = a;
+  p->requests[p->deadline_heap[b]].heap_index = b;
+}
 
-static struct path_element **duplicate_and_extend_path_element(struct path_element **previous, struct path_element new) {
-  size_t current_len = 0;
-  if (previous) {
-    for (struct path_element **p = previous; *p != NULL; p++);
-    current_len++;
+static void deadline_sift_up(struct protocol *p, size_t pos) {
+  while (pos > 0) {
+    size_t parent = (pos - 1) / 2;
+    if (!deadline_before(p, pos, parent)) {
+      break;
+    }
+    deadline_swap(p, pos, parent);
+    pos = parent;
   }
+}
 
-  struct path_element **retval = calloc(sizeof(struct path_element *), current_len + 2); /* One extra new element, one null terminator */
-  if (!retval) {
-    return NULL;
-  }
-  for (int i = 0; i < current_len; i++) {
-    struct path_element *newcopy = malloc(sizeof(struct path_element));
-    if (!newcopy) {
-      return NULL;
+static void deadline_sift_down(struct protocol *p, size_t pos) {
+  while (true) {
+    size_t smallest = pos;
+    size_t left = 2 * pos + 1;
+    size_t right = 2 * pos + 2;
+    if (left < p->n_deadlines && deadline_before(p, left, smallest)) {
+      smallest = left;
     }
-    *newcopy = *previous[i];
-    retval[i] = newcopy;
+    if (right < p->n_deadlines && deadline_before(p, right, smallest)) {
+      smallest = right;
+    }
+    if (smallest == pos) {
+      break;
+    }
+    deadline_swap(p, pos, smallest);
+    pos = smallest;
   }
+}
 
-  struct path_element *newcopy = malloc(sizeof(struct path_element));
-  if (!newcopy) {
-    return NULL;
+static void deadline_remove(struct protocol *p, size_t pos) {
+  p->n_deadlines -= 1;
+  if (pos == p->n_deadlines) {
+    return;
   }
-  *newcopy = new;
-  retval[current_len] = newcopy;
-  retval[current_len + 1] = NULL;
-  return retval;
-
+  deadline_swap(p, pos, p->n_deadlines);
+  deadline_sift_up(p, pos);
+  deadline_sift_down(p, pos);
 }
 
-static bool parse_structure_list_into_node(struct structure_node *dest, struct path_element **path, CborValue *entry) {
-  size_t len = calculate_container_length(entry);
-  struct structure_node *list = calloc(sizeof(struct structure_node), len);
-  if (!list) {
-    return false;
+/* Must hold request_mtx. Returns NULL if the table is full */
+static struct request *request_alloc(struct protocol *p, request_type type) {
+  if (p->n_free_slots == 0) {
+    return NULL;
   }
+  uint16_t slot = p->free_slots[--p->n_free_slots];
+  struct request *req = &p->requests[slot];
 
-  CborValue element;
-  if (cbor_value_enter_container(entry, &element) != CborNoError) {
-    return false;
-  }
-  for (int i = 0; i < len; i++) {
-    struct path_element **newpath = duplicate_and_extend_path_element(path, (struct path_element){
-        .type = PATH_IDX,
-        .idx = i,
-        });
-    if (!parse_cbor_structure_into_node(&list[i], newpath, &element)) {
-      return false;
-    }
+  uint32_t generation = (req->id >> REQUEST_SLOT_BITS) + 1;
+  if ((generation << REQUEST_SLOT_BITS) == 0) {
+    generation = 1; /* Wrapped, never hand out id 0 */
   }
-  cbor_value_leave_container(entry, &element);
 
-  dest->type = LIST;
-  dest->path = path;
-  dest->list.len = len;
-  dest->list.list = list;
+  uint64_t now = monotonic_ns();
+  *req = (struct request){
+    .active = true,
+    .id = (generation << REQUEST_SLOT_BITS) | slot,
+    .type = type,
+    .sent_ns = now,
+    .deadline_ns = now + (uint64_t)p->request_timeout_ms * 1000000,
+    .heap_index = p->n_deadlines,
+  };
 
-  return true;
+  p->deadline_heap[p->n_deadlines++] = slot;
+  deadline_sift_up(p, req->heap_index);
+  if (req->heap_index == 0) {
+    /* New earliest deadline */
+    check_thrd(cnd_signal(&p->deadline_cnd));
+  }
+  return req;
 }
 
-static bool parse_structure_map_into_node(struct structure_node *dest, struct path_element **path, CborValue *entry) {
-  size_t len = calculate_container_length(entry);
-  if (len % 2 != 0) {
-    return false;
+/* Must hold request_mtx. Returns NULL if no such request is outstanding */
+static struct request *request_lookup(struct protocol *p, uint64_t id) {
+  if (id > UINT32_MAX) {
+    return NULL;
   }
-  len /= 2; /* Map length should be double for key/value pairs */
-  struct structure_node *list = calloc(sizeof(struct structure_node), len);
-  char **names = calloc(sizeof(char *), len);
-
-  if (!list || !names) {
-    return false;
+  struct request *req = &p->requests[id & (MAX_REQUESTS - 1)];
+  if (!req->active || req->id != id) {
+    return NULL;
   }
+  return req;
+}
 
-  CborValue element;
-  if (cbor_value_enter_container(entry, &element) != CborNoError) {
-    return false;
+/* Must hold request_mtx. Removes the request from the table, returning a
+ * copy so that it can be completed after the lock is dropped */
+static struct request request_take(struct protocol *p, struct request *req) {
+  struct request taken = *req;
+  if (req->skeleton) {
+    request_skeleton_release(req->skeleton);
+    taken.skeleton = NULL;
   }
-  for (int i = 0; i < len; i++) {
-    /* handle key name first */
-    if (!cbor_value_is_text_string(&element)) {
-      return false;
+  deadline_remove(p, req->heap_index);
+  req->active = false;
+  p->free_slots[p->n_free_slots++] = req - p->requests;
+  return taken;
+}
+
+/* Must hold request_mtx */
+static bool completion_grow(struct protocol *p, size_t needed) {
+  if (needed > p->completions_capacity) {
+    size_t capacity = p->completions_capacity ? p->completions_capacity : 64;
+    while (capacity < needed) {
+      capacity *= 2;
     }
-    size_t keylen;
-    if (cbor_value_calculate_string_length(&element, &keylen) != CborNoError) {
+    struct viaems_completion *c = protocol_realloc(p, p->completions,
+        p->completions_capacity * sizeof(struct viaems_completion),
+        capacity * sizeof(struct viaems_completion));
+    if (!c) {
       return false;
     }
-    keylen += 1; /* For null byte */
-    names[i] = malloc(keylen);
-    cbor_value_copy_text_string(&element, names[i], &keylen, &element);
-
-    struct path_element **newpath = duplicate_and_extend_path_element(path, (struct path_element){
-        .type = PATH_STR,
-        .str = names[i],
-        });
-
-    if (!parse_cbor_structure_into_node(&list[i], newpath, &element)) {
-      return false;
+    /* Unwrap entries that ran past the end of the old ring */
+    size_t tail = p->completions_head + p->n_completions;
+    if (tail > p->completions_capacity) {
+      memcpy(&c[p->completions_capacity], &c[0],
+          (tail - p->completions_capacity) * sizeof(struct viaems_completion));
     }
+    p->completions = c;
+    p->completions_capacity = capacity;
   }
-  cbor_value_leave_container(entry, &element);
-
-  dest->type = MAP;
-  dest->path = path;
-  dest->map.len = len;
-  dest->map.list = list;
-  dest->map.names = names;
-
   return true;
 }
 
-
-static config_value_type parse_leaf_type(CborValue *entry) {
-  CborValue cbor_type;
-  if (cbor_value_map_find_value(entry, "_type", &cbor_type) != CborNoError) {
-    return VALUE_INVALID;
+/* Must hold request_mtx. Makes room for one more queued completion, growing
+ * the ring if needed */
+static bool completion_reserve(struct protocol *p) {
+  if (!completion_grow(p, p->n_completions + p->n_completions_reserved + 1)) {
+    return false;
   }
-  if (!cbor_value_is_text_string(&cbor_type)) {
-    return VALUE_INVALID;
+  p->n_completions_reserved += 1;
+  return true;
+}
+
+static void completion_push(struct protocol *p, const struct viaems_completion *c) {
+  check_thrd(mtx_lock(&p->request_mtx));
+  size_t tail = (p->completions_head + p->n_completions) % p->completions_capacity;
+  p->completions[tail] = *c;
+  p->n_completions_reserved -= 1;
+  p->n_completions += 1;
+  if (p->n_completions == 1) {
+    uint64_t one = 1;
+    write(p->completion_fd, &one, sizeof(one));
   }
+  check_thrd(mtx_unlock(&p->request_mtx));
+}
 
-  config_value_type type = VALUE_INVALID;
+int viaems_completion_fd(struct protocol *p) {
+  return p->completion_fd;
+}
 
-  bool match;
-  cbor_value_text_string_equals(&cbor_type, "uint32", &match);
-  if (match) {
-    type = VALUE_UINT32;
+bool viaems_reserve_completions(struct protocol *p, size_t n) {
+  check_thrd(mtx_lock(&p->request_mtx));
+  bool success = completion_grow(p, p->n_completions + p->n_completions_reserved + n);
+  check_thrd(mtx_unlock(&p->request_mtx));
+  return success;
+}
+
+size_t viaems_poll_completions(struct protocol *p, struct viaems_completion *dest, size_t max) {
+  check_thrd(mtx_lock(&p->request_mtx));
+  size_t n = 0;
+  while (n < max && p->n_completions > 0) {
+    dest[n++] = p->completions[p->completions_head];
+    p->completions_head = (p->completions_head + 1) % p->completions_capacity;
+    p->n_completions -= 1;
   }
+  if (n > 0 && p->n_completions == 0) {
+    uint64_t count;
+    read(p->completion_fd, &count, sizeof(count));
+  }
+  check_thrd(mtx_unlock(&p->request_mtx));
+  return n;
+}
 
-  cbor_value_text_string_equals(&cbor_type, "float", &match);
-  if (match) {
-    type = VALUE_FLOAT;
+static bool encode_buffer_get(struct protocol *p, size_t capacity, struct encode_buffer *dest) {
+  *dest = (struct encode_buffer){ 0 };
+  check_thrd(mtx_lock(&p->pool_mtx));
+  if (p->n_encode_pool > 0) {
+    *dest = p->encode_pool[--p->n_encode_pool];
   }
+  check_thrd(mtx_unlock(&p->pool_mtx));
 
-  cbor_value_text_string_equals(&cbor_type, "bool", &match);
-  if (match) {
-    type = VALUE_BOOL;
+  if (dest->capacity < capacity) {
+    /* Contents need not survive, so there is nothing to copy */
+    protocol_free(p, dest->data, dest->capacity);
+    dest->data = protocol_alloc(p, capacity);
+    if (!dest->data) {
+      return false;
+    }
+    dest->capacity = capacity;
   }
+  return true;
+}
 
-  cbor_value_text_string_equals(&cbor_type, "string", &match);
-  if (match) {
-    type = VALUE_STRING;
+static void encode_buffer_put(struct protocol *p, struct encode_buffer *b) {
+  check_thrd(mtx_lock(&p->pool_mtx));
+  if (p->n_encode_pool < ENCODE_POOL_SIZE && b->capacity <= ENCODE_POOL_MAX_CAPACITY) {
+    p->encode_pool[p->n_encode_pool++] = *b;
+    b->data = NULL;
   }
+  check_thrd(mtx_unlock(&p->pool_mtx));
+  protocol_free(p, b->data, b->capacity);
+}
 
-  cbor_value_text_string_equals(&cbor_type, "sensor", &match);
-  if (match) {
-    type = VALUE_SENSOR;
+static void protocol_writev(struct protocol *p, const struct iovec *iov, int iovcnt) {
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+
+  if (p->writev) {
+    metric_add(&p->metrics.bytes_sent, len);
+    metric_add(&p->metrics.requests_sent, 1);
+    p->writev(p->write_userdata, iov, iovcnt);
+  } else if (p->write) {
+    if (iovcnt == 1) {
+      metric_add(&p->metrics.bytes_sent, len);
+      metric_add(&p->metrics.requests_sent, 1);
+      p->write(p->write_userdata, iov[0].iov_base, len);
+      return;
+    }
+    /* A plain write_fn needs the message in one piece */
+    struct encode_buffer joined;
+    if (!encode_buffer_get(p, len, &joined)) {
+      return;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      memcpy(joined.data + pos, iov[i].iov_base, iov[i].iov_len);
+      pos += iov[i].iov_len;
+    }
+    metric_add(&p->metrics.bytes_sent, len);
+    metric_add(&p->metrics.requests_sent, 1);
+    p->write(p->write_userdata, joined.data, len);
+    encode_buffer_put(p, &joined);
+  }
+}
+
+static void protocol_write(struct protocol *p, uint8_t *buf, size_t len) {
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  protocol_writev(p, &iov, 1);
+}
+
+static int deadline_loop(void *ptr);
+static void complete_request(struct protocol *p, struct request *req, request_status status, CborValue *response);
+
+static void *default_alloc(void *userdata, size_t size) {
+  return malloc(size);
+}
+
+static void default_free(void *userdata, void *ptr, size_t size) {
+  free(ptr);
+}
+
+bool viaems_create_protocol(struct protocol **dest) {
+  struct viaems_allocator allocator = {
+    .alloc = default_alloc,
+    .free = default_free,
+  };
+  return viaems_create_protocol_with_allocator(dest, &allocator);
+}
+
+/* Undoes protocol creation up to the point the deadline thread starts */
+static void free_unstarted_protocol(struct protocol *p) {
+  cnd_destroy(&p->deadline_cnd);
+  mtx_destroy(&p->listener_mtx);
+  mtx_destroy(&p->pool_mtx);
+  mtx_destroy(&p->request_mtx);
+  protocol_free(p, p->string_pool, STRING_POOL_SLOTS * STRING_POOL_SLOT_LEN);
+  protocol_free(p, p, sizeof(struct protocol));
+}
+
+bool viaems_create_protocol_with_allocator(struct protocol **dest, const struct viaems_allocator *allocator) {
+  assert(dest);
+  assert(allocator && allocator->alloc && allocator->free);
+  *dest = (struct protocol *)allocator->alloc(allocator->userdata, sizeof(struct protocol));
+  if (!*dest) {
+    return false;
+  }
+
+  struct protocol *p = *dest;
+  memset(p, 0, sizeof(struct protocol));
+  p->allocator = *allocator;
+  p->string_pool = protocol_alloc(p, STRING_POOL_SLOTS * STRING_POOL_SLOT_LEN);
+  if (!p->string_pool) {
+    protocol_free(p, p, sizeof(struct protocol));
+    *dest = NULL;
+    return false;
+  }
+  for (int i = 0; i < STRING_POOL_SLOTS; i++) {
+    p->free_strings[i] = STRING_POOL_SLOTS - 1 - i;
+  }
+  p->n_free_strings = STRING_POOL_SLOTS;
+  mtx_init(&p->request_mtx, mtx_plain);
+  mtx_init(&p->pool_mtx, mtx_plain);
+  mtx_init(&p->listener_mtx, mtx_recursive);
+  cnd_init(&p->deadline_cnd);
+  p->request_timeout_ms = DEFAULT_REQUEST_TIMEOUT_MS;
+  for (int i = 0; i < MAX_REQUESTS; i++) {
+    p->free_slots[i] = MAX_REQUESTS - 1 - i;
+  }
+  p->n_free_slots = MAX_REQUESTS;
+
+  p->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (p->completion_fd < 0) {
+    free_unstarted_protocol(p);
+    *dest = NULL;
+    return false;
+  }
+
+  p->running = true;
+  if (thrd_create(&p->deadline_thrd, deadline_loop, p) != thrd_success) {
+    close(p->completion_fd);
+    free_unstarted_protocol(p);
+    *dest = NULL;
+    return false;
+  }
+  return true;
+}
+
+void viaems_set_alloc_tracking(struct protocol *p, bool enabled) {
+  atomic_store_explicit(&p->track_allocations, enabled, memory_order_relaxed);
+}
+
+void viaems_destroy_protocol(struct protocol **proto) {
+  struct protocol *p = *proto;
+
+  check_thrd(mtx_lock(&p->request_mtx));
+  p->running = false;
+  check_thrd(cnd_signal(&p->deadline_cnd));
+  check_thrd(mtx_unlock(&p->request_mtx));
+  thrd_join(p->deadline_thrd, NULL);
+
+  /* Anything still outstanding will never complete now */
+  check_thrd(mtx_lock(&p->request_mtx));
+  while (p->n_deadlines > 0) {
+    struct request req = request_take(p, &p->requests[p->deadline_heap[0]]);
+    check_thrd(mtx_unlock(&p->request_mtx));
+    complete_request(p, &req, REQUEST_CANCELLED, NULL);
+    check_thrd(mtx_lock(&p->request_mtx));
+  }
+  check_thrd(mtx_unlock(&p->request_mtx));
+
+  /* Release anything queued but never polled */
+  struct viaems_completion c;
+  while (viaems_poll_completions(p, &c, 1) > 0) {
+    structure_destroy(c.root);
+    if (c.value.type == VALUE_STRING) {
+      free(c.value.as_string);
+    }
+  }
+  protocol_free(p, p->completions, p->completions_capacity * sizeof(struct viaems_completion));
+  close(p->completion_fd);
+
+  for (int i = 0; i < p->n_feed_fields; i++) {
+    release_field_name(p, &p->field_keys[i]);
+  }
+  protocol_free(p, p->field_keys, p->feed_capacity * sizeof(struct field_key));
+  protocol_free(p, p->feed_values, p->feed_capacity * sizeof(union field_value));
+  derived_program_destroy(p->derived);
+  for (size_t i = 0; i < p->n_encode_pool; i++) {
+    protocol_free(p, p->encode_pool[i].data, p->encode_pool[i].capacity);
+  }
+  protocol_free(p, p->string_pool, STRING_POOL_SLOTS * STRING_POOL_SLOT_LEN);
+  cnd_destroy(&p->deadline_cnd);
+  mtx_destroy(&p->listener_mtx);
+  mtx_destroy(&p->pool_mtx);
+  mtx_destroy(&p->request_mtx);
+  protocol_free(p, p, sizeof(struct protocol));
+  *proto = NULL;
+}
+
+void viaems_set_lazy_structure(struct protocol *p, bool lazy) {
+  p->lazy_structure = lazy;
+}
+
+void viaems_set_request_timeout(struct protocol *p, uint32_t timeout_ms) {
+  check_thrd(mtx_lock(&p->request_mtx));
+  p->request_timeout_ms = timeout_ms;
+  check_thrd(mtx_unlock(&p->request_mtx));
+}
+
+void viaems_set_feed_cb(struct protocol *p, feed_callback cb) {
+  p->feed_cb = cb;
+}
+
+bool viaems_add_feed_listener(struct protocol *p, const struct feed_listener *listener) {
+  check_thrd(mtx_lock(&p->listener_mtx));
+  bool success = p->n_feed_listeners < MAX_FEED_LISTENERS;
+  if (success) {
+    p->feed_listeners[p->n_feed_listeners++] = (struct listener_slot){
+      .listener = *listener,
+      .schema_pending = true,
+    };
+  }
+  check_thrd(mtx_unlock(&p->listener_mtx));
+  return success;
+}
+
+static void compact_listeners(struct protocol *p) {
+  size_t n = 0;
+  for (size_t i = 0; i < p->n_feed_listeners; i++) {
+    if (!p->feed_listeners[i].removed) {
+      p->feed_listeners[n++] = p->feed_listeners[i];
+    }
+  }
+  p->n_feed_listeners = n;
+}
+
+bool viaems_remove_feed_listener(struct protocol *p, const struct feed_listener *listener) {
+  /* Blocks while another thread is dispatching, so no callback for the
+   * listener is running once this returns */
+  check_thrd(mtx_lock(&p->listener_mtx));
+  bool found = false;
+  for (size_t i = 0; i < p->n_feed_listeners; i++) {
+    struct listener_slot *s = &p->feed_listeners[i];
+    if (!s->removed && s->listener.schema == listener->schema &&
+        s->listener.frame == listener->frame && s->listener.userdata == listener->userdata) {
+      s->removed = true;
+      found = true;
+      break;
+    }
+  }
+  if (!p->dispatching_listeners) {
+    compact_listeners(p);
+  }
+  check_thrd(mtx_unlock(&p->listener_mtx));
+  return found;
+}
+
+void viaems_set_write_fn(struct protocol *p, write_fn wfn, void *ud) {
+  p->write_userdata = ud;
+  p->writev = NULL;
+  p->write = wfn;
+}
+
+void viaems_set_writev_fn(struct protocol *p, writev_fn wfn, void *ud) {
+  p->write_userdata = ud;
+  p->write = NULL;
+  p->writev = wfn;
+}
+
+static void check_schema_names(struct protocol *p) {
+  const struct feed_schema *schema = p->typed_schema;
+  if (!schema) {
+    return;
+  }
+  if (p->n_feed_fields == 0) {
+    p->typed_schema_state = SCHEMA_UNCHECKED;
+    return;
+  }
+  if (schema->n_fields != p->n_feed_fields) {
+    p->typed_schema_state = SCHEMA_MISMATCH;
+    return;
+  }
+  for (int i = 0; i < schema->n_fields; i++) {
+    if (strcmp(schema->fields[i].name, p->field_keys[i].name) != 0) {
+      p->typed_schema_state = SCHEMA_MISMATCH;
+      return;
+    }
+  }
+  p->typed_schema_state = SCHEMA_NAMES_MATCH;
+}
+
+static void check_schema_types(struct protocol *p) {
+  const struct feed_schema *schema = p->typed_schema;
+  for (int i = 0; i < schema->n_fields; i++) {
+    if (schema->fields[i].type != p->field_keys[i].type) {
+      p->typed_schema_state = SCHEMA_MISMATCH;
+      return;
+    }
+  }
+  p->typed_schema_state = SCHEMA_MATCH;
+}
+
+void viaems_set_typed_feed_cb(struct protocol *p, const struct feed_schema *schema, typed_feed_callback cb, void *ud) {
+  p->typed_schema = schema;
+  p->typed_feed_cb = cb;
+  p->typed_feed_userdata = ud;
+  p->typed_schema_state = SCHEMA_UNCHECKED;
+  check_schema_names(p);
+}
+
+bool viaems_feed_schema_matches(struct protocol *p) {
+  return p->typed_schema_state == SCHEMA_MATCH;
+}
+
+static bool reserve_feed_fields(struct protocol *p, size_t n_fields) {
+  if (n_fields <= p->feed_capacity) {
+    return true;
+  }
+  struct field_key *keys = protocol_alloc(p, n_fields * sizeof(struct field_key));
+  union field_value *values = protocol_alloc(p, n_fields * sizeof(union field_value));
+  if (!keys || !values) {
+    protocol_free(p, keys, n_fields * sizeof(struct field_key));
+    protocol_free(p, values, n_fields * sizeof(union field_value));
+    return false;
+  }
+  memset(keys, 0, n_fields * sizeof(struct field_key));
+  if (p->feed_capacity > 0) {
+    memcpy(keys, p->field_keys, p->feed_capacity * sizeof(struct field_key));
+    memcpy(values, p->feed_values, p->feed_capacity * sizeof(union field_value));
+  }
+  protocol_free(p, p->field_keys, p->feed_capacity * sizeof(struct field_key));
+  protocol_free(p, p->feed_values, p->feed_capacity * sizeof(union field_value));
+  p->field_keys = keys;
+  p->feed_values = values;
+  p->feed_capacity = n_fields;
+  return true;
+}
+
+/* Listeners are told about the schema again before their next frame */
+static void mark_schema_pending(struct protocol *p) {
+  check_thrd(mtx_lock(&p->listener_mtx));
+  for (size_t i = 0; i < p->n_feed_listeners; i++) {
+    p->feed_listeners[i].schema_pending = true;
+  }
+  check_thrd(mtx_unlock(&p->listener_mtx));
+}
+
+static void detach_derived_fields(struct protocol *p) {
+  for (int i = 0; i < p->n_derived_fields; i++) {
+    p->field_keys[p->n_feed_fields + i].name = NULL;
+  }
+  p->n_derived_fields = 0;
+}
+
+static void attach_derived_fields(struct protocol *p) {
+  if (!p->derived || p->n_feed_fields == 0) {
+    return;
+  }
+  size_t n_derived = derived_program_n_outputs(p->derived);
+  if (!reserve_feed_fields(p, p->n_feed_fields + n_derived)) {
+    return;
+  }
+  derived_program_bind(p->derived, p->n_feed_fields, p->field_keys);
+  for (int i = 0; i < n_derived; i++) {
+    p->field_keys[p->n_feed_fields + i] = (struct field_key){
+      .name = (char *)derived_program_output_name(p->derived, i),
+      .type = FIELD_FLOAT,
+    };
+  }
+  p->n_derived_fields = n_derived;
+}
+
+bool viaems_add_derived_channel(struct protocol *p, const char *name, const char *expression) {
+  if (!p->derived) {
+    p->derived = derived_program_create();
+    if (!p->derived) {
+      return false;
+    }
+  }
+  if (!derived_program_add(p->derived, name, expression)) {
+    return false;
+  }
+  detach_derived_fields(p);
+  attach_derived_fields(p);
+  mark_schema_pending(p);
+  return true;
+}
+
+static size_t calculate_container_length(const CborValue *value) {
+  CborValue i;
+  if (cbor_value_enter_container(value, &i) != CborNoError) {
+    return 0;
+  }
+  size_t count = 0;
+  while(!cbor_value_at_end(&i)) {
+    cbor_value_advance(&i);
+    count += 1;
+  }
+  return count;// no call to leave container, leave `value` unaltered
+}
+
+/* Copies the names in keys into field_keys, keeping those that are unchanged */
+static bool copy_field_keys(struct protocol *p, CborValue *keys, size_t len, size_t *n_keys) {
+  CborValue i;
+  cbor_value_enter_container(keys, &i);
+  while(!cbor_value_at_end(&i) && *n_keys < len) {
+    if (!cbor_value_is_text_string(&i)) {
+      metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+      return false;
+    }
+
+    struct field_key *k = &p->field_keys[*n_keys];
+    if (k->name) {
+      /* Already exists, check for change */
+      bool match;
+      cbor_value_text_string_equals(&i, k->name, &match);
+      if (!match) {
+        release_field_name(p, k);
+      }
+    }
+    if (!k->name) {
+      size_t len;
+      if (cbor_value_calculate_string_length(&i, &len) != CborNoError) {
+        metric_parse_error(p, PARSE_ERROR_CBOR);
+        return false;
+      }
+      len += 1; /* Account for null byte */
+      size_t capacity = len;
+      p->schema_changed = true;
+      k->name = protocol_alloc(p, capacity);
+      if (!k->name) {
+        return false;
+      }
+      if (cbor_value_copy_text_string(&i, k->name, &len, &i) != CborNoError) {
+        protocol_free(p, k->name, capacity);
+        k->name = NULL;
+        metric_parse_error(p, PARSE_ERROR_CBOR);
+        return false;
+      }
+    } else {
+      cbor_value_advance(&i);
+    }
+    *n_keys += 1;
+  }
+  return true;
+}
+
+static bool parse_description_keys(struct protocol *p, CborValue *msg) {
+  CborValue keys;
+  if (cbor_value_map_find_value(msg, "keys", &keys) != CborNoError ||
+      !cbor_value_is_valid(&keys)) {
+    metric_parse_error(p, PARSE_ERROR_MISSING_FIELD);
+    return false;
+  }
+
+  if (!cbor_value_is_array(&keys)) {
+    metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+    return false;
+  }
+
+  size_t len;
+  if (cbor_value_get_array_length(&keys, &len) != CborNoError) {
+    len = calculate_container_length(&keys);
+  }
+  if (!reserve_feed_fields(p, len)) {
+    return false;
+  }
+
+  size_t n_keys = 0;
+  if (!copy_field_keys(p, &keys, len, &n_keys)) {
+    /* Leave no partial description behind, names copied so far included */
+    for (size_t i = 0; i < p->feed_capacity; i++) {
+      release_field_name(p, &p->field_keys[i]);
+    }
+    p->n_feed_fields = 0;
+    p->schema_changed = true;
+    check_schema_names(p);
+    return false;
+  }
+
+  if (n_keys != p->n_feed_fields) {
+    p->schema_changed = true;
+  }
+  /* Description shrank, release names no longer in use */
+  for (size_t i = n_keys; i < p->n_feed_fields; i++) {
+    release_field_name(p, &p->field_keys[i]);
+  }
+  p->n_feed_fields = n_keys;
+  check_schema_names(p);
+  return true;
+}
+
+/* Optional "types" array, sent by an ECU that can emit packed feed frames.
+ * Without it, types are learned from the first array-form frame */
+static bool parse_description_types(struct protocol *p, CborValue *msg) {
+  CborValue types;
+  p->feed_types_known = false;
+  if (cbor_value_map_find_value(msg, "types", &types) != CborNoError ||
+      !cbor_value_is_valid(&types)) {
+    return true;
+  }
+
+  if (!cbor_value_is_array(&types)) {
+    metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+    return false;
+  }
+
+  CborValue i;
+  size_t n_types = 0;
+  cbor_value_enter_container(&types, &i);
+  while(!cbor_value_at_end(&i)) {
+    bool is_uint32 = false;
+    bool is_float = false;
+    if (n_types >= p->n_feed_fields || !cbor_value_is_text_string(&i)) {
+      metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+      return false;
+    }
+    cbor_value_text_string_equals(&i, "uint32", &is_uint32);
+    cbor_value_text_string_equals(&i, "float", &is_float);
+    if (!is_uint32 && !is_float) {
+      metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+      return false;
+    }
+    feed_field_type type = is_float ? FIELD_FLOAT : FIELD_UINT32;
+    if (p->field_keys[n_types].type != type) {
+      p->field_keys[n_types].type = type;
+      p->schema_changed = true;
+    }
+    n_types += 1;
+    cbor_value_advance(&i);
+  }
+  if (n_types != p->n_feed_fields) {
+    metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+    return false;
+  }
+  p->feed_types_known = true;
+  return true;
+}
+
+static bool handle_desc_message(struct protocol *p, CborValue *msg) {
+  detach_derived_fields(p);
+  bool success = parse_description_keys(p, msg) &&
+                 parse_description_types(p, msg);
+  attach_derived_fields(p);
+  /* A repeated description is not a new schema. One that failed part way
+   * leaves schema_changed set for the next to report */
+  if (success && p->schema_changed) {
+    p->schema_changed = false;
+    mark_schema_pending(p);
+  }
+  return success;
+}
+
+/* Frame decoders return false on a parse error. A frame that does not match
+ * the description is dropped and counted, leaving matched false.
+ *
+ * Packed frames carry every value as a little endian 32 bit word in
+ * description order, which is already the layout of feed_values */
+static bool decode_packed_values(struct protocol *p, CborValue *cbor_values, bool *matched) {
+  size_t len;
+  *matched = false;
+  if (!p->feed_types_known ||
+      cbor_value_calculate_string_length(cbor_values, &len) != CborNoError ||
+      len != p->n_feed_fields * sizeof(union field_value) ||
+      cbor_value_copy_byte_string(cbor_values, (uint8_t *)p->feed_values, &len, NULL) != CborNoError) {
+    metric_add(&p->metrics.feed_length_mismatches, 1);
+    return true;
+  }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  for (size_t i = 0; i < p->n_feed_fields; i++) {
+    p->feed_values[i].as_uint32 = __builtin_bswap32(p->feed_values[i].as_uint32);
+  }
+#endif
+  *matched = true;
+  return true;
+}
+
+/* Types are only written once the whole frame has decoded, and a change
+ * means listeners are told the schema again */
+static void update_array_types(struct protocol *p, CborValue *cbor_values) {
+  CborValue i;
+  cbor_value_enter_container(cbor_values, &i);
+  for (size_t n = 0; n < p->n_feed_fields; n++) {
+    p->field_keys[n].type = cbor_value_is_float(&i) ? FIELD_FLOAT : FIELD_UINT32;
+    cbor_value_advance_fixed(&i);
+  }
+  mark_schema_pending(p);
+  check_schema_names(p);
+}
+
+static bool decode_array_values(struct protocol *p, CborValue *cbor_values, bool *matched) {
+  union field_value *feed_values = p->feed_values;
+  *matched = false;
+  size_t len;
+  if (cbor_value_get_array_length(cbor_values, &len) != CborNoError) {
+    len = calculate_container_length(cbor_values);
+  }
+  if (len != p->n_feed_fields) {
+    metric_add(&p->metrics.feed_length_mismatches, 1);
+    return true;
+  }
+
+  CborValue i;
+  size_t n_values = 0;
+  bool types_changed = false;
+  cbor_value_enter_container(cbor_values, &i);
+  while(!cbor_value_at_end(&i)) {
+    feed_field_type type;
+    if (cbor_value_is_unsigned_integer(&i)) {
+      type = FIELD_UINT32;
+      uint64_t val;
+      cbor_value_get_uint64(&i, &val);
+      feed_values[n_values].as_uint32 = val;
+    } else if (cbor_value_is_float(&i)) {
+      type = FIELD_FLOAT;
+      float val;
+      cbor_value_get_float(&i, &val);
+      feed_values[n_values].as_float = val;
+    } else {
+      metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+      return false;
+    }
+    types_changed |= p->field_keys[n_values].type != type;
+    n_values += 1;
+    cbor_value_advance_fixed(&i);
+  }
+  if (types_changed) {
+    update_array_types(p, cbor_values);
+  }
+  p->feed_types_known = true;
+  *matched = true;
+  return true;
+}
+
+static bool handle_feed_message(struct protocol *p, CborValue *msg) {
+  CborValue cbor_values;
+  union field_value *feed_values = p->feed_values;
+  if (cbor_value_map_find_value(msg, "values", &cbor_values) != CborNoError ||
+      !cbor_value_is_valid(&cbor_values)) {
+    metric_parse_error(p, PARSE_ERROR_MISSING_FIELD);
+    return false;
+  }
+
+  bool matched;
+  if (cbor_value_is_byte_string(&cbor_values)) {
+    if (!decode_packed_values(p, &cbor_values, &matched)) {
+      return false;
+    }
+  } else if (cbor_value_is_array(&cbor_values)) {
+    if (!decode_array_values(p, &cbor_values, &matched)) {
+      return false;
+    }
+  } else {
+    metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+    return false;
+  }
+  if (!matched) {
+    return true;
+  }
+  size_t n_values = p->n_feed_fields;
+  if (p->n_derived_fields > 0) {
+    derived_program_run(p->derived, n_values, p->field_keys, feed_values);
+  }
+  size_t n_fields = n_values + p->n_derived_fields;
+  if (p->feed_cb) {
+    p->feed_cb(n_fields, p->field_keys, feed_values);
+  }
+  check_thrd(mtx_lock(&p->listener_mtx));
+  p->dispatching_listeners = true;
+  /* Listeners added by a callback are appended, and see this frame */
+  for (size_t i = 0; i < p->n_feed_listeners; i++) {
+    struct listener_slot *s = &p->feed_listeners[i];
+    if (s->schema_pending && !s->removed) {
+      /* Field types are only known once a frame has been decoded */
+      s->schema_pending = false;
+      if (s->listener.schema) {
+        s->listener.schema(s->listener.userdata, n_fields, p->field_keys);
+      }
+    }
+    if (!s->removed) {
+      s->listener.frame(s->listener.userdata, n_fields, p->field_keys, feed_values);
+    }
+  }
+  p->dispatching_listeners = false;
+  compact_listeners(p);
+  check_thrd(mtx_unlock(&p->listener_mtx));
+  if (p->typed_schema_state == SCHEMA_NAMES_MATCH) {
+    check_schema_types(p);
+  }
+  if (p->typed_schema_state == SCHEMA_MATCH) {
+    /* Generated frame structs are packed 32 bit fields in description
+     * order, the same layout as the decoded values */
+    p->typed_feed_cb(feed_values, p->typed_feed_userdata);
+  }
+  return true;
+}
+
+static bool parse_cbor_structure_into_node(struct structure_node *dest, struct path_element **path, CborValue *entry);
+static bool parse_lazy_node(struct structure_node *dest, struct path_element **path, CborValue *entry, struct structure_source *source);
+static void structure_destroy_child(struct structure_node *node);
+
+/* A retained structure response, shared by every node of a lazy tree that
+ * has yet to be expanded */
+struct structure_source {
+  uint8_t *data;
+  size_t len;
+  size_t refs;
+};
+
+static void structure_source_release(struct structure_source *source) {
+  source->refs -= 1;
+  if (source->refs == 0) {
+    free(source->data);
+    free(source);
+  }
+}
+
+/* Children are parsed fully, or only enough to know their kind if lazy is
+ * set */
+static bool parse_child(struct structure_node *dest, struct path_element **path, CborValue *entry, struct structure_source *lazy) {
+  if (lazy) {
+    return parse_lazy_node(dest, path, entry, lazy);
+  }
+  return parse_cbor_structure_into_node(dest, path, entry);
+}
+
+/* Releases the children of a container that failed to parse. Each child
+ * owns its path once parsing it started, and untouched children are zeroed */
+static void free_partial_children(struct structure_node *list, char **names, size_t len) {
+  for (size_t i = 0; list && i < len; i++) {
+    structure_destroy_child(&list[i]);
+  }
+  for (size_t i = 0; names && i < len; i++) {
+    free(names[i]);
+  }
+  free(list);
+  free(names);
+}
+
+
+static struct path_element **duplicate_and_extend_path_element(struct path_element **previous, struct path_element new) {
+  size_t current_len = 0;
+  if (previous) {
+    for (struct path_element **p = previous; *p != NULL; p++) {
+      current_len++;
+    }
+  }
+
+  struct path_element **retval = result_calloc(sizeof(struct path_element *), current_len + 2); /* One extra new element, one null terminator */
+  if (!retval) {
+    return NULL;
+  }
+  for (int i = 0; i < current_len; i++) {
+    struct path_element *newcopy = result_malloc(sizeof(struct path_element));
+    if (!newcopy) {
+      return NULL;
+    }
+    *newcopy = *previous[i];
+    retval[i] = newcopy;
+  }
+
+  struct path_element *newcopy = result_malloc(sizeof(struct path_element));
+  if (!newcopy) {
+    return NULL;
+  }
+  *newcopy = new;
+  retval[current_len] = newcopy;
+  retval[current_len + 1] = NULL;
+  return retval;
+
+}
+
+static bool parse_structure_list_into_node(struct structure_node *dest, struct path_element **path, CborValue *entry, struct structure_source *lazy) {
+  dest->path = path;
+  size_t len = calculate_container_length(entry);
+  struct structure_node *list = result_calloc(sizeof(struct structure_node), len);
+  if (!list) {
+    return false;
+  }
+
+  CborValue element;
+  if (cbor_value_enter_container(entry, &element) != CborNoError) {
+    free_partial_children(list, NULL, len);
+    return false;
+  }
+  for (int i = 0; i < len; i++) {
+    struct path_element **newpath = duplicate_and_extend_path_element(path, (struct path_element){
+        .type = PATH_IDX,
+        .idx = i,
+        });
+    if (!newpath || !parse_child(&list[i], newpath, &element, lazy)) {
+      free_partial_children(list, NULL, len);
+      return false;
+    }
+  }
+  cbor_value_leave_container(entry, &element);
+
+  dest->type = LIST;
+  dest->path = path;
+  dest->list.len = len;
+  dest->list.list = list;
+
+  return true;
+}
+
+static bool parse_structure_map_into_node(struct structure_node *dest, struct path_element **path, CborValue *entry, struct structure_source *lazy) {
+  dest->path = path;
+  size_t len = calculate_container_length(entry);
+  if (len % 2 != 0) {
+    return false;
+  }
+  len /= 2; /* Map length should be double for key/value pairs */
+  struct structure_node *list = result_calloc(sizeof(struct structure_node), len);
+  char **names = result_calloc(sizeof(char *), len);
+
+  if (!list || !names) {
+    free_partial_children(list, names, len);
+    return false;
+  }
+
+  CborValue element;
+  if (cbor_value_enter_container(entry, &element) != CborNoError) {
+    free_partial_children(list, names, len);
+    return false;
+  }
+  for (int i = 0; i < len; i++) {
+    /* handle key name first */
+    size_t keylen;
+    if (!cbor_value_is_text_string(&element) ||
+        cbor_value_calculate_string_length(&element, &keylen) != CborNoError) {
+      free_partial_children(list, names, len);
+      return false;
+    }
+    keylen += 1; /* For null byte */
+    names[i] = result_malloc(keylen);
+    if (!names[i]) {
+      free_partial_children(list, names, len);
+      return false;
+    }
+    cbor_value_copy_text_string(&element, names[i], &keylen, &element);
+
+    struct path_element **newpath = duplicate_and_extend_path_element(path, (struct path_element){
+        .type = PATH_STR,
+        .str = names[i],
+        });
+
+    if (!newpath || !parse_child(&list[i], newpath, &element, lazy)) {
+      free_partial_children(list, names, len);
+      return false;
+    }
+  }
+  cbor_value_leave_container(entry, &element);
+
+  dest->type = MAP;
+  dest->path = path;
+  dest->map.len = len;
+  dest->map.list = list;
+  dest->map.names = names;
+
+  return true;
+}
+
+
+static config_value_type parse_leaf_type(CborValue *entry) {
+  CborValue cbor_type;
+  if (cbor_value_map_find_value(entry, "_type", &cbor_type) != CborNoError) {
+    return VALUE_INVALID;
+  }
+  if (!cbor_value_is_text_string(&cbor_type)) {
+    return VALUE_INVALID;
+  }
+
+  config_value_type type = VALUE_INVALID;
+
+  bool match;
+  cbor_value_text_string_equals(&cbor_type, "uint32", &match);
+  if (match) {
+    type = VALUE_UINT32;
+  }
+
+  cbor_value_text_string_equals(&cbor_type, "float", &match);
+  if (match) {
+    type = VALUE_FLOAT;
+  }
+
+  cbor_value_text_string_equals(&cbor_type, "bool", &match);
+  if (match) {
+    type = VALUE_BOOL;
+  }
+
+  cbor_value_text_string_equals(&cbor_type, "string", &match);
+  if (match) {
+    type = VALUE_STRING;
+  }
+
+  cbor_value_text_string_equals(&cbor_type, "sensor", &match);
+  if (match) {
+    type = VALUE_SENSOR;
   }
 
   cbor_value_text_string_equals(&cbor_type, "table", &match);
@@ -370,7 +1464,7 @@ static char *parse_leaf_description(CborValue *entry) {
   }
 
   size_t buflen = desc_len + 1;
-  char *desc = malloc(buflen);
+  char *desc = result_malloc(buflen);
   if (!desc) {
     return NULL;
   }
@@ -387,30 +1481,116 @@ static char **parse_leaf_choices(CborValue *entry) {
     return NULL;
   }
   size_t count = calculate_container_length(&cbor_choices);
-  char **choices = calloc(sizeof(const char *), count + 1);
-  choices[count] = NULL;
+  char **choices = result_calloc(sizeof(const char *), count + 1);
+  if (!choices) {
+    return NULL;
+  }
 
   CborValue choice_item;
   cbor_value_enter_container(&cbor_choices, &choice_item);
   for (int i = 0; i < count; i++) {
     size_t choice_len;
-    if (cbor_value_calculate_string_length(&choice_item, &choice_len) != CborNoError) {
+    if (cbor_value_calculate_string_length(&choice_item, &choice_len) != CborNoError ||
+        !(choices[i] = result_malloc(choice_len + 1))) {
+      for (int j = 0; j < i; j++) {
+        free(choices[j]);
+      }
+      free(choices);
       return NULL;
     }
     choice_len += 1; // Account for the null
-    choices[i] = malloc(choice_len);
     cbor_value_copy_text_string(&choice_item, choices[i], &choice_len, &choice_item);
   }
   return choices;
 }
 
+/* Leaf requests are encoded once, when the structure is parsed, as a get:
+ *   {"type": "request", "method": "get", "path": [...], "id": 0xffffffff}
+ * The id is always in its five byte form at the very end, so a get is sent
+ * as the skeleton minus the id bytes followed by the request's own id. A set
+ * is sent from the same bytes in pieces: the map grows to five entries,
+ * "get" becomes "set" (the same length), and a "value" entry follows the
+ * id */
+#define REQUEST_METHOD_OFFSET 22
+#define REQUEST_ID_LEN 4
+
+static size_t encode_leaf_request(uint8_t *buf, size_t len, struct path_element **path) {
+  size_t path_len = 0;
+  for (struct path_element **i = path; i && *i != NULL; i++) {
+    path_len++;
+  }
+
+  CborEncoder encoder;
+  cbor_encoder_init(&encoder, buf, len, 0);
+
+  CborEncoder map_encoder;
+  cbor_encoder_create_map(&encoder, &map_encoder, 4);
+  cbor_encode_text_stringz(&map_encoder, "type");
+  cbor_encode_text_stringz(&map_encoder, "request");
+  cbor_encode_text_stringz(&map_encoder, "method");
+  cbor_encode_text_stringz(&map_encoder, "get");
+  cbor_encode_text_stringz(&map_encoder, "path");
+
+  CborEncoder cbor_path;
+  cbor_encoder_create_array(&map_encoder, &cbor_path, path_len);
+  for (size_t i = 0; i < path_len; i++) {
+    if (path[i]->type == PATH_IDX) {
+      cbor_encode_uint(&cbor_path, path[i]->idx);
+    } else if (path[i]->type == PATH_STR) {
+      cbor_encode_text_stringz(&cbor_path, path[i]->str);
+    }
+  }
+  cbor_encoder_close_container(&map_encoder, &cbor_path);
+  cbor_encode_text_stringz(&map_encoder, "id");
+  cbor_encode_uint(&map_encoder, UINT32_MAX);
+  cbor_encoder_close_container(&encoder, &map_encoder);
+
+  size_t extra = cbor_encoder_get_extra_bytes_needed(&encoder);
+  if (extra > 0) {
+    return len + extra;
+  }
+  return cbor_encoder_get_buffer_size(&encoder, buf);
+}
+
+static bool build_leaf_request(struct structure_leaf *leaf, struct path_element **path) {
+  uint8_t buf[256];
+  size_t len = encode_leaf_request(buf, sizeof(buf), path);
+  struct request_skeleton *skeleton = result_malloc(sizeof(struct request_skeleton) + len);
+  if (!skeleton) {
+    return false;
+  }
+  atomic_init(&skeleton->refs, 1);
+  skeleton->len = len;
+  leaf->request = skeleton->data;
+  if (len <= sizeof(buf)) {
+    memcpy(leaf->request, buf, len);
+  } else {
+    encode_leaf_request(leaf->request, len, path);
+  }
+  leaf->request_len = len;
+  assert(memcmp(leaf->request + REQUEST_METHOD_OFFSET, "get", 3) == 0);
+  return true;
+}
+
+static void encode_request_id(uint8_t dest[REQUEST_ID_LEN], uint32_t id) {
+  dest[0] = id >> 24;
+  dest[1] = id >> 16;
+  dest[2] = id >> 8;
+  dest[3] = id;
+}
+
 static bool parse_structure_leaf_into_node(struct structure_node *dest, struct path_element **path, CborValue *entry) {
 
+  dest->path = path;
   dest->leaf.type = parse_leaf_type(entry);
   if (dest->leaf.type == VALUE_INVALID) {
     return false;
   }
 
+  if (!build_leaf_request(&dest->leaf, path)) {
+    return false;
+  }
+
   if (dest->leaf.type == VALUE_STRING) {
     dest->leaf.choices = parse_leaf_choices(entry);
   }
@@ -425,13 +1605,13 @@ static bool parse_structure_leaf_into_node(struct structure_node *dest, struct p
 static bool parse_cbor_structure_into_node(struct structure_node *dest, struct path_element **path, CborValue *entry) {
 
   if (cbor_value_is_array(entry)) {
-    return parse_structure_list_into_node(dest, path, entry);
+    return parse_structure_list_into_node(dest, path, entry, NULL);
   } else if (cbor_value_is_map(entry)) {
     CborValue cbor_type;
     cbor_value_map_find_value(entry, "_type", &cbor_type);
     if (cbor_value_get_type(&cbor_type) == CborInvalidType) {
       /* Not a leaf, parse as a map */
-      return parse_structure_map_into_node(dest, path, entry);
+      return parse_structure_map_into_node(dest, path, entry, NULL);
     } else {
       /* Is a leaf, parse out the details */
       return parse_structure_leaf_into_node(dest, path, entry);
@@ -440,252 +1620,819 @@ static bool parse_cbor_structure_into_node(struct structure_node *dest, struct p
   return false;
 }
 
-static void handle_response_message(struct protocol *p, CborValue *msg) {
+/* Lazy nodes record their kind, and for leaves the type and request
+ * template, but leave children, description and choices in the source until
+ * first accessed */
+static bool parse_lazy_node(struct structure_node *dest, struct path_element **path, CborValue *entry, struct structure_source *source) {
+  dest->path = path;
+  if (cbor_value_is_array(entry)) {
+    dest->type = LIST;
+  } else if (cbor_value_is_map(entry)) {
+    CborValue cbor_type;
+    cbor_value_map_find_value(entry, "_type", &cbor_type);
+    if (cbor_value_get_type(&cbor_type) == CborInvalidType) {
+      dest->type = MAP;
+    } else {
+      dest->type = LEAF;
+      dest->leaf.type = parse_leaf_type(entry);
+      if (dest->leaf.type == VALUE_INVALID || !build_leaf_request(&dest->leaf, path)) {
+        return false;
+      }
+    }
+  } else {
+    return false;
+  }
+  dest->source = source;
+  dest->offset = cbor_value_get_next_byte(entry) - source->data;
+  source->refs += 1;
+  return cbor_value_advance(entry) == CborNoError;
+}
+
+/* Copies the response so the tree can outlive the receive buffer */
+static struct structure_node *parse_lazy_structure(CborValue *response) {
+  const uint8_t *start = cbor_value_get_next_byte(response);
+  CborValue end = *response;
+  if (cbor_value_advance(&end) != CborNoError) {
+    return NULL;
+  }
+  size_t len = cbor_value_get_next_byte(&end) - start;
+
+  struct structure_source *source = result_malloc(sizeof(struct structure_source));
+  struct structure_node *root = result_calloc(1, sizeof(struct structure_node));
+  uint8_t *data = result_malloc(len);
+  if (!source || !root || !data) {
+    free(source);
+    free(root);
+    free(data);
+    return NULL;
+  }
+  memcpy(data, start, len);
+  *source = (struct structure_source){ .data = data, .len = len, .refs = 1 };
+
+  CborParser parser;
+  CborValue value;
+  if (cbor_parser_init(data, len, 0, &parser, &value) != CborNoError ||
+      !parse_lazy_node(root, NULL, &value, source)) {
+    structure_destroy(root);
+    root = NULL;
+  }
+  structure_source_release(source);
+  return root;
+}
+
+/* Not synchronized: expanding writes to the node, see viaems-c.h. On
+ * failure anything parsed is freed and the node stays unexpanded */
+static bool structure_expand(struct structure_node *node) {
+  struct structure_source *source = node->source;
+  if (!source) {
+    return true;
+  }
+
+  CborParser parser;
+  CborValue value;
+  if (cbor_parser_init(source->data + node->offset, source->len - node->offset, 0, &parser, &value) != CborNoError) {
+    return false;
+  }
+  bool success = true;
+  if (node->type == LEAF) {
+    if (node->leaf.type == VALUE_STRING) {
+      node->leaf.choices = parse_leaf_choices(&value);
+    }
+    node->leaf.description = parse_leaf_description(&value);
+  } else if (node->type == LIST) {
+    success = parse_structure_list_into_node(node, node->path, &value, source);
+  } else if (node->type == MAP) {
+    success = parse_structure_map_into_node(node, node->path, &value, source);
+  }
+  if (success) {
+    node->source = NULL;
+    structure_source_release(source);
+  }
+  return success;
+}
+
+static bool decode_config_value(config_value_type type, CborValue *v, struct config_value *dest) {
+  *dest = (struct config_value){ .type = type };
+  switch (type) {
+    case VALUE_UINT32: {
+      uint64_t u64val;
+      if (!cbor_value_is_unsigned_integer(v) ||
+          cbor_value_get_uint64(v, &u64val) != CborNoError) {
+        return false;
+      }
+      dest->as_uint32 = u64val;
+      return true;
+    }
+    case VALUE_FLOAT:
+      if (cbor_value_is_float(v)) {
+        return cbor_value_get_float(v, &dest->as_float) == CborNoError;
+      } else if (cbor_value_is_double(v)) {
+        double dval;
+        if (cbor_value_get_double(v, &dval) != CborNoError) {
+          return false;
+        }
+        dest->as_float = dval;
+        return true;
+      }
+      return false;
+    case VALUE_BOOL:
+      return cbor_value_is_boolean(v) &&
+             cbor_value_get_boolean(v, &dest->as_bool) == CborNoError;
+    case VALUE_STRING: {
+      size_t len;
+      if (!cbor_value_is_text_string(v)) {
+        return false;
+      }
+      track_result_alloc();
+      return cbor_value_dup_text_string(v, &dest->as_string, &len, NULL) == CborNoError;
+    }
+    default:
+      return false;
+  }
+}
+
+bool config_value_equal(const struct config_value *a, const struct config_value *b) {
+  if (a->type != b->type) {
+    return false;
+  }
+  switch (a->type) {
+    case VALUE_UINT32:
+      return a->as_uint32 == b->as_uint32;
+    case VALUE_FLOAT:
+      /* Bitwise, so a NaN equals itself */
+      return memcmp(&a->as_float, &b->as_float, sizeof(float)) == 0;
+    case VALUE_BOOL:
+      return a->as_bool == b->as_bool;
+    case VALUE_STRING:
+      return a->as_string && b->as_string && strcmp(a->as_string, b->as_string) == 0;
+    default:
+      return false;
+  }
+}
+
+/* Called without request_mtx held, after the request has been taken out of
+ * the table. `response` is only used for REQUEST_OK */
+static void complete_request(struct protocol *p, struct request *req, request_status status, CborValue *response) {
+  if (req->type == SET && req->set_value.type == VALUE_STRING) {
+    string_release(p, req->set_value.as_string);
+  }
+  struct viaems_completion c = {
+    .id = req->id,
+    .userdata = req->userdata,
+    .value = { .type = VALUE_INVALID },
+  };
+  if (req->type == STRUCTURE) {
+    struct structure_node *root = NULL;
+    if (status == REQUEST_OK) {
+      if (p->lazy_structure) {
+        root = parse_lazy_structure(response);
+      } else {
+        root = result_calloc(1, sizeof(struct structure_node));
+        if (root && !parse_cbor_structure_into_node(root, NULL, response)) {
+          structure_destroy(root);
+          root = NULL;
+        }
+      }
+      if (!root) {
+        status = REQUEST_FAILED;
+      }
+    }
+    if (req->structure_cb) {
+      req->structure_cb(status, root, req->userdata);
+      return;
+    }
+    c.root = root;
+  } else if (req->type == GET || req->type == SET) {
+    struct config_value val = { .type = VALUE_INVALID };
+    if (status == REQUEST_OK &&
+        !decode_config_value(req->value_type, response, &val)) {
+      val = (struct config_value){ .type = VALUE_INVALID };
+      status = REQUEST_FAILED;
+    }
+    if (req->get_callback) {
+      req->get_callback(status, val, req->userdata);
+      return;
+    }
+    c.node = req->node;
+    c.value = val;
+  }
+  c.status = status;
+  completion_push(p, &c);
+}
+
+static bool handle_response_message(struct protocol *p, CborValue *msg) {
   CborValue cbor_id;
-  if (cbor_value_map_find_value(msg, "id", &cbor_id) != CborNoError) {
-    /* TODO: handle */
-    return;
+  if (cbor_value_map_find_value(msg, "id", &cbor_id) != CborNoError ||
+      !cbor_value_is_valid(&cbor_id)) {
+    metric_parse_error(p, PARSE_ERROR_MISSING_FIELD);
+    return false;
   }
 
-  if (!cbor_value_is_integer(&cbor_id)) {
-    return;
+  if (!cbor_value_is_unsigned_integer(&cbor_id)) {
+    metric_parse_error(p, PARSE_ERROR_BAD_FIELD);
+    return false;
   }
 
   uint64_t id;
   cbor_value_get_uint64(&cbor_id, &id);
 
+  CborValue cbor_response;
+  if (cbor_value_map_find_value(msg, "response", &cbor_response) != CborNoError ||
+      !cbor_value_is_valid(&cbor_response)) {
+    metric_parse_error(p, PARSE_ERROR_MISSING_FIELD);
+    return false;
+  }
+
   check_thrd(mtx_lock(&p->request_mtx));
-  if (!p->request.active || p->request.id != id) {
-    fprintf(stderr, "Does this happen?\n");
+  struct request *outstanding = request_lookup(p, id);
+  if (!outstanding) {
+    metric_add(&p->metrics.orphan_responses, 1);
     check_thrd(mtx_unlock(&p->request_mtx));
-    return;
+    return true;
   }
+  struct request req = request_take(p, outstanding);
+  check_thrd(mtx_unlock(&p->request_mtx));
 
-  CborValue cbor_response;
-  if (cbor_value_map_find_value(msg, "response", &cbor_response) != CborNoError) {
-    fprintf(stderr, "Does this happen2?\n");
+  histogram_record(&p->metrics.request_latency, monotonic_ns() - req.sent_ns);
+  complete_request(p, &req, REQUEST_OK, &cbor_response);
+  return true;
+}
+
+static message_type parse_message_type(CborValue *type_value) {
+  bool match;
+  cbor_value_text_string_equals(type_value, "feed", &match);
+  if (match) {
+    return MESSAGE_FEED;
+  }
+
+  cbor_value_text_string_equals(type_value, "description", &match);
+  if (match) {
+    return MESSAGE_DESCRIPTION;
+  }
+
+  cbor_value_text_string_equals(type_value, "response", &match);
+  if (match) {
+    return MESSAGE_RESPONSE;
+  }
+  return MESSAGE_UNKNOWN;
+}
+
+bool viaems_new_data(struct protocol *p, const uint8_t *data, size_t len) {
+  uint64_t start_ns = monotonic_ns();
+  CborParser parser;
+  CborValue root;
+
+  metric_add(&p->metrics.bytes_received, len);
+
+  if (cbor_parser_init(data, len, 0, &parser, &root) != CborNoError) {
+    metric_parse_error(p, PARSE_ERROR_CBOR);
+    return false;
+  }
+  if (!cbor_value_is_map(&root)) {
+    metric_parse_error(p, PARSE_ERROR_NOT_MAP);
+    return false;
+  }
+
+
+  CborValue type_value;
+  if (cbor_value_map_find_value(&root, "type", &type_value) != CborNoError ||
+      !cbor_value_is_text_string(&type_value)) {
+    metric_parse_error(p, PARSE_ERROR_NO_TYPE);
+    return false;
+  }
+
+  message_type type = parse_message_type(&type_value);
+  bool success = false;
+  decoding_protocol = p;
+  decoding_type = type;
+  switch (type) {
+    case MESSAGE_FEED:
+      success = handle_feed_message(p, &root);
+      break;
+    case MESSAGE_DESCRIPTION:
+      success = handle_desc_message(p, &root);
+      break;
+    case MESSAGE_RESPONSE:
+      success = handle_response_message(p, &root);
+      break;
+    default:
+      metric_parse_error(p, PARSE_ERROR_UNKNOWN_TYPE);
+      break;
+  }
+  decoding_protocol = NULL;
+
+  metric_add(&p->metrics.messages[type], 1);
+  metric_add(&p->metrics.message_bytes[type], len);
+  histogram_record(&p->metrics.decode_time[type], monotonic_ns() - start_ns);
+  return success;
+}
+
+/* Converts a relative wait into the TIME_UTC based absolute time that
+ * cnd_timedwait wants. Deadlines themselves stay on CLOCK_MONOTONIC and are
+ * rechecked after every wakeup, so a wall clock step only moves a wakeup */
+static struct timespec time_ns_from_now(uint64_t ns) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ns / 1000000000;
+  ts.tv_nsec += ns % 1000000000;
+  while (ts.tv_nsec >= 1000000000) {
+    ts.tv_nsec -= 1000000000;
+    ts.tv_sec += 1;
+  }
+  return ts;
+}
+
+static int deadline_loop(void *ptr) {
+  struct protocol *p = ptr;
+
+  check_thrd(mtx_lock(&p->request_mtx));
+  while (p->running) {
+    if (p->n_deadlines == 0) {
+      check_thrd(cnd_wait(&p->deadline_cnd, &p->request_mtx));
+      continue;
+    }
+
+    uint64_t now = monotonic_ns();
+    struct request *earliest = &p->requests[p->deadline_heap[0]];
+    if (earliest->deadline_ns > now) {
+      struct timespec ts = time_ns_from_now(earliest->deadline_ns - now);
+      cnd_timedwait(&p->deadline_cnd, &p->request_mtx, &ts);
+      continue;
+    }
+
+    struct request req = request_take(p, earliest);
     check_thrd(mtx_unlock(&p->request_mtx));
-    return;
+    metric_add(&p->metrics.timeouts, 1);
+    complete_request(p, &req, REQUEST_TIMEOUT, NULL);
+    check_thrd(mtx_lock(&p->request_mtx));
+  }
+  check_thrd(mtx_unlock(&p->request_mtx));
+  return 0;
+}
+
+bool viaems_cancel_request(struct protocol *p, uint32_t id) {
+  check_thrd(mtx_lock(&p->request_mtx));
+  struct request *outstanding = request_lookup(p, id);
+  if (!outstanding) {
+    check_thrd(mtx_unlock(&p->request_mtx));
+    return false;
+  }
+  struct request req = request_take(p, outstanding);
+  check_thrd(mtx_unlock(&p->request_mtx));
+
+  complete_request(p, &req, REQUEST_CANCELLED, NULL);
+  return true;
+}
+
+void viaems_offer_packed_feed(struct protocol *p) {
+  uint8_t buf[64];
+  CborEncoder encoder;
+  cbor_encoder_init(&encoder, buf, sizeof(buf), 0);
+
+  CborEncoder map_encoder;
+  cbor_encoder_create_map(&encoder, &map_encoder, 2);
+  cbor_encode_text_stringz(&map_encoder, "type");
+  cbor_encode_text_stringz(&map_encoder, "feed_encoding");
+  cbor_encode_text_stringz(&map_encoder, "encoding");
+  cbor_encode_text_stringz(&map_encoder, "packed");
+  cbor_encoder_close_container(&encoder, &map_encoder);
+  protocol_write(p, buf, cbor_encoder_get_buffer_size(&encoder, buf));
+}
+
+size_t viaems_encode_description(uint8_t *buf, size_t len, size_t n_fields, const struct field_key *keys) {
+  CborEncoder encoder;
+  cbor_encoder_init(&encoder, buf, len, 0);
+
+  CborEncoder map_encoder, array_encoder;
+  cbor_encoder_create_map(&encoder, &map_encoder, 3);
+  cbor_encode_text_stringz(&map_encoder, "type");
+  cbor_encode_text_stringz(&map_encoder, "description");
+  cbor_encode_text_stringz(&map_encoder, "keys");
+  cbor_encoder_create_array(&map_encoder, &array_encoder, n_fields);
+  for (size_t i = 0; i < n_fields; i++) {
+    cbor_encode_text_stringz(&array_encoder, keys[i].name);
+  }
+  cbor_encoder_close_container(&map_encoder, &array_encoder);
+  cbor_encode_text_stringz(&map_encoder, "types");
+  cbor_encoder_create_array(&map_encoder, &array_encoder, n_fields);
+  for (size_t i = 0; i < n_fields; i++) {
+    cbor_encode_text_stringz(&array_encoder, keys[i].type == FIELD_FLOAT ? "float" : "uint32");
+  }
+  cbor_encoder_close_container(&map_encoder, &array_encoder);
+  cbor_encoder_close_container(&encoder, &map_encoder);
+
+  if (cbor_encoder_get_extra_bytes_needed(&encoder) > 0) {
+    return 0;
+  }
+  return cbor_encoder_get_buffer_size(&encoder, buf);
+}
+
+size_t viaems_encode_feed(uint8_t *buf, size_t len, size_t n_fields, const struct field_key *keys, const union field_value *values, bool packed) {
+  CborEncoder encoder;
+  cbor_encoder_init(&encoder, buf, len, 0);
+
+  CborEncoder map_encoder;
+  cbor_encoder_create_map(&encoder, &map_encoder, 2);
+  cbor_encode_text_stringz(&map_encoder, "type");
+  cbor_encode_text_stringz(&map_encoder, "feed");
+  cbor_encode_text_stringz(&map_encoder, "values");
+  if (packed) {
+    uint8_t words[256 * sizeof(union field_value)];
+    uint8_t *dest = n_fields <= 256 ? words : malloc(n_fields * sizeof(union field_value));
+    if (!dest) {
+      return 0;
+    }
+    for (size_t i = 0; i < n_fields; i++) {
+      uint32_t word = values[i].as_uint32;
+      dest[i * 4 + 0] = word;
+      dest[i * 4 + 1] = word >> 8;
+      dest[i * 4 + 2] = word >> 16;
+      dest[i * 4 + 3] = word >> 24;
+    }
+    cbor_encode_byte_string(&map_encoder, dest, n_fields * sizeof(union field_value));
+    if (dest != words) {
+      free(dest);
+    }
+  } else {
+    CborEncoder array_encoder;
+    cbor_encoder_create_array(&map_encoder, &array_encoder, n_fields);
+    for (size_t i = 0; i < n_fields; i++) {
+      if (keys[i].type == FIELD_FLOAT) {
+        cbor_encode_float(&array_encoder, values[i].as_float);
+      } else {
+        cbor_encode_uint(&array_encoder, values[i].as_uint32);
+      }
+    }
+    cbor_encoder_close_container(&map_encoder, &array_encoder);
+  }
+  cbor_encoder_close_container(&encoder, &map_encoder);
+
+  if (cbor_encoder_get_extra_bytes_needed(&encoder) > 0) {
+    return 0;
+  }
+  return cbor_encoder_get_buffer_size(&encoder, buf);
+}
+
+#define STRUCTURE_REQUEST_MAX_LEN 64
+
+static size_t encode_structure_request(uint8_t buf[STRUCTURE_REQUEST_MAX_LEN], uint32_t id) {
+  CborEncoder encoder;
+  cbor_encoder_init(&encoder, buf, STRUCTURE_REQUEST_MAX_LEN, 0);
+
+  CborEncoder map_encoder;
+  cbor_encoder_create_map(&encoder, &map_encoder, 3);
+  cbor_encode_text_stringz(&map_encoder, "type");
+  cbor_encode_text_stringz(&map_encoder, "request");
+  cbor_encode_text_stringz(&map_encoder, "method");
+  cbor_encode_text_stringz(&map_encoder, "structure");
+  cbor_encode_text_stringz(&map_encoder, "id");
+  cbor_encode_int(&map_encoder, id);
+  cbor_encoder_close_container(&encoder, &map_encoder);
+  assert(cbor_encoder_get_extra_bytes_needed(&encoder) == 0);
+  return cbor_encoder_get_buffer_size(&encoder, buf);
+}
+
+uint32_t viaems_get_structure_async(struct protocol *p, structure_callback callback, void *userdata) {
+
+  check_thrd(mtx_lock(&p->request_mtx));
+  if (!callback && !completion_reserve(p)) {
+    check_thrd(mtx_unlock(&p->request_mtx));
+    return 0;
   }
-
-  if (p->request.type == STRUCTURE) {
-    struct structure_node *root = malloc(sizeof(struct structure_node));;
-    parse_cbor_structure_into_node(root, NULL, &cbor_response);
-    p->request.structure_cb(root, p->request.userdata);
-  } else if (p->request.type == GET) {
-    switch (p->request.node->leaf.type) {
-      case VALUE_UINT32: {
-        struct config_value val = {.type = VALUE_UINT32 };
-        uint64_t u64val;
-        cbor_value_get_uint64(&cbor_response, &u64val);
-        val.as_uint32 = u64val;
-        p->request.get_callback(val, p->request.userdata);
-      default:
-                         }
+  struct request *req = request_alloc(p, STRUCTURE);
+  if (!req) {
+    if (!callback) {
+      p->n_completions_reserved -= 1;
     }
-  }
-
-    p->request.active = false;
     check_thrd(mtx_unlock(&p->request_mtx));
+    return 0;
+  }
+  req->structure_cb = callback;
+  req->userdata = userdata;
+  uint32_t id = req->id;
+  check_thrd(mtx_unlock(&p->request_mtx));
 
+  uint8_t buf[STRUCTURE_REQUEST_MAX_LEN];
+  protocol_write(p, buf, encode_structure_request(buf, id));
+  return id;
 }
 
-bool viaems_new_data(struct protocol *p, const uint8_t *data, size_t len) {
-  CborParser parser;
-  CborValue root;
+/* "value" key, then at most a 9 byte header and, except for strings, the
+ * value */
+#define LEAF_VALUE_MAX_LEN (6 + 9)
+
+/* A leaf request as pieces around the leaf's skeleton, pointing into the
+ * scratch fields here */
+struct leaf_message {
+  uint8_t map_header;
+  uint8_t id_bytes[REQUEST_ID_LEN];
+  uint8_t value_buf[LEAF_VALUE_MAX_LEN];
+  struct iovec iov[7];
+  int iovcnt;
+};
 
-  if (cbor_parser_init(data, len, 0, &parser, &root) != CborNoError) {
-    return false;
-  }
-  if (!cbor_value_is_map(&root)) {
-    return false;
+static bool encode_config_value(CborEncoder *encoder, struct config_value value) {
+  switch (value.type) {
+    case VALUE_UINT32:
+      return cbor_encode_uint(encoder, value.as_uint32) == CborNoError;
+    case VALUE_FLOAT:
+      return cbor_encode_float(encoder, value.as_float) == CborNoError;
+    case VALUE_BOOL:
+      return cbor_encode_boolean(encoder, value.as_bool) == CborNoError;
+    case VALUE_STRING:
+      return value.as_string &&
+             cbor_encode_text_stringz(encoder, value.as_string) == CborNoError;
+    default:
+      return false;
   }
+}
 
-
-  CborValue type_value;
-  if (cbor_value_map_find_value(&root, "type", &type_value) != CborNoError) {
-    return false;
+/* Header of a definite length text string, at most 9 bytes */
+static size_t encode_text_string_header(uint8_t *dest, uint64_t len) {
+  const uint8_t major = 3 << 5;
+  if (len < 24) {
+    dest[0] = major | len;
+    return 1;
   }
-
-  bool is_feed;
-  cbor_value_text_string_equals(&type_value, "feed", &is_feed);
-  if (is_feed) {
-    handle_feed_message(p, &root);
-    return true;
+  int n_bytes = len <= UINT8_MAX ? 1 : len <= UINT16_MAX ? 2 : len <= UINT32_MAX ? 4 : 8;
+  dest[0] = major | (n_bytes == 1 ? 24 : n_bytes == 2 ? 25 : n_bytes == 4 ? 26 : 27);
+  for (int i = 0; i < n_bytes; i++) {
+    dest[1 + i] = len >> (8 * (n_bytes - 1 - i));
   }
+  return 1 + n_bytes;
+}
 
-  bool is_description;
-  cbor_value_text_string_equals(&type_value, "description", &is_description);
-  if (is_description) {
-    handle_desc_message(p, &root);
+static bool build_leaf_message(const struct structure_leaf *leaf, request_type type, struct config_value value, struct leaf_message *m) {
+  size_t skeleton_len = leaf->request_len - REQUEST_ID_LEN;
+  if (type == GET) {
+    m->iov[0] = (struct iovec){ .iov_base = leaf->request, .iov_len = skeleton_len };
+    m->iov[1] = (struct iovec){ .iov_base = m->id_bytes, .iov_len = REQUEST_ID_LEN };
+    m->iovcnt = 2;
     return true;
   }
 
-  bool is_response;
-  cbor_value_text_string_equals(&type_value, "response", &is_response);
-  if (is_response) {
-    handle_response_message(p, &root);
-    return true;
+  /* "value" key, then the value or, for a string, only its header so that
+   * the string itself is sent from the caller's memory */
+  size_t value_len;
+  size_t string_len = 0;
+  CborEncoder encoder;
+  cbor_encoder_init(&encoder, m->value_buf, sizeof(m->value_buf), 0);
+  cbor_encode_text_stringz(&encoder, "value");
+  if (value.type == VALUE_STRING) {
+    value_len = cbor_encoder_get_buffer_size(&encoder, m->value_buf);
+    string_len = strlen(value.as_string);
+    value_len += encode_text_string_header(m->value_buf + value_len, string_len);
+  } else {
+    if (!encode_config_value(&encoder, value)) {
+      return false;
+    }
+    value_len = cbor_encoder_get_buffer_size(&encoder, m->value_buf);
   }
-  return false;
-}
 
-static void blocking_structure_callback(struct structure_node *root, void *userdata) {
-  struct protocol *proto = userdata;
-  proto->request.node = root;
-  check_thrd(cnd_signal(&proto->request_wakeup_cnd));
+  m->map_header = leaf->request[0] + 1; /* Map of four entries becomes five */
+  size_t method_end = REQUEST_METHOD_OFFSET + 3;
+  m->iov[0] = (struct iovec){ .iov_base = &m->map_header, .iov_len = 1 };
+  m->iov[1] = (struct iovec){ .iov_base = leaf->request + 1, .iov_len = REQUEST_METHOD_OFFSET - 1 };
+  m->iov[2] = (struct iovec){ .iov_base = "set", .iov_len = 3 };
+  m->iov[3] = (struct iovec){ .iov_base = leaf->request + method_end, .iov_len = skeleton_len - method_end };
+  m->iov[4] = (struct iovec){ .iov_base = m->id_bytes, .iov_len = REQUEST_ID_LEN };
+  m->iov[5] = (struct iovec){ .iov_base = m->value_buf, .iov_len = value_len };
+  m->iov[6] = (struct iovec){ .iov_base = value.as_string, .iov_len = string_len };
+  m->iovcnt = string_len > 0 ? 7 : 6;
+  return true;
 }
 
-static uint32_t global_id = 1;
-
-bool viaems_get_structure_async(struct protocol *p, structure_callback callback, void *userdata) {
+/* Registers a leaf request and sends it. A set keeps `stored`, its value
+ * with any string already copied, for replay */
+static uint32_t send_leaf_request(struct protocol *p, request_type type, struct structure_node *node, struct config_value value, struct config_value stored, get_callback cb, void *ud) {
+  struct leaf_message m;
+  if (!build_leaf_message(&node->leaf, type, value, &m)) {
+    return 0;
+  }
 
   check_thrd(mtx_lock(&p->request_mtx));
-  p->request = (struct request){
-    .active = true,
-    .type = STRUCTURE,
-    .id = global_id++,
-    .structure_cb = callback,
-    .userdata = userdata,
-  };
-
+  if (!cb && !completion_reserve(p)) {
+    check_thrd(mtx_unlock(&p->request_mtx));
+    return 0;
+  }
+  struct request *req = request_alloc(p, type);
+  if (!req) {
+    if (!cb) {
+      p->n_completions_reserved -= 1;
+    }
+    check_thrd(mtx_unlock(&p->request_mtx));
+    return 0;
+  }
+  req->node = node;
+  req->skeleton = request_skeleton_retain(request_skeleton_of(node->leaf.request));
+  req->value_type = node->leaf.type;
+  req->set_value = stored;
+  req->get_callback = cb;
+  req->userdata = ud;
+  uint32_t id = req->id;
   check_thrd(mtx_unlock(&p->request_mtx));
 
-  uint8_t buf[512];
-  CborEncoder encoder;
-  cbor_encoder_init(&encoder, buf, sizeof(buf), 0);
-
-  CborEncoder map_encoder;
-  cbor_encoder_create_map(&encoder, &map_encoder, 3);
-  cbor_encode_text_stringz(&map_encoder, "type");
-  cbor_encode_text_stringz(&map_encoder, "request");
-  cbor_encode_text_stringz(&map_encoder, "method");
-  cbor_encode_text_stringz(&map_encoder, "structure");
-  cbor_encode_text_stringz(&map_encoder, "id");
-  cbor_encode_int(&map_encoder, p->request.id);
-  cbor_encoder_close_container(&encoder, &map_encoder);
-  size_t written_size = cbor_encoder_get_buffer_size(&encoder, buf);
-  if (p->write) {
-    p->write(p->write_userdata, buf, written_size);
-  }
-  return true;
+  encode_request_id(m.id_bytes, id);
+  protocol_writev(p, m.iov, m.iovcnt);
+  return id;
 }
 
-static struct timespec time_ms_from_now(int ms) {
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
-  ts.tv_nsec += (ms * 1000000);
-  while (ts.tv_nsec >= 1000000000) {
-    ts.tv_nsec -= 1000000000;
-    ts.tv_sec += 1;
+uint32_t viaems_send_get_async(struct protocol *p, struct structure_node *node, get_callback cb, void *ud) {
+  if (node->type != LEAF || !node->leaf.request) {
+    return 0;
   }
-  return ts;
+  struct config_value none = { .type = VALUE_INVALID };
+  return send_leaf_request(p, GET, node, none, none, cb, ud);
 }
 
-bool viaems_get_structure(struct protocol *p, struct structure_node **res) {
-
-  check_thrd(mtx_lock(&p->request_client_mtx));
+uint32_t viaems_send_set_async(struct protocol *p, struct structure_node *node, struct config_value value, get_callback cb, void *ud) {
+  if (node->type != LEAF || !node->leaf.request || value.type != node->leaf.type ||
+      (value.type == VALUE_STRING && !value.as_string)) {
+    return 0;
+  }
 
-  size_t timeout_ms = 1000;
-  struct timespec ts = time_ms_from_now(timeout_ms);
-  viaems_get_structure_async(p, blocking_structure_callback, p);
+  struct config_value stored = value;
+  if (value.type == VALUE_STRING) {
+    stored.as_string = string_copy(p, value.as_string);
+    if (!stored.as_string) {
+      return 0;
+    }
+  }
+  uint32_t id = send_leaf_request(p, SET, node, value, stored, cb, ud);
+  if (id == 0 && stored.type == VALUE_STRING) {
+    string_release(p, stored.as_string);
+  }
+  return id;
+}
 
+bool viaems_replay_requests(struct protocol *p) {
   check_thrd(mtx_lock(&p->request_mtx));
-  while (p->request.active) {
-    if (cnd_timedwait(&p->request_wakeup_cnd, &p->request_mtx, &ts) == thrd_timedout) {
-    p->request.active = false;
+  size_t n = p->n_deadlines;
+  size_t capacity = 0;
+  for (size_t i = 0; i < n; i++) {
+    const struct request *req = &p->requests[p->deadline_heap[i]];
+    if (req->type == STRUCTURE) {
+      capacity += STRUCTURE_REQUEST_MAX_LEN;
+    } else {
+      capacity += req->skeleton->len + LEAF_VALUE_MAX_LEN;
+      if (req->type == SET && req->set_value.type == VALUE_STRING) {
+        capacity += strlen(req->set_value.as_string);
+      }
+    }
+  }
+
+  /* Encode everything under the lock, from the skeletons the requests kept,
+   * and send once it is dropped */
+  struct encode_buffer out;
+  size_t *lengths = protocol_alloc(p, (n ? n : 1) * sizeof(size_t));
+  if (!lengths || !encode_buffer_get(p, capacity ? capacity : 1, &out)) {
     check_thrd(mtx_unlock(&p->request_mtx));
-    check_thrd(mtx_unlock(&p->request_client_mtx));
+    protocol_free(p, lengths, (n ? n : 1) * sizeof(size_t));
     return false;
+  }
+
+  uint64_t now = monotonic_ns();
+  size_t pos = 0;
+  for (size_t i = 0; i < n; i++) {
+    struct request *req = &p->requests[p->deadline_heap[i]];
+    size_t start = pos;
+    if (req->type == STRUCTURE) {
+      pos += encode_structure_request(out.data + pos, req->id);
+    } else {
+      struct structure_leaf leaf = { .request = req->skeleton->data, .request_len = req->skeleton->len };
+      struct leaf_message m;
+      build_leaf_message(&leaf, req->type, req->set_value, &m);
+      encode_request_id(m.id_bytes, req->id);
+      for (int v = 0; v < m.iovcnt; v++) {
+        memcpy(out.data + pos, m.iov[v].iov_base, m.iov[v].iov_len);
+        pos += m.iov[v].iov_len;
+      }
     }
+    lengths[i] = pos - start;
 
+    /* A fresh timeout, and with every deadline equal the heap stays valid */
+    req->sent_ns = now;
+    req->deadline_ns = now + (uint64_t)p->request_timeout_ms * 1000000;
   }
-  *res = p->request.node;
   check_thrd(mtx_unlock(&p->request_mtx));
-  check_thrd(mtx_unlock(&p->request_client_mtx));
 
+  pos = 0;
+  for (size_t i = 0; i < n; i++) {
+    protocol_write(p, out.data + pos, lengths[i]);
+    pos += lengths[i];
+  }
+  encode_buffer_put(p, &out);
+  protocol_free(p, lengths, (n ? n : 1) * sizeof(size_t));
   return true;
 }
 
-bool viaems_send_get_async(struct protocol *p, struct structure_node *node, get_callback cb, void *ud) {
-  if (node->type != LEAF) {
-    return false;
-  }
+/* Blocking calls park on their own condition variable, under request_mtx,
+ * until the async callback fires. The deadline thread guarantees that it
+ * always does, so no timed wait is needed here */
+struct blocking_request {
+  struct protocol *p;
+  cnd_t wakeup_cnd;
+  bool done;
+  request_status status;
+  struct config_value value;
+  struct structure_node *root;
+};
 
-  check_thrd(mtx_lock(&p->request_mtx));
-  p->request = (struct request){
-    .active = true,
-    .type = GET,
-    .node = node,
-    .id = global_id++,
-    .get_callback = cb,
-    .userdata = ud,
-  };
-  check_thrd(mtx_unlock(&p->request_mtx));
+static void blocking_request_init(struct blocking_request *b, struct protocol *p) {
+  *b = (struct blocking_request){ .p = p };
+  check_thrd(cnd_init(&b->wakeup_cnd));
+}
 
-  uint8_t buf[512];
-  CborEncoder encoder;
-  cbor_encoder_init(&encoder, buf, sizeof(buf), 0);
+static void blocking_request_finish(struct blocking_request *b) {
+  check_thrd(mtx_lock(&b->p->request_mtx));
+  b->done = true;
+  check_thrd(cnd_signal(&b->wakeup_cnd));
+  check_thrd(mtx_unlock(&b->p->request_mtx));
+}
 
-  CborEncoder map_encoder;
-  cbor_encoder_create_map(&encoder, &map_encoder, 4);
-  cbor_encode_text_stringz(&map_encoder, "type");
-  cbor_encode_text_stringz(&map_encoder, "request");
-  cbor_encode_text_stringz(&map_encoder, "method");
-  cbor_encode_text_stringz(&map_encoder, "get");
-  cbor_encode_text_stringz(&map_encoder, "id");
-  cbor_encode_int(&map_encoder, p->request.id);
-  cbor_encode_text_stringz(&map_encoder, "path");
+static request_status blocking_request_wait(struct blocking_request *b) {
+  check_thrd(mtx_lock(&b->p->request_mtx));
+  while (!b->done) {
+    check_thrd(cnd_wait(&b->wakeup_cnd, &b->p->request_mtx));
+  }
+  check_thrd(mtx_unlock(&b->p->request_mtx));
+  cnd_destroy(&b->wakeup_cnd);
+  return b->status;
+}
 
-  CborEncoder cbor_path;
-  cbor_encoder_create_array(&map_encoder, &cbor_path, CborIndefiniteLength);
-  for (struct path_element **i = node->path; *i != NULL; i++) {
-    if ((*i)->type == PATH_IDX) {
-      cbor_encode_int(&cbor_path, (*i)->idx);
-    } else if ((*i)->type == PATH_STR) {
-      cbor_encode_text_stringz(&cbor_path, (*i)->str);
-    }
+static void blocking_structure_callback(request_status status, struct structure_node *root, void *userdata) {
+  struct blocking_request *b = userdata;
+  b->status = status;
+  b->root = root;
+  blocking_request_finish(b);
+}
+
+bool viaems_get_structure(struct protocol *p, struct structure_node **res) {
+  struct blocking_request b;
+  blocking_request_init(&b, p);
+  if (!viaems_get_structure_async(p, blocking_structure_callback, &b)) {
+    cnd_destroy(&b.wakeup_cnd);
+    return false;
   }
-  cbor_encoder_close_container(&map_encoder, &cbor_path);
-  cbor_encoder_close_container(&encoder, &map_encoder);
-  size_t written_size = cbor_encoder_get_buffer_size(&encoder, buf);
-  if (p->write) {
-    p->write(p->write_userdata, buf, written_size);
+  if (blocking_request_wait(&b) != REQUEST_OK) {
+    return false;
   }
+  *res = b.root;
   return true;
 }
 
-static void blocking_get_callback(struct config_value value, void *userdata) {
-  struct protocol *proto = userdata;
-  proto->request.value = value;
-  cnd_signal(&proto->request_wakeup_cnd);
+static void blocking_get_callback(request_status status, struct config_value value, void *userdata) {
+  struct blocking_request *b = userdata;
+  b->status = status;
+  b->value = value;
+  blocking_request_finish(b);
 }
 
 bool viaems_send_get(struct protocol *p, struct structure_node *node, struct config_value *dest) {
-  check_thrd(mtx_lock(&p->request_client_mtx));
-  size_t timeout_ms = 1000;
-  struct timespec ts = time_ms_from_now(timeout_ms);
-
-  viaems_send_get_async(p, node, blocking_get_callback, p);
+  struct blocking_request b;
+  blocking_request_init(&b, p);
+  if (!viaems_send_get_async(p, node, blocking_get_callback, &b)) {
+    cnd_destroy(&b.wakeup_cnd);
+    return false;
+  }
+  if (blocking_request_wait(&b) != REQUEST_OK) {
+    return false;
+  }
+  *dest = b.value;
+  return true;
+}
 
-  check_thrd(mtx_lock(&p->request_mtx));
-  while (p->request.active) {
-    if (cnd_timedwait(&p->request_wakeup_cnd, &p->request_mtx, &ts) == thrd_timedout) {
-      p->request.active = false;
-      check_thrd(mtx_unlock(&p->request_mtx));
-      check_thrd(mtx_unlock(&p->request_client_mtx));
-      return false;
-    }
+bool viaems_refresh_structure(struct protocol *p, struct structure_node *root, struct structure_diff *diff) {
+  struct structure_node *update;
+  if (!viaems_get_structure(p, &update)) {
+    return false;
   }
-  *dest = p->request.value;
-  check_thrd(mtx_unlock(&p->request_mtx));
-  check_thrd(mtx_unlock(&p->request_client_mtx));
+  return structure_merge(root, update, diff);
+}
 
+bool viaems_send_set(struct protocol *p, struct structure_node *node, struct config_value value, struct config_value *result) {
+  struct blocking_request b;
+  blocking_request_init(&b, p);
+  if (!viaems_send_set_async(p, node, value, blocking_get_callback, &b)) {
+    cnd_destroy(&b.wakeup_cnd);
+    return false;
+  }
+  if (blocking_request_wait(&b) != REQUEST_OK) {
+    return false;
+  }
+  if (result) {
+    *result = b.value;
+  } else if (b.value.type == VALUE_STRING) {
+    free(b.value.as_string);
+  }
   return true;
 }
 
 
 static void structure_destroy_child(struct structure_node *node) {
+  if (node->source) {
+    structure_source_release(node->source);
+  }
   if (node->path) {
     for (struct path_element **p = node->path; *p != NULL; p++) {
       free(*p);
@@ -693,6 +2440,9 @@ static void structure_destroy_child(struct structure_node *node) {
     free(node->path);
   }
   if (node->type == LEAF) {
+    if (node->leaf.request) {
+      request_skeleton_release(request_skeleton_of(node->leaf.request));
+    }
     if (node->leaf.description) {
       free(node->leaf.description);
     }
@@ -720,8 +2470,319 @@ static void structure_destroy_child(struct structure_node *node) {
 }
 
 void structure_destroy(struct structure_node *node) {
+  if (!node) {
+    return;
+  }
   structure_destroy_child(node);
   free(node);
 }
 
+bool structure_node_is_list(struct structure_node *node) {
+  return node->type == LIST;
+}
+
+bool structure_node_is_map(struct structure_node *node) {
+  return node->type == MAP;
+}
+
+bool structure_node_is_leaf(struct structure_node *node) {
+  return node->type == LEAF;
+}
+
+size_t structure_node_len(struct structure_node *node) {
+  if (node->type == LEAF || !structure_expand(node)) {
+    return 0;
+  }
+  return node->type == LIST ? node->list.len : node->map.len;
+}
+
+struct structure_node *structure_node_child(struct structure_node *node, size_t i) {
+  if (i >= structure_node_len(node)) {
+    return NULL;
+  }
+  return node->type == LIST ? &node->list.list[i] : &node->map.list[i];
+}
+
+const char *structure_node_child_name(struct structure_node *node, size_t i) {
+  if (node->type != MAP || i >= structure_node_len(node)) {
+    return NULL;
+  }
+  return node->map.names[i];
+}
+
+const char *structure_leaf_description(struct structure_node *node) {
+  if (node->type != LEAF || !structure_expand(node)) {
+    return NULL;
+  }
+  return node->leaf.description;
+}
+
+char **structure_leaf_choices(struct structure_node *node) {
+  if (node->type != LEAF || !structure_expand(node)) {
+    return NULL;
+  }
+  return node->leaf.choices;
+}
+
+bool structure_expand_all(struct structure_node *node) {
+  if (!structure_expand(node)) {
+    return false;
+  }
+  size_t len = node->type == LIST ? node->list.len :
+               node->type == MAP ? node->map.len : 0;
+  for (size_t i = 0; i < len; i++) {
+    if (!structure_expand_all(structure_node_child(node, i))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Path elements are separated by '/', list elements are decimal indices */
+struct structure_node *structure_find_node(struct structure_node *root, const char *path) {
+  struct structure_node *node = root;
+  const char *element = path;
+  while (node && *element) {
+    size_t len = strcspn(element, "/");
+    size_t n_children = structure_node_len(node);
+    struct structure_node *next = NULL;
+    if (node->type == LIST) {
+      char *end;
+      unsigned long idx = strtoul(element, &end, 10);
+      if (end == element + len && idx < n_children) {
+        next = structure_node_child(node, idx);
+      }
+    } else if (node->type == MAP) {
+      for (size_t i = 0; i < n_children; i++) {
+        const char *name = node->map.names[i];
+        if (strncmp(name, element, len) == 0 && name[len] == '\0') {
+          next = structure_node_child(node, i);
+          break;
+        }
+      }
+    }
+    node = next;
+    element += len;
+    if (*element == '/') {
+      element++;
+    }
+  }
+  return node;
+}
+
+
+
+static bool diff_add(struct structure_diff *diff, structure_change_type type, struct structure_node *node, struct structure_node *old_node) {
+  if (diff->len == diff->capacity) {
+    size_t capacity = diff->capacity ? diff->capacity * 2 : 16;
+    struct structure_change *changes = realloc(diff->changes, capacity * sizeof(struct structure_change));
+    if (!changes) {
+      return false;
+    }
+    diff->changes = changes;
+    diff->capacity = capacity;
+  }
+  diff->changes[diff->len++] = (struct structure_change){
+    .type = type,
+    .node = node,
+    .old_node = old_node,
+  };
+  return true;
+}
+
+void structure_diff_free(struct structure_diff *diff) {
+  free(diff->changes);
+  *diff = (struct structure_diff){ 0 };
+}
+
+static size_t path_length(struct path_element **path) {
+  size_t len = 0;
+  for (struct path_element **p = path; p && *p != NULL; p++) {
+    len++;
+  }
+  return len;
+}
+
+/* Path strings point into the names of ancestor maps. A subtree taken from
+ * the update must point into the names of the tree it now lives in */
+static void rebase_paths(struct structure_node *node, struct path_element **prefix, size_t prefix_len) {
+  if (node->path) {
+    for (size_t i = 0; i < prefix_len; i++) {
+      *node->path[i] = *prefix[i];
+    }
+  }
+  if (node->type == LIST) {
+    for (size_t i = 0; i < node->list.len; i++) {
+      rebase_paths(&node->list.list[i], prefix, prefix_len);
+    }
+  } else if (node->type == MAP) {
+    for (size_t i = 0; i < node->map.len; i++) {
+      rebase_paths(&node->map.list[i], prefix, prefix_len);
+    }
+  }
+}
+
+static bool strings_equal(const char *a, const char *b) {
+  if (!a || !b) {
+    return a == b;
+  }
+  return strcmp(a, b) == 0;
+}
+
+static bool leaf_details_equal(const struct structure_leaf *a, const struct structure_leaf *b) {
+  if (!strings_equal(a->description, b->description)) {
+    return false;
+  }
+  if (!a->choices || !b->choices) {
+    return a->choices == b->choices;
+  }
+  size_t i;
+  for (i = 0; a->choices[i] && b->choices[i]; i++) {
+    if (strcmp(a->choices[i], b->choices[i]) != 0) {
+      return false;
+    }
+  }
+  return !a->choices[i] && !b->choices[i];
+}
+
+/* Swap everything but the path, leaving the old contents in update to be
+ * destroyed with it */
+static void replace_node(struct structure_node *node, struct structure_node *update) {
+  struct structure_node contents = *node;
+  *node = *update;
+  node->path = contents.path;
+  contents.path = update->path;
+  *update = contents;
+  rebase_paths(node, node->path, path_length(node->path));
+}
+
+static bool merge_node(struct structure_node *node, struct structure_node *update, struct structure_diff *diff);
+
+static bool children_same_shape(const struct structure_node *node, const struct structure_node *update) {
+  if (node->type == LIST) {
+    return node->list.len == update->list.len;
+  }
+  if (node->map.len != update->map.len) {
+    return false;
+  }
+  for (size_t i = 0; i < node->map.len; i++) {
+    if (strcmp(node->map.names[i], update->map.names[i]) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int find_matching_child(const struct structure_node *node, const struct structure_node *update, size_t idx) {
+  if (node->type == LIST) {
+    return idx < node->list.len ? (int)idx : -1;
+  }
+  for (size_t i = 0; i < node->map.len; i++) {
+    if (strcmp(node->map.names[i], update->map.names[idx]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool reshape_container(struct structure_node *node, struct structure_node *update, struct structure_diff *diff) {
+  bool is_map = node->type == MAP;
+  /* list and map share the len and list members */
+  size_t old_len = node->list.len;
+  struct structure_node *old_list = node->list.list;
+  size_t len = update->list.len;
+  struct structure_node *update_list = update->list.list;
+
+  struct structure_node *list = calloc(len ? len : 1, sizeof(struct structure_node));
+  char **names = is_map ? calloc(len ? len : 1, sizeof(char *)) : NULL;
+  bool *kept = calloc(old_len ? old_len : 1, sizeof(bool));
+  if (!list || (is_map && !names) || !kept) {
+    free(list);
+    free(names);
+    free(kept);
+    return false;
+  }
+
+  bool success = true;
+  size_t prefix_len = path_length(node->path);
+  for (size_t i = 0; i < len; i++) {
+    int match = find_matching_child(node, update, i);
+    if (match >= 0) {
+      list[i] = old_list[match];
+      kept[match] = true;
+      if (is_map) {
+        names[i] = node->map.names[match];
+      }
+      success &= diff_add(diff, STRUCTURE_MOVED, &list[i], &old_list[match]);
+      success &= merge_node(&list[i], &update_list[i], diff);
+    } else {
+      list[i] = update_list[i];
+      update_list[i] = (struct structure_node){ 0 };
+      if (is_map) {
+        names[i] = update->map.names[i];
+        update->map.names[i] = NULL;
+      }
+      rebase_paths(&list[i], node->path, prefix_len);
+      success &= diff_add(diff, STRUCTURE_ADDED, &list[i], NULL);
+    }
+  }
+
+  for (size_t i = 0; i < old_len; i++) {
+    if (!kept[i]) {
+      success &= diff_add(diff, STRUCTURE_REMOVED, &old_list[i], NULL);
+      structure_destroy_child(&old_list[i]);
+      if (is_map) {
+        free(node->map.names[i]);
+      }
+    }
+  }
+  free(kept);
+  free(old_list);
+  node->list.list = list;
+  node->list.len = len;
+  if (is_map) {
+    free(node->map.names);
+    node->map.names = names;
+  }
+  return success;
+}
+
+static bool merge_node(struct structure_node *node, struct structure_node *update, struct structure_diff *diff) {
+  if (node->type != update->type ||
+      (node->type == LEAF && node->leaf.type != update->leaf.type)) {
+    replace_node(node, update);
+    return diff_add(diff, STRUCTURE_CHANGED, node, NULL);
+  }
+
+  if (node->type == LEAF) {
+    if (leaf_details_equal(&node->leaf, &update->leaf)) {
+      return true;
+    }
+    char *description = node->leaf.description;
+    char **choices = node->leaf.choices;
+    node->leaf.description = update->leaf.description;
+    node->leaf.choices = update->leaf.choices;
+    update->leaf.description = description;
+    update->leaf.choices = choices;
+    return diff_add(diff, STRUCTURE_CHANGED, node, NULL);
+  }
+
+  if (!children_same_shape(node, update)) {
+    return reshape_container(node, update, diff);
+  }
+  bool success = true;
+  for (size_t i = 0; i < node->list.len; i++) {
+    success &= merge_node(&node->list.list[i], &update->list.list[i], diff);
+  }
+  return success;
+}
 
+bool structure_merge(struct structure_node *root, struct structure_node *update, struct structure_diff *diff) {
+  if (!structure_expand_all(root) || !structure_expand_all(update)) {
+    structure_destroy(update);
+    return false;
+  }
+  bool success = merge_node(root, update, diff);
+  structure_destroy(update);
+  return success;
+}
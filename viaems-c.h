@@ -4,6 +4,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef enum {
   FIELD_UINT32,
@@ -20,6 +25,18 @@ union field_value {
   float as_float;
 };
 
+/* Expected feed layout, normally generated by viaems-schemagen from a
+ * captured session */
+struct feed_schema_field {
+  const char *name;
+  feed_field_type type;
+};
+
+struct feed_schema {
+  size_t n_fields;
+  const struct feed_schema_field *fields;
+};
+
 typedef enum {
   VALUE_INVALID,
   VALUE_UINT32,
@@ -74,6 +91,10 @@ struct config_value {
   };
 };
 
+/* Floats compare bitwise: a NaN equals itself, and 0 and -0 differ. Strings
+ * compare by content. Values of any other type are never equal */
+bool config_value_equal(const struct config_value *a, const struct config_value *b);
+
 struct path_element {
   enum {
     PATH_STR,
@@ -101,10 +122,17 @@ struct structure_leaf {
   config_value_type type;
   char *description;
   char **choices;
+  uint8_t *request; /* Pre-encoded request skeleton, see viaems_send_get_async */
+  size_t request_len;
 };
 
+struct structure_source;
 struct structure_node {
   struct path_element **path;
+  /* Lazy trees: the retained response this node is still to be expanded
+   * from, NULL once expanded */
+  struct structure_source *source;
+  size_t offset;
   enum {
     LEAF,
     LIST,
@@ -121,24 +149,251 @@ bool structure_node_is_list(struct structure_node *);
 bool structure_node_is_map(struct structure_node *);
 bool structure_node_is_leaf(struct structure_node *);
 void structure_destroy(struct structure_node *root);
+
+/* Lazy trees (see viaems_set_lazy_structure) expand a node's children, or a
+ * leaf's description and choices, on first access through these, so read
+ * them this way rather than through the struct members. They work the same
+ * on fully parsed trees.
+ *
+ * Expanding writes to the tree, so a lazy tree must only be read from one
+ * thread at a time until structure_expand_all has succeeded on it (or on
+ * the subtree being shared). A fully parsed or fully expanded tree is read
+ * only and may be shared freely */
+size_t structure_node_len(struct structure_node *);
+struct structure_node *structure_node_child(struct structure_node *, size_t i);
+const char *structure_node_child_name(struct structure_node *, size_t i);
+const char *structure_leaf_description(struct structure_node *);
+char **structure_leaf_choices(struct structure_node *);
+bool structure_expand_all(struct structure_node *);
+
+/* path is like "outputs/3/pin", NULL if there is no such node */
 struct structure_node *structure_find_node(struct structure_node *root, const char *path);
 
+/* Changes made by structure_merge, in the order they were applied. Map
+ * children are matched by name and list children by index. Unchanged
+ * subtrees keep their addresses; when a container gains or loses children
+ * its child array is reallocated, so each surviving child is reported as
+ * moved (its own descendants stay in place). A changed node whose kind
+ * changed (leaf, list, map) has its whole subtree replaced. Removed and old
+ * addresses are freed and only useful as keys, so apply the changes in
+ * order */
+typedef enum {
+  STRUCTURE_ADDED,
+  STRUCTURE_REMOVED,
+  STRUCTURE_CHANGED, /* Leaf type, description or choices changed, or node kind changed */
+  STRUCTURE_MOVED,
+} structure_change_type;
+
+struct structure_change {
+  structure_change_type type;
+  struct structure_node *node;
+  struct structure_node *old_node; /* Former address, for STRUCTURE_MOVED */
+};
+
+struct structure_diff {
+  size_t len;
+  size_t capacity;
+  struct structure_change *changes;
+};
+
+/* Merge a newly fetched tree into an existing one, consuming update. root
+ * itself always stays in place. Returns false if memory ran out, in which
+ * case the tree is still valid but the diff may be incomplete */
+bool structure_merge(struct structure_node *root, struct structure_node *update, struct structure_diff *diff);
+void structure_diff_free(struct structure_diff *);
+
+typedef enum {
+  MESSAGE_FEED,
+  MESSAGE_DESCRIPTION,
+  MESSAGE_RESPONSE,
+  MESSAGE_UNKNOWN,
+  N_MESSAGE_TYPES,
+} message_type;
+
+typedef enum {
+  PARSE_ERROR_CBOR,          /* Not decodable as CBOR at all */
+  PARSE_ERROR_NOT_MAP,       /* Top level item is not a map */
+  PARSE_ERROR_NO_TYPE,       /* Missing "type" key */
+  PARSE_ERROR_UNKNOWN_TYPE,  /* "type" is not feed, description, or response */
+  PARSE_ERROR_MISSING_FIELD, /* Message lacks a field required for its type */
+  PARSE_ERROR_BAD_FIELD,     /* Field present but of an unexpected type */
+  N_PARSE_ERRORS,
+} parse_error;
+
+/* Log2 bucketed histogram of durations: bucket i counts samples in
+ * [2^i, 2^(i+1)) nanoseconds, bucket 0 also holds zero, and the last bucket
+ * holds everything larger */
+#define METRICS_HISTOGRAM_BUCKETS 32
+struct metrics_histogram {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
+struct viaems_metrics {
+  uint64_t bytes_received;
+  uint64_t bytes_sent;
+  uint64_t messages[N_MESSAGE_TYPES];
+  uint64_t message_bytes[N_MESSAGE_TYPES];
+  uint64_t parse_errors[N_PARSE_ERRORS];
+  uint64_t feed_length_mismatches; /* Feed frames dropped for not matching the description */
+  uint64_t requests_sent;
+  uint64_t orphan_responses; /* Responses with no matching outstanding request */
+  uint64_t timeouts;
+  struct metrics_histogram decode_time[N_MESSAGE_TYPES];
+  struct metrics_histogram request_latency;
+
+  /* Only counted while allocation tracking is on, see
+   * viaems_set_alloc_tracking */
+  uint64_t allocations[N_MESSAGE_TYPES]; /* Made while decoding each message type */
+  uint64_t request_allocations;          /* Made outside decoding, such as issuing requests */
+};
+
+/* Each call carries exactly one complete message. A writev_fn receives the
+ * message in pieces, such as a pre-encoded request skeleton and a large
+ * value, so a transport can send them without first joining them */
 typedef void (*write_fn)(void *userdata, uint8_t *bytes, size_t len);
+typedef void (*writev_fn)(void *userdata, const struct iovec *iov, int iovcnt);
+
+typedef enum {
+  REQUEST_OK,
+  REQUEST_TIMEOUT,
+  REQUEST_CANCELLED,
+  REQUEST_FAILED, /* Response arrived but could not be decoded */
+} request_status;
 
 typedef void (*feed_callback)(size_t n_fields, const struct field_key *keys, const union field_value *);
-typedef void (*structure_callback)(struct structure_node *root, void *userdata);
-typedef void (*get_callback)(struct config_value value, void *userdata);
+typedef void (*typed_feed_callback)(const void *frame, void *userdata);
+
+/* Feed listeners let several consumers share the receive path. schema (may
+ * be NULL) is called before a listener's first frame, and again whenever
+ * the keys or types change or a derived channel is added; a repeated
+ * description does not call it. frame is called for every frame. Both run
+ * on the receive thread and must not block. Once remove returns, no
+ * callback for the listener is running or will run. Callbacks may add and
+ * remove listeners */
+struct feed_listener {
+  void (*schema)(void *userdata, size_t n_fields, const struct field_key *keys);
+  void (*frame)(void *userdata, size_t n_fields, const struct field_key *keys, const union field_value *values);
+  void *userdata;
+};
+typedef void (*structure_callback)(request_status status, struct structure_node *root, void *userdata);
+typedef void (*get_callback)(request_status status, struct config_value value, void *userdata);
+
+/* Allocator hook. Memory the protocol keeps for itself goes through it:
+ * the protocol, feed storage and key names, the completion queue, encode
+ * buffers, and copies of set values. free is passed the size that was
+ * allocated. Results handed to the caller, structure trees and string
+ * values, still come from the C heap, since the caller releases them with
+ * structure_destroy and free */
+struct viaems_allocator {
+  void *(*alloc)(void *userdata, size_t size);
+  void (*free)(void *userdata, void *ptr, size_t size);
+  void *userdata;
+};
 
 struct protocol;
 bool viaems_create_protocol(struct protocol **);
+bool viaems_create_protocol_with_allocator(struct protocol **, const struct viaems_allocator *);
 void viaems_destroy_protocol(struct protocol **);
 void viaems_set_write_fn(struct protocol *, write_fn, void *userdata);
+void viaems_set_writev_fn(struct protocol *, writev_fn, void *userdata);
 void viaems_set_feed_cb(struct protocol *, feed_callback);
+bool viaems_add_feed_listener(struct protocol *, const struct feed_listener *);
+bool viaems_remove_feed_listener(struct protocol *, const struct feed_listener *);
+
+/* Deliver each feed frame as a generated frame struct, laid out in schema
+ * order. The live description is checked against the schema once per
+ * description message (and for value types on the first frame, or a frame
+ * whose types changed); frames are only delivered while it matches */
+void viaems_set_typed_feed_cb(struct protocol *, const struct feed_schema *, typed_feed_callback, void *userdata);
+bool viaems_feed_schema_matches(struct protocol *);
+
+/* Register a derived channel, an expression over feed fields (see
+ * viaems-derived.h). Derived channels are computed once per frame and
+ * appended, as float fields, after the described fields in every feed
+ * callback. Register them before data starts flowing. Returns false if the
+ * expression does not parse */
+bool viaems_add_derived_channel(struct protocol *, const char *name, const char *expression);
 bool viaems_new_data(struct protocol *, const uint8_t *data, size_t len);
 
-bool viaems_get_structure_async(struct protocol *p, structure_callback cb, void *userdata);
+/* Packed feed. A feed message's "values" may be a byte string of little
+ * endian 32 bit words in description order instead of an array; the types
+ * come from a "types" array in the description, or from an earlier array
+ * frame. Both forms are always accepted. viaems_offer_packed_feed tells the
+ * ECU the client understands packed frames; an ECU that does not support
+ * them ignores it */
+void viaems_offer_packed_feed(struct protocol *);
+
+/* Encode description and feed messages as an ECU would, for simulators and
+ * tests. Return the encoded length, or 0 if buf is too small */
+size_t viaems_encode_description(uint8_t *buf, size_t len, size_t n_fields, const struct field_key *keys);
+size_t viaems_encode_feed(uint8_t *buf, size_t len, size_t n_fields, const struct field_key *keys, const union field_value *values, bool packed);
+void viaems_get_metrics(struct protocol *, struct viaems_metrics *dest);
+
+/* Count every allocation, through the allocator hook or for a caller owned
+ * result, in the metrics. Meant for checking that a steady feed does not
+ * allocate; off by default */
+void viaems_set_alloc_tracking(struct protocol *, bool enabled);
+
+/* Async requests return a nonzero request id, or 0 if the request could not
+ * be issued. Every issued request gets exactly one callback: with the
+ * response, or with REQUEST_TIMEOUT once the request timeout (default 1000
+ * ms, measured on CLOCK_MONOTONIC) elapses, or with REQUEST_CANCELLED. Timeout
+ * callbacks fire on an internal thread owned by the protocol. A string
+ * value returned by a get is owned by the caller */
+void viaems_set_request_timeout(struct protocol *, uint32_t timeout_ms);
+
+/* Keep structure responses as received and expand nodes only when they are
+ * first accessed, see structure_node_child and the threading note there.
+ * Off by default */
+void viaems_set_lazy_structure(struct protocol *, bool lazy);
+bool viaems_cancel_request(struct protocol *, uint32_t id);
+
+/* Send every outstanding request again, with the same id and a fresh
+ * timeout, after the transport has reconnected. A response to the original
+ * send that still arrives completes the request; the later one is counted
+ * as an orphan. Requests hold on to what they send, so the tree they were
+ * made from may already be destroyed */
+bool viaems_replay_requests(struct protocol *);
+
+uint32_t viaems_get_structure_async(struct protocol *p, structure_callback cb, void *userdata);
 bool viaems_get_structure(struct protocol *p, struct structure_node **);
-bool viaems_send_get_async(struct protocol *p, struct structure_node *node, get_callback callback, void *userdata);
+uint32_t viaems_send_get_async(struct protocol *p, struct structure_node *node, get_callback callback, void *userdata);
 bool viaems_send_get(struct protocol *p, struct structure_node *node, struct config_value *dest);
 
+/* Fetch the structure again and merge it into root, see structure_merge.
+ * Nodes that are removed or moved must not have requests outstanding */
+bool viaems_refresh_structure(struct protocol *p, struct structure_node *root, struct structure_diff *diff);
+
+/* Sets report the value the ECU settled on. value.type must match the leaf */
+uint32_t viaems_send_set_async(struct protocol *p, struct structure_node *node, struct config_value value, get_callback callback, void *userdata);
+bool viaems_send_set(struct protocol *p, struct structure_node *node, struct config_value value, struct config_value *result);
+
+/* Completion queue. An async request issued with a NULL callback completes
+ * into a queue owned by the protocol instead, so one thread can drive any
+ * number of outstanding requests. The completion fd is an eventfd that is
+ * readable while completions are waiting; add it to an epoll/poll set and
+ * drain with viaems_poll_completions. Room for each completion is reserved
+ * when the request is issued, so no completion is ever lost */
+struct viaems_completion {
+  uint32_t id;
+  request_status status;
+  void *userdata;
+  struct structure_node *node; /* The leaf, for get and set */
+  struct config_value value;   /* Get and set result, a string is owned by the caller */
+  struct structure_node *root; /* Structure result, owned by the caller */
+};
+
+int viaems_completion_fd(struct protocol *);
+
+/* Grow the completion queue up front so that issuing up to n queued
+ * requests at once never allocates */
+bool viaems_reserve_completions(struct protocol *, size_t n);
+size_t viaems_poll_completions(struct protocol *, struct viaems_completion *dest, size_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,574 @@
+#include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include "viaems-capture.h"
+#include "viaems-log.h"
+
+#define CAPTURE_BLOCK_ROWS 256
+#define MAX_PENDING_BLOCKS 64
+
+static void check_thrd(int val) {
+  assert(val == thrd_success);
+}
+
+/* Schemas are kept until destroy, queued rows refer to them. A repeated
+ * schema is not copied again */
+struct capture_schema {
+  struct capture_schema *next;
+  size_t n_fields;
+  struct field_key *keys;
+};
+
+/* Rows, stored row-major. The pre-trigger ring wraps at capacity starting
+ * at start; post-trigger blocks start at 0 */
+struct capture_rows {
+  struct capture_rows *next;
+  bool is_ring;
+  bool last; /* Final rows of a capture */
+  uint32_t capture;
+  const struct capture_schema *schema;
+  uint64_t cutoff_ns; /* Ring rows older than this are not written */
+  size_t capacity;
+  size_t fields_capacity;
+  size_t start;
+  size_t n_rows;
+  uint64_t *timestamps;
+  union field_value *values;
+};
+
+struct capture_trigger {
+  char *channel;
+  vp_trigger_type type;
+  float threshold;
+  int field; /* In the current schema, -1 if absent */
+  bool has_last;
+  float last;
+};
+
+struct vp_capture {
+  struct vp_capture_config config;
+  char *path_prefix;
+
+  struct protocol *proto;
+  struct feed_listener listener;
+
+  /* Feed side */
+  struct capture_schema *schemas; /* Newest first */
+  struct capture_trigger *triggers;
+  size_t n_triggers;
+  struct capture_rows *ring;
+  struct capture_rows *block;
+  bool recording;
+  uint64_t post_end_ns;
+  uint32_t next_capture;
+  _Atomic bool force;
+
+  mtx_t mtx; /* Protects everything below */
+  cnd_t cnd;
+  thrd_t thrd;
+  bool closing;
+  struct capture_rows *pending_head;
+  struct capture_rows *pending_tail;
+  size_t n_pending;
+  struct capture_rows *free_rings;
+  struct capture_rows *free_blocks;
+
+  _Atomic uint64_t completed;
+  _Atomic uint64_t missed_triggers;
+  _Atomic uint64_t dropped_rows;
+};
+
+static void schema_free(struct capture_schema *schema) {
+  for (size_t i = 0; i < schema->n_fields; i++) {
+    free(schema->keys[i].name);
+  }
+  free(schema->keys);
+  free(schema);
+}
+
+static bool schema_equals(const struct capture_schema *schema, size_t n_fields, const struct field_key *keys) {
+  if (schema->n_fields != n_fields) {
+    return false;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    if (schema->keys[i].type != keys[i].type || strcmp(schema->keys[i].name, keys[i].name) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static struct capture_schema *schema_copy(size_t n_fields, const struct field_key *keys) {
+  struct capture_schema *schema = calloc(1, sizeof(struct capture_schema));
+  if (!schema) {
+    return NULL;
+  }
+  schema->keys = calloc(n_fields ? n_fields : 1, sizeof(struct field_key));
+  if (!schema->keys) {
+    free(schema);
+    return NULL;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    schema->keys[i].type = keys[i].type;
+    schema->keys[i].name = strdup(keys[i].name);
+    if (!schema->keys[i].name) {
+      schema_free(schema);
+      return NULL;
+    }
+    schema->n_fields = i + 1;
+  }
+  return schema;
+}
+
+static void rows_free(struct capture_rows *rows) {
+  while (rows) {
+    struct capture_rows *next = rows->next;
+    free(rows->timestamps);
+    free(rows->values);
+    free(rows);
+    rows = next;
+  }
+}
+
+static bool rows_reserve(struct capture_rows *rows, size_t capacity, size_t n_fields) {
+  if (rows->capacity < capacity) {
+    uint64_t *timestamps = realloc(rows->timestamps, capacity * sizeof(uint64_t));
+    if (!timestamps) {
+      return false;
+    }
+    rows->timestamps = timestamps;
+    rows->capacity = capacity;
+    rows->fields_capacity = 0;
+  }
+  if (rows->fields_capacity < n_fields) {
+    union field_value *values = realloc(rows->values, rows->capacity * n_fields * sizeof(union field_value));
+    if (!values) {
+      return false;
+    }
+    rows->values = values;
+    rows->fields_capacity = n_fields;
+  }
+  return true;
+}
+
+/* Takes recycled rows from a pool, allocating only while the pool warms up
+ * or after the schema grows */
+static struct capture_rows *take_rows(struct vp_capture *c, struct capture_rows **pool, bool is_ring) {
+  const struct capture_schema *schema = c->schemas;
+  check_thrd(mtx_lock(&c->mtx));
+  struct capture_rows *rows = *pool;
+  if (rows) {
+    *pool = rows->next;
+  }
+  check_thrd(mtx_unlock(&c->mtx));
+
+  if (!rows) {
+    rows = calloc(1, sizeof(struct capture_rows));
+    if (!rows) {
+      return NULL;
+    }
+  }
+  size_t capacity = is_ring ? c->config.max_pre_rows : CAPTURE_BLOCK_ROWS;
+  if (!rows_reserve(rows, capacity, schema->n_fields)) {
+    rows_free(rows);
+    return NULL;
+  }
+  rows->next = NULL;
+  rows->is_ring = is_ring;
+  rows->last = false;
+  rows->schema = schema;
+  rows->start = 0;
+  rows->n_rows = 0;
+  return rows;
+}
+
+static void rows_append(struct capture_rows *rows, uint64_t timestamp_ns, const union field_value *values) {
+  size_t n_fields = rows->schema->n_fields;
+  size_t row;
+  if (rows->n_rows < rows->capacity) {
+    row = (rows->start + rows->n_rows++) % rows->capacity;
+  } else {
+    /* Ring is full, overwrite the oldest */
+    row = rows->start;
+    rows->start = (rows->start + 1) % rows->capacity;
+  }
+  rows->timestamps[row] = timestamp_ns;
+  memcpy(&rows->values[row * n_fields], values, n_fields * sizeof(union field_value));
+}
+
+/* Once MAX_PENDING_BLOCKS are queued, post-trigger blocks are dropped and
+ * counted, so a stalled writer cannot grow the queue without bound. Rings
+ * and the final rows of a capture are always queued, so every capture's
+ * file is opened and closed */
+static void enqueue(struct vp_capture *c, struct capture_rows *rows) {
+  check_thrd(mtx_lock(&c->mtx));
+  if (!rows->is_ring && !rows->last && c->n_pending >= MAX_PENDING_BLOCKS) {
+    atomic_fetch_add_explicit(&c->dropped_rows, rows->n_rows, memory_order_relaxed);
+    rows->next = c->free_blocks;
+    c->free_blocks = rows;
+  } else {
+    rows->next = NULL;
+    if (c->pending_tail) {
+      c->pending_tail->next = rows;
+    } else {
+      c->pending_head = rows;
+    }
+    c->pending_tail = rows;
+    c->n_pending += 1;
+    check_thrd(cnd_signal(&c->cnd));
+  }
+  check_thrd(mtx_unlock(&c->mtx));
+}
+
+static bool write_rows(struct vp_log_writer *log, const struct capture_rows *rows) {
+  size_t n_fields = rows->schema->n_fields;
+  bool success = true;
+  for (size_t i = 0; i < rows->n_rows; i++) {
+    size_t row = (rows->start + i) % rows->capacity;
+    if (rows->is_ring && rows->timestamps[row] < rows->cutoff_ns) {
+      continue;
+    }
+    success &= vp_log_writer_append(log, rows->timestamps[row], &rows->values[row * n_fields]);
+  }
+  return success;
+}
+
+static int writer_loop(void *ptr) {
+  struct vp_capture *c = ptr;
+  struct vp_log_writer *log = NULL;
+
+  check_thrd(mtx_lock(&c->mtx));
+  while (true) {
+    if (!c->pending_head) {
+      if (c->closing) {
+        break;
+      }
+      check_thrd(cnd_wait(&c->cnd, &c->mtx));
+      continue;
+    }
+    struct capture_rows *rows = c->pending_head;
+    c->pending_head = rows->next;
+    if (!c->pending_head) {
+      c->pending_tail = NULL;
+    }
+    c->n_pending -= 1;
+    check_thrd(mtx_unlock(&c->mtx));
+
+    if (rows->is_ring) {
+      /* A capture always starts with its ring */
+      char path[4096];
+      snprintf(path, sizeof(path), "%s-%04u.vlog", c->path_prefix, rows->capture);
+      log = vp_log_writer_create(path);
+      if (log) {
+        vp_log_writer_set_blocking(log, true);
+        vp_log_writer_set_schema(log, rows->schema->n_fields, rows->schema->keys);
+      }
+    }
+    if (log) {
+      write_rows(log, rows);
+      if (rows->last) {
+        vp_log_writer_close(log);
+        log = NULL;
+        atomic_fetch_add_explicit(&c->completed, 1, memory_order_relaxed);
+      }
+    }
+
+    check_thrd(mtx_lock(&c->mtx));
+    struct capture_rows **pool = rows->is_ring ? &c->free_rings : &c->free_blocks;
+    rows->next = *pool;
+    *pool = rows;
+  }
+  check_thrd(mtx_unlock(&c->mtx));
+  if (log) {
+    vp_log_writer_close(log);
+  }
+  return 0;
+}
+
+struct vp_capture *vp_capture_create(const struct vp_capture_config *config) {
+  if (!config->path_prefix || config->max_pre_rows == 0) {
+    return NULL;
+  }
+  struct vp_capture *c = malloc(sizeof(struct vp_capture));
+  if (!c) {
+    return NULL;
+  }
+  memset(c, 0, sizeof(struct vp_capture));
+  c->config = *config;
+  c->path_prefix = strdup(config->path_prefix);
+  if (!c->path_prefix) {
+    free(c);
+    return NULL;
+  }
+
+  mtx_init(&c->mtx, mtx_plain);
+  cnd_init(&c->cnd);
+  if (thrd_create(&c->thrd, writer_loop, c) != thrd_success) {
+    free(c->path_prefix);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/* Queues the rows recorded so far and marks the end of the capture */
+static void finish_capture(struct vp_capture *c) {
+  struct capture_rows *rows = c->block;
+  c->block = NULL;
+  if (!rows) {
+    rows = take_rows(c, &c->free_blocks, false);
+  }
+  if (rows) {
+    rows->last = true;
+    enqueue(c, rows);
+  }
+  c->recording = false;
+  /* Rearmed: edges are only detected between frames seen while armed */
+  for (size_t i = 0; i < c->n_triggers; i++) {
+    c->triggers[i].has_last = false;
+  }
+}
+
+void vp_capture_destroy(struct vp_capture *c) {
+  if (c->proto) {
+    viaems_remove_feed_listener(c->proto, &c->listener);
+  }
+  if (c->recording) {
+    finish_capture(c);
+  }
+
+  check_thrd(mtx_lock(&c->mtx));
+  c->closing = true;
+  check_thrd(cnd_signal(&c->cnd));
+  check_thrd(mtx_unlock(&c->mtx));
+  thrd_join(c->thrd, NULL);
+
+  rows_free(c->ring);
+  rows_free(c->free_rings);
+  rows_free(c->free_blocks);
+  while (c->schemas) {
+    struct capture_schema *schema = c->schemas;
+    c->schemas = schema->next;
+    schema_free(schema);
+  }
+  for (size_t i = 0; i < c->n_triggers; i++) {
+    free(c->triggers[i].channel);
+  }
+  free(c->triggers);
+  free(c->path_prefix);
+  cnd_destroy(&c->cnd);
+  mtx_destroy(&c->mtx);
+  free(c);
+}
+
+static void resolve_trigger(struct vp_capture *c, struct capture_trigger *t) {
+  t->field = -1;
+  t->has_last = false;
+  const struct capture_schema *schema = c->schemas;
+  for (size_t i = 0; schema && i < schema->n_fields; i++) {
+    if (strcmp(schema->keys[i].name, t->channel) == 0) {
+      t->field = i;
+      return;
+    }
+  }
+}
+
+bool vp_capture_add_trigger(struct vp_capture *c, const char *channel, vp_trigger_type type, float threshold) {
+  struct capture_trigger *triggers = realloc(c->triggers, (c->n_triggers + 1) * sizeof(struct capture_trigger));
+  if (!triggers) {
+    return false;
+  }
+  c->triggers = triggers;
+  struct capture_trigger *t = &c->triggers[c->n_triggers];
+  *t = (struct capture_trigger){
+    .channel = strdup(channel),
+    .type = type,
+    .threshold = threshold,
+  };
+  if (!t->channel) {
+    return false;
+  }
+  resolve_trigger(c, t);
+  c->n_triggers += 1;
+  return true;
+}
+
+void vp_capture_trigger(struct vp_capture *c) {
+  atomic_store_explicit(&c->force, true, memory_order_relaxed);
+}
+
+bool vp_capture_set_schema(struct vp_capture *c, size_t n_fields, const struct field_key *keys) {
+  /* An unchanged schema keeps the ring and any capture in progress */
+  bool unchanged = c->schemas && schema_equals(c->schemas, n_fields, keys);
+  if (unchanged && c->ring) {
+    return true;
+  }
+  if (!unchanged) {
+    /* Built in full before it is linked in. Rows of the old schema stop
+     * either way, and without a ring frames are ignored until a schema is
+     * set */
+    struct capture_schema *schema = schema_copy(n_fields, keys);
+    if (c->recording) {
+      finish_capture(c);
+    }
+    if (c->ring) {
+      check_thrd(mtx_lock(&c->mtx));
+      c->ring->next = c->free_rings;
+      c->free_rings = c->ring;
+      check_thrd(mtx_unlock(&c->mtx));
+      c->ring = NULL;
+    }
+    if (!schema) {
+      return false;
+    }
+    schema->next = c->schemas;
+    c->schemas = schema;
+    for (size_t i = 0; i < c->n_triggers; i++) {
+      resolve_trigger(c, &c->triggers[i]);
+    }
+  }
+  /* One ring fills while the other may be with the writer */
+  c->ring = take_rows(c, &c->free_rings, true);
+  if (!c->ring) {
+    return false;
+  }
+  check_thrd(mtx_lock(&c->mtx));
+  bool have_spare = c->free_rings != NULL;
+  check_thrd(mtx_unlock(&c->mtx));
+  if (!have_spare) {
+    struct capture_rows *spare = take_rows(c, &c->free_rings, true);
+    if (!spare) {
+      return false;
+    }
+    check_thrd(mtx_lock(&c->mtx));
+    spare->next = c->free_rings;
+    c->free_rings = spare;
+    check_thrd(mtx_unlock(&c->mtx));
+  }
+  return true;
+}
+
+static bool check_trigger(struct capture_trigger *t, const struct capture_schema *schema, const union field_value *values) {
+  if (t->field < 0) {
+    return false;
+  }
+  float x = schema->keys[t->field].type == FIELD_FLOAT ? values[t->field].as_float : (float)values[t->field].as_uint32;
+  if (isnan(x)) {
+    return false;
+  }
+  bool fired = false;
+  switch (t->type) {
+    case VP_TRIGGER_ABOVE:
+      fired = x > t->threshold;
+      break;
+    case VP_TRIGGER_BELOW:
+      fired = x < t->threshold;
+      break;
+    case VP_TRIGGER_RISING:
+      fired = t->has_last && t->last <= t->threshold && x > t->threshold;
+      break;
+    case VP_TRIGGER_FALLING:
+      fired = t->has_last && t->last >= t->threshold && x < t->threshold;
+      break;
+  }
+  t->last = x;
+  t->has_last = true;
+  return fired;
+}
+
+/* Hands the ring over, with a fresh one taking its place */
+static void start_capture(struct vp_capture *c, uint64_t timestamp_ns) {
+  check_thrd(mtx_lock(&c->mtx));
+  bool spare = c->free_rings != NULL;
+  check_thrd(mtx_unlock(&c->mtx));
+  struct capture_rows *ring = spare ? take_rows(c, &c->free_rings, true) : NULL;
+  if (!ring) {
+    atomic_fetch_add_explicit(&c->missed_triggers, 1, memory_order_relaxed);
+    return;
+  }
+
+  struct capture_rows *pre = c->ring;
+  c->ring = ring;
+  pre->capture = c->next_capture++;
+  pre->cutoff_ns = timestamp_ns > c->config.pre_ns ? timestamp_ns - c->config.pre_ns : 0;
+  enqueue(c, pre);
+  c->recording = true;
+  c->post_end_ns = timestamp_ns + c->config.post_ns;
+}
+
+void vp_capture_push(struct vp_capture *c, uint64_t timestamp_ns, const union field_value *values) {
+  const struct capture_schema *schema = c->schemas;
+  if (!schema || !c->ring) {
+    return;
+  }
+
+  if (c->recording) {
+    if (timestamp_ns > c->post_end_ns) {
+      finish_capture(c);
+    } else {
+      if (!c->block) {
+        c->block = take_rows(c, &c->free_blocks, false);
+        if (!c->block) {
+          atomic_fetch_add_explicit(&c->dropped_rows, 1, memory_order_relaxed);
+          return;
+        }
+      }
+      rows_append(c->block, timestamp_ns, values);
+      if (c->block->n_rows == c->block->capacity) {
+        enqueue(c, c->block);
+        c->block = NULL;
+      }
+      return;
+    }
+  }
+
+  rows_append(c->ring, timestamp_ns, values);
+  bool fired = atomic_exchange_explicit(&c->force, false, memory_order_relaxed);
+  for (size_t i = 0; i < c->n_triggers; i++) {
+    fired |= check_trigger(&c->triggers[i], schema, values);
+  }
+  if (fired) {
+    start_capture(c, timestamp_ns);
+  }
+}
+
+static void capture_feed_schema(void *userdata, size_t n_fields, const struct field_key *keys) {
+  vp_capture_set_schema(userdata, n_fields, keys);
+}
+
+static void capture_feed_frame(void *userdata, size_t n_fields, const struct field_key *keys, const union field_value *values) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  vp_capture_push(userdata, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, values);
+}
+
+bool vp_capture_attach(struct vp_capture *c, struct protocol *p) {
+  c->listener = (struct feed_listener){
+    .schema = capture_feed_schema,
+    .frame = capture_feed_frame,
+    .userdata = c,
+  };
+  if (!viaems_add_feed_listener(p, &c->listener)) {
+    return false;
+  }
+  c->proto = p;
+  return true;
+}
+
+uint64_t vp_capture_completed(struct vp_capture *c) {
+  return atomic_load_explicit(&c->completed, memory_order_relaxed);
+}
+
+uint64_t vp_capture_missed_triggers(struct vp_capture *c) {
+  return atomic_load_explicit(&c->missed_triggers, memory_order_relaxed);
+}
+
+uint64_t vp_capture_dropped_rows(struct vp_capture *c) {
+  return atomic_load_explicit(&c->dropped_rows, memory_order_relaxed);
+}
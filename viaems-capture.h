@@ -0,0 +1,61 @@
+#ifndef VIAEMS_CAPTURE_H
+#define VIAEMS_CAPTURE_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Triggered capture, like an oscilloscope in normal mode.
+ *
+ * While armed, every frame goes into a fixed pre-trigger ring. Triggers are
+ * checked on every frame; when one fires, the ring is handed to a writer
+ * thread and frames are recorded for the post-trigger window, after which
+ * the capture rearms. Each capture is written as its own columnar log (see
+ * viaems-log.h) named <prefix>-<n>.vlog. The feed side only copies frames
+ * and swaps buffers, it never waits on I/O. Derived channels can be used as
+ * trigger sources like any other field.
+ */
+
+typedef enum {
+  VP_TRIGGER_ABOVE,   /* Whenever the value is above the threshold */
+  VP_TRIGGER_BELOW,   /* Whenever the value is below the threshold */
+  VP_TRIGGER_RISING,  /* Value crosses the threshold upwards */
+  VP_TRIGGER_FALLING, /* Value crosses the threshold downwards */
+} vp_trigger_type;
+
+struct vp_capture_config {
+  const char *path_prefix;
+  uint64_t pre_ns;     /* History kept before the trigger */
+  uint64_t post_ns;    /* Recorded after the trigger */
+  size_t max_pre_rows; /* Size of the pre-trigger ring, bounds pre_ns at high rates */
+};
+
+struct vp_capture;
+
+struct vp_capture *vp_capture_create(const struct vp_capture_config *);
+
+/* Finishes a capture in progress and waits for all captures to be written */
+void vp_capture_destroy(struct vp_capture *);
+
+bool vp_capture_add_trigger(struct vp_capture *, const char *channel, vp_trigger_type, float threshold);
+
+/* Fire on the next frame regardless of the triggers, from any thread */
+void vp_capture_trigger(struct vp_capture *);
+
+bool vp_capture_set_schema(struct vp_capture *, size_t n_fields, const struct field_key *keys);
+void vp_capture_push(struct vp_capture *, uint64_t timestamp_ns, const union field_value *values);
+
+/* Capture a live feed, timestamped with CLOCK_REALTIME on arrival */
+bool vp_capture_attach(struct vp_capture *, struct protocol *);
+
+uint64_t vp_capture_completed(struct vp_capture *);
+uint64_t vp_capture_missed_triggers(struct vp_capture *); /* Fired while the previous ring was still being written */
+uint64_t vp_capture_dropped_rows(struct vp_capture *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
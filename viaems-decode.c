@@ -0,0 +1,47 @@
+/* viaems-decode: convert a captured session into a columnar log
+ *
+ * usage: viaems-decode <capture.cbor> <out.vlog> [workers] [timestamp-field ns-per-unit]
+ *
+ * The capture is a file of concatenated protocol messages as received from
+ * the ECU. Chunks of it are decoded in parallel, see viaems-batch.h. Without
+ * a timestamp field, frames are numbered from 0.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "viaems-batch.h"
+
+static void die(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3 && argc != 4 && argc != 6) {
+    die("usage: viaems-decode <capture.cbor> <out.vlog> [workers] [timestamp-field ns-per-unit]");
+  }
+
+  struct vp_batch_config config = { 0 };
+  if (argc >= 4) {
+    config.n_workers = strtoul(argv[3], NULL, 10);
+  }
+  if (argc == 6) {
+    config.timestamp_field = argv[4];
+    config.timestamp_scale_ns = strtod(argv[5], NULL);
+  }
+
+  struct vp_batch_result result;
+  if (!vp_batch_decode(argv[1], argv[2], &config, &result)) {
+    die("decode failed");
+  }
+  fprintf(stderr, "%llu messages, %llu frames, %llu parse errors, %llu mismatched frames\n",
+      (unsigned long long)result.messages, (unsigned long long)result.frames,
+      (unsigned long long)result.parse_errors,
+      (unsigned long long)result.feed_length_mismatches);
+  if (result.timestamp_resets || result.rejected_timestamps) {
+    fprintf(stderr, "%llu timestamp resets, %llu frames with a bad timestamp\n",
+        (unsigned long long)result.timestamp_resets,
+        (unsigned long long)result.rejected_timestamps);
+  }
+  return 0;
+}
@@ -0,0 +1,611 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "viaems-derived.h"
+
+typedef enum {
+  OP_CONST,
+  OP_LOAD,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_NEG,
+  OP_LT,
+  OP_GT,
+  OP_LE,
+  OP_GE,
+  OP_ABS,
+  OP_MIN,
+  OP_MAX,
+  OP_DELTA,
+  OP_RATE,
+  OP_EMA,
+  OP_MEAN,
+  OP_STORE,
+} derived_opcode;
+
+struct derived_op {
+  derived_opcode opcode;
+  uint32_t arg; /* Field reference, state offset, or output index */
+  uint32_t window; /* OP_MEAN only */
+  double constant; /* OP_CONST only */
+};
+
+/* Field names are resolved to indices by derived_program_bind, so the
+ * program itself never changes when the description does */
+struct derived_ref {
+  char *name;
+  int32_t field; /* -1 if not in the current description */
+};
+
+struct derived_program {
+  size_t n_ops;
+  size_t ops_capacity;
+  struct derived_op *ops;
+
+  size_t n_refs;
+  struct derived_ref *refs;
+
+  size_t n_outputs;
+  char **output_names;
+
+  size_t n_state;
+  double *state;
+
+  size_t max_depth;
+  double *stack; /* double so uint32 fields (timestamps) load exactly */
+};
+
+#define MAX_MEAN_WINDOW 4096
+
+struct derived_parser {
+  struct derived_program *prog;
+  const char *pos;
+  size_t depth;
+  size_t max_depth;
+  bool error;
+};
+
+struct derived_program *derived_program_create(void) {
+  struct derived_program *prog = malloc(sizeof(struct derived_program));
+  if (!prog) {
+    return NULL;
+  }
+  memset(prog, 0, sizeof(struct derived_program));
+  return prog;
+}
+
+void derived_program_destroy(struct derived_program *prog) {
+  if (!prog) {
+    return;
+  }
+  for (int i = 0; i < prog->n_refs; i++) {
+    free(prog->refs[i].name);
+  }
+  for (int i = 0; i < prog->n_outputs; i++) {
+    free(prog->output_names[i]);
+  }
+  free(prog->refs);
+  free(prog->output_names);
+  free(prog->ops);
+  free(prog->state);
+  free(prog->stack);
+  free(prog);
+}
+
+size_t derived_program_n_outputs(const struct derived_program *prog) {
+  return prog->n_outputs;
+}
+
+const char *derived_program_output_name(const struct derived_program *prog, size_t output) {
+  return prog->output_names[output];
+}
+
+static int stack_effect(derived_opcode opcode) {
+  switch (opcode) {
+    case OP_CONST:
+    case OP_LOAD:
+      return 1;
+    case OP_NEG:
+    case OP_ABS:
+    case OP_DELTA:
+    case OP_MEAN:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+static void emit(struct derived_parser *ps, struct derived_op op) {
+  struct derived_program *prog = ps->prog;
+  if (prog->n_ops == prog->ops_capacity) {
+    size_t capacity = prog->ops_capacity ? prog->ops_capacity * 2 : 32;
+    struct derived_op *ops = realloc(prog->ops, capacity * sizeof(struct derived_op));
+    if (!ops) {
+      ps->error = true;
+      return;
+    }
+    prog->ops = ops;
+    prog->ops_capacity = capacity;
+  }
+  prog->ops[prog->n_ops++] = op;
+  ps->depth += stack_effect(op.opcode);
+  if (ps->depth > ps->max_depth) {
+    ps->max_depth = ps->depth;
+  }
+}
+
+static void emit_op(struct derived_parser *ps, derived_opcode opcode) {
+  emit(ps, (struct derived_op){ .opcode = opcode });
+}
+
+static uint32_t alloc_state(struct derived_parser *ps, size_t n) {
+  uint32_t offset = ps->prog->n_state;
+  ps->prog->n_state += n;
+  return offset;
+}
+
+static uint32_t find_or_add_ref(struct derived_parser *ps, const char *name, size_t len) {
+  struct derived_program *prog = ps->prog;
+  for (uint32_t i = 0; i < prog->n_refs; i++) {
+    if (strlen(prog->refs[i].name) == len && strncmp(prog->refs[i].name, name, len) == 0) {
+      return i;
+    }
+  }
+  struct derived_ref *refs = realloc(prog->refs, (prog->n_refs + 1) * sizeof(struct derived_ref));
+  char *copy = strndup(name, len);
+  if (refs) {
+    prog->refs = refs;
+  }
+  if (!refs || !copy) {
+    free(copy);
+    ps->error = true;
+    return 0;
+  }
+  prog->refs[prog->n_refs] = (struct derived_ref){ .name = copy, .field = -1 };
+  return prog->n_refs++;
+}
+
+static void skip_space(struct derived_parser *ps) {
+  while (isspace((unsigned char)*ps->pos)) {
+    ps->pos++;
+  }
+}
+
+static bool accept(struct derived_parser *ps, const char *token) {
+  skip_space(ps);
+  size_t len = strlen(token);
+  if (strncmp(ps->pos, token, len) == 0) {
+    ps->pos += len;
+    return true;
+  }
+  return false;
+}
+
+static void expect(struct derived_parser *ps, const char *token) {
+  if (!accept(ps, token)) {
+    ps->error = true;
+  }
+}
+
+static bool is_ident_start(char c) {
+  return isalpha((unsigned char)c) || c == '_';
+}
+
+static bool is_ident_char(char c) {
+  return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+static bool parse_number(struct derived_parser *ps, double *dest) {
+  skip_space(ps);
+  if (!isdigit((unsigned char)ps->pos[0]) &&
+      !(ps->pos[0] == '.' && isdigit((unsigned char)ps->pos[1]))) {
+    return false;
+  }
+  char *end;
+  *dest = strtod(ps->pos, &end);
+  ps->pos = end;
+  return true;
+}
+
+static void parse_expr(struct derived_parser *ps);
+
+static void parse_function(struct derived_parser *ps, const char *name, size_t len) {
+  struct {
+    const char *name;
+    derived_opcode opcode;
+    int n_args;
+    size_t n_state;
+  } functions[] = {
+    { "abs", OP_ABS, 1, 0 },
+    { "min", OP_MIN, 2, 0 },
+    { "max", OP_MAX, 2, 0 },
+    { "delta", OP_DELTA, 1, 1 },
+    { "rate", OP_RATE, 2, 2 },
+    { "ema", OP_EMA, 2, 1 },
+  };
+
+  if (len == 4 && strncmp(name, "mean", 4) == 0) {
+    /* Window is a constant since it sizes the history ring */
+    parse_expr(ps);
+    expect(ps, ",");
+    double window;
+    if (!parse_number(ps, &window) || window < 1 || window > MAX_MEAN_WINDOW ||
+        window != (uint32_t)window) {
+      ps->error = true;
+      return;
+    }
+    expect(ps, ")");
+    /* State: sum, count, ring position, then the ring itself */
+    emit(ps, (struct derived_op){
+      .opcode = OP_MEAN,
+      .arg = alloc_state(ps, 3 + (size_t)window),
+      .window = window,
+    });
+    return;
+  }
+
+  for (int i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+    if (strlen(functions[i].name) != len || strncmp(functions[i].name, name, len) != 0) {
+      continue;
+    }
+    for (int arg = 0; arg < functions[i].n_args; arg++) {
+      if (arg > 0) {
+        expect(ps, ",");
+      }
+      parse_expr(ps);
+    }
+    expect(ps, ")");
+    emit(ps, (struct derived_op){
+      .opcode = functions[i].opcode,
+      .arg = functions[i].n_state ? alloc_state(ps, functions[i].n_state) : 0,
+    });
+    return;
+  }
+  ps->error = true;
+}
+
+static void parse_primary(struct derived_parser *ps) {
+  double constant;
+  skip_space(ps);
+  if (ps->error) {
+    return;
+  }
+  if (parse_number(ps, &constant)) {
+    emit(ps, (struct derived_op){ .opcode = OP_CONST, .constant = constant });
+  } else if (accept(ps, "(")) {
+    parse_expr(ps);
+    expect(ps, ")");
+  } else if (accept(ps, "\"")) {
+    const char *start = ps->pos;
+    const char *end = strchr(start, '"');
+    if (!end) {
+      ps->error = true;
+      return;
+    }
+    ps->pos = end + 1;
+    emit(ps, (struct derived_op){ .opcode = OP_LOAD, .arg = find_or_add_ref(ps, start, end - start) });
+  } else if (is_ident_start(*ps->pos)) {
+    const char *start = ps->pos;
+    while (is_ident_char(*ps->pos)) {
+      ps->pos++;
+    }
+    size_t len = ps->pos - start;
+    if (accept(ps, "(")) {
+      parse_function(ps, start, len);
+    } else {
+      emit(ps, (struct derived_op){ .opcode = OP_LOAD, .arg = find_or_add_ref(ps, start, len) });
+    }
+  } else {
+    ps->error = true;
+  }
+}
+
+static void parse_unary(struct derived_parser *ps) {
+  if (accept(ps, "-")) {
+    parse_unary(ps);
+    emit_op(ps, OP_NEG);
+  } else {
+    parse_primary(ps);
+  }
+}
+
+static void parse_term(struct derived_parser *ps) {
+  parse_unary(ps);
+  while (!ps->error) {
+    if (accept(ps, "*")) {
+      parse_unary(ps);
+      emit_op(ps, OP_MUL);
+    } else if (accept(ps, "/")) {
+      parse_unary(ps);
+      emit_op(ps, OP_DIV);
+    } else {
+      break;
+    }
+  }
+}
+
+static void parse_sum(struct derived_parser *ps) {
+  parse_term(ps);
+  while (!ps->error) {
+    if (accept(ps, "+")) {
+      parse_term(ps);
+      emit_op(ps, OP_ADD);
+    } else if (accept(ps, "-")) {
+      parse_term(ps);
+      emit_op(ps, OP_SUB);
+    } else {
+      break;
+    }
+  }
+}
+
+static void parse_expr(struct derived_parser *ps) {
+  parse_sum(ps);
+  derived_opcode opcode;
+  if (accept(ps, "<=")) {
+    opcode = OP_LE;
+  } else if (accept(ps, ">=")) {
+    opcode = OP_GE;
+  } else if (accept(ps, "<")) {
+    opcode = OP_LT;
+  } else if (accept(ps, ">")) {
+    opcode = OP_GT;
+  } else {
+    return;
+  }
+  parse_sum(ps);
+  emit_op(ps, opcode);
+}
+
+static bool has_state(derived_opcode opcode) {
+  return opcode >= OP_DELTA && opcode <= OP_MEAN;
+}
+
+static void reset_state(struct derived_program *prog) {
+  for (int i = 0; i < prog->n_ops; i++) {
+    const struct derived_op *op = &prog->ops[i];
+    if (!has_state(op->opcode)) {
+      continue;
+    }
+    double *state = &prog->state[op->arg];
+    switch (op->opcode) {
+      case OP_DELTA:
+      case OP_EMA:
+        state[0] = NAN;
+        break;
+      case OP_RATE:
+        state[0] = NAN;
+        state[1] = NAN;
+        break;
+      case OP_MEAN:
+        memset(state, 0, (3 + op->window) * sizeof(double));
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+static bool reserve_storage(struct derived_program *prog, size_t depth) {
+  char **names = realloc(prog->output_names, (prog->n_outputs + 1) * sizeof(char *));
+  if (!names) {
+    return false;
+  }
+  prog->output_names = names;
+
+  if (prog->n_state > 0) {
+    double *state = realloc(prog->state, prog->n_state * sizeof(double));
+    if (!state) {
+      return false;
+    }
+    prog->state = state;
+  }
+
+  if (depth > prog->max_depth) {
+    double *stack = realloc(prog->stack, depth * sizeof(double));
+    if (!stack) {
+      return false;
+    }
+    prog->stack = stack;
+    prog->max_depth = depth;
+  }
+  return true;
+}
+
+bool derived_program_add(struct derived_program *prog, const char *name, const char *expression) {
+  size_t n_ops = prog->n_ops;
+  size_t n_refs = prog->n_refs;
+  size_t n_state = prog->n_state;
+
+  struct derived_parser ps = {
+    .prog = prog,
+    .pos = expression,
+  };
+  parse_expr(&ps);
+  skip_space(&ps);
+  if (*ps.pos != '\0') {
+    ps.error = true;
+  }
+  emit(&ps, (struct derived_op){ .opcode = OP_STORE, .arg = prog->n_outputs });
+  if (!ps.error && !reserve_storage(prog, ps.max_depth)) {
+    ps.error = true;
+  }
+
+  char *copy = ps.error ? NULL : strdup(name);
+  if (!copy) {
+    /* Roll back anything emitted for this channel */
+    for (size_t i = n_refs; i < prog->n_refs; i++) {
+      free(prog->refs[i].name);
+    }
+    prog->n_ops = n_ops;
+    prog->n_refs = n_refs;
+    prog->n_state = n_state;
+    return false;
+  }
+  prog->output_names[prog->n_outputs++] = copy;
+  reset_state(prog);
+  return true;
+}
+
+void derived_program_bind(struct derived_program *prog, size_t n_fields, const struct field_key *keys) {
+  bool changed = false;
+  for (int i = 0; i < prog->n_refs; i++) {
+    struct derived_ref *ref = &prog->refs[i];
+    int32_t field = -1;
+    for (int f = 0; f < n_fields; f++) {
+      if (strcmp(ref->name, keys[f].name) == 0) {
+        field = f;
+        break;
+      }
+    }
+    changed |= ref->field != field;
+    ref->field = field;
+  }
+  /* History is of the same inputs if every reference resolved as before */
+  if (changed) {
+    reset_state(prog);
+  }
+}
+
+static double load_field(const struct derived_program *prog, const struct field_key *keys, const union field_value *values, uint32_t ref) {
+  int32_t field = prog->refs[ref].field;
+  if (field < 0) {
+    return NAN;
+  }
+  if (keys[field].type == FIELD_FLOAT) {
+    return values[field].as_float;
+  }
+  return values[field].as_uint32;
+}
+
+static double run_mean(double *state, uint32_t window, double x) {
+  double *sum = &state[0];
+  double *count = &state[1];
+  double *pos = &state[2];
+  double *ring = &state[3];
+
+  size_t i = *pos;
+  if (*count == window) {
+    *sum -= ring[i];
+  } else {
+    *count += 1;
+  }
+  ring[i] = x;
+  *sum += x;
+  i = (i + 1) % window;
+  *pos = i;
+  if (i == 0) {
+    /* Recompute once per lap so rounding error (or a NaN that has since
+     * left the window) does not accumulate */
+    *sum = 0;
+    for (size_t j = 0; j < *count; j++) {
+      *sum += ring[j];
+    }
+  }
+  return *sum / *count;
+}
+
+void derived_program_run(struct derived_program *prog, size_t n_fields, const struct field_key *keys, union field_value *values) {
+  double *stack = prog->stack;
+  size_t sp = 0;
+
+  for (int i = 0; i < prog->n_ops; i++) {
+    const struct derived_op *op = &prog->ops[i];
+    double *state = has_state(op->opcode) ? &prog->state[op->arg] : NULL;
+    double a, b;
+    switch (op->opcode) {
+      case OP_CONST:
+        stack[sp++] = op->constant;
+        break;
+      case OP_LOAD:
+        stack[sp++] = load_field(prog, keys, values, op->arg);
+        break;
+      case OP_ADD:
+        b = stack[--sp];
+        stack[sp - 1] += b;
+        break;
+      case OP_SUB:
+        b = stack[--sp];
+        stack[sp - 1] -= b;
+        break;
+      case OP_MUL:
+        b = stack[--sp];
+        stack[sp - 1] *= b;
+        break;
+      case OP_DIV:
+        b = stack[--sp];
+        stack[sp - 1] /= b;
+        break;
+      case OP_NEG:
+        stack[sp - 1] = -stack[sp - 1];
+        break;
+      case OP_LT:
+        b = stack[--sp];
+        stack[sp - 1] = stack[sp - 1] < b;
+        break;
+      case OP_GT:
+        b = stack[--sp];
+        stack[sp - 1] = stack[sp - 1] > b;
+        break;
+      case OP_LE:
+        b = stack[--sp];
+        stack[sp - 1] = stack[sp - 1] <= b;
+        break;
+      case OP_GE:
+        b = stack[--sp];
+        stack[sp - 1] = stack[sp - 1] >= b;
+        break;
+      case OP_ABS:
+        a = stack[sp - 1];
+        stack[sp - 1] = a < 0 ? -a : a;
+        break;
+      case OP_MIN:
+        b = stack[--sp];
+        a = stack[sp - 1];
+        stack[sp - 1] = a < b ? a : b;
+        break;
+      case OP_MAX:
+        b = stack[--sp];
+        a = stack[sp - 1];
+        stack[sp - 1] = a > b ? a : b;
+        break;
+      case OP_DELTA:
+        a = stack[sp - 1];
+        stack[sp - 1] = isnan(state[0]) ? 0 : a - state[0];
+        state[0] = a;
+        break;
+      case OP_RATE: {
+        b = stack[--sp]; /* t */
+        a = stack[sp - 1]; /* x */
+        double dt = b - state[1];
+        if (isnan(state[0]) || isnan(state[1]) || dt == 0) {
+          stack[sp - 1] = 0;
+        } else {
+          stack[sp - 1] = (a - state[0]) / dt;
+        }
+        state[0] = a;
+        state[1] = b;
+        break;
+      }
+      case OP_EMA:
+        b = stack[--sp]; /* alpha */
+        a = stack[sp - 1];
+        if (!isnan(state[0])) {
+          a = state[0] + b * (a - state[0]);
+        }
+        state[0] = a;
+        stack[sp - 1] = a;
+        break;
+      case OP_MEAN:
+        stack[sp - 1] = run_mean(state, op->window, stack[sp - 1]);
+        break;
+      case OP_STORE:
+        values[n_fields + op->arg].as_float = stack[--sp];
+        break;
+    }
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef VIAEMS_DERIVED_H
+#define VIAEMS_DERIVED_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Derived channel expressions, compiled into one flat stack program that is
+ * run after every decoded feed frame.
+ *
+ * Grammar:
+ *   expr    := sum [ ('<' | '>' | '<=' | '>=') sum ]
+ *   sum     := term { ('+' | '-') term }
+ *   term    := unary { ('*' | '/') unary }
+ *   unary   := '-' unary | primary
+ *   primary := number | field | function '(' expr { ',' expr } ')' | '(' expr ')'
+ *   field   := identifier ([A-Za-z_][A-Za-z0-9_.]*) or "quoted name"
+ *
+ * Comparisons evaluate to 1 or 0. Functions:
+ *   abs(x), min(a, b), max(a, b)
+ *   delta(x)      change in x since the previous frame
+ *   rate(x, t)    delta(x) / delta(t)
+ *   ema(x, alpha) exponential moving average
+ *   mean(x, n)    moving average over the last n frames, n a constant
+ *
+ * A field missing from the current description evaluates to NaN.
+ * Evaluation is in double precision, so uint32 fields such as timestamps are
+ * exact; results are stored as floats.
+ */
+
+struct derived_program;
+
+struct derived_program *derived_program_create(void);
+void derived_program_destroy(struct derived_program *);
+
+/* Parses and appends one channel, false on a syntax error */
+bool derived_program_add(struct derived_program *, const char *name, const char *expression);
+size_t derived_program_n_outputs(const struct derived_program *);
+const char *derived_program_output_name(const struct derived_program *, size_t output);
+
+/* Resolves field references against a new description. All history
+ * (delta, rate, ema, mean) is reset if any reference now resolves to a
+ * different field, and kept if none does */
+void derived_program_bind(struct derived_program *, size_t n_fields, const struct field_key *keys);
+
+/* Writes output i to values[n_fields + i] as a float */
+void derived_program_run(struct derived_program *, size_t n_fields, const struct field_key *keys, union field_value *values);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "viaems-latest.h"
+
+#define LATEST_INDEX 0x3
+#define LATEST_FRESH 0x4 /* Shared buffer holds a frame the reader has not taken */
+
+/* An old schema is kept while any buffer still refers to it, since one of
+ * them may be the reader's. Only the writer changes which schema a buffer
+ * refers to, so it can tell when one is no longer used */
+struct latest_schema {
+  struct latest_schema *next;
+  size_t n_fields;
+  struct field_key *keys;
+};
+
+struct latest_buffer {
+  uint64_t seq;
+  uint64_t timestamp_ns;
+  const struct latest_schema *schema;
+  size_t capacity;
+  union field_value *values;
+};
+
+struct vp_latest {
+  struct latest_buffer buffers[3];
+  _Atomic uint32_t shared;
+  uint32_t back;  /* Owned by the writer */
+  uint32_t front; /* Owned by the reader */
+  uint64_t seq;
+  struct latest_schema *schemas; /* Newest first */
+  bool schema_ok; /* The newest schema is the current one */
+
+  struct protocol *proto;
+  struct feed_listener listener;
+};
+
+struct vp_latest *vp_latest_create(void) {
+  struct vp_latest *l = malloc(sizeof(struct vp_latest));
+  if (!l) {
+    return NULL;
+  }
+  memset(l, 0, sizeof(struct vp_latest));
+  l->back = 0;
+  atomic_init(&l->shared, 1);
+  l->front = 2;
+  return l;
+}
+
+static void schema_free(struct latest_schema *schema) {
+  for (size_t i = 0; i < schema->n_fields; i++) {
+    free(schema->keys[i].name);
+  }
+  free(schema->keys);
+  free(schema);
+}
+
+static bool schema_equals(const struct latest_schema *schema, size_t n_fields, const struct field_key *keys) {
+  if (schema->n_fields != n_fields) {
+    return false;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    if (schema->keys[i].type != keys[i].type || strcmp(schema->keys[i].name, keys[i].name) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Frees the old schemas that no buffer refers to any more */
+static void release_unused_schemas(struct vp_latest *l) {
+  struct latest_schema **link = &l->schemas->next;
+  while (*link) {
+    struct latest_schema *schema = *link;
+    bool used = false;
+    for (int i = 0; i < 3; i++) {
+      used |= l->buffers[i].schema == schema;
+    }
+    if (used) {
+      link = &schema->next;
+    } else {
+      *link = schema->next;
+      schema_free(schema);
+    }
+  }
+}
+
+void vp_latest_destroy(struct vp_latest *l) {
+  if (l->proto) {
+    viaems_remove_feed_listener(l->proto, &l->listener);
+  }
+  for (int i = 0; i < 3; i++) {
+    free(l->buffers[i].values);
+  }
+  while (l->schemas) {
+    struct latest_schema *schema = l->schemas;
+    l->schemas = schema->next;
+    schema_free(schema);
+  }
+  free(l);
+}
+
+bool vp_latest_set_schema(struct vp_latest *l, size_t n_fields, const struct field_key *keys) {
+  l->schema_ok = l->schemas && schema_equals(l->schemas, n_fields, keys);
+  if (l->schema_ok) {
+    return true;
+  }
+  struct latest_schema *schema = calloc(1, sizeof(struct latest_schema));
+  if (!schema) {
+    return false;
+  }
+  schema->keys = calloc(n_fields ? n_fields : 1, sizeof(struct field_key));
+  if (!schema->keys) {
+    free(schema);
+    return false;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    schema->keys[i].type = keys[i].type;
+    schema->keys[i].name = strdup(keys[i].name);
+    if (!schema->keys[i].name) {
+      schema_free(schema);
+      return false;
+    }
+    schema->n_fields = i + 1;
+  }
+  /* Only linked in once complete, so it is never published partly filled */
+  schema->next = l->schemas;
+  l->schemas = schema;
+  l->schema_ok = true;
+  release_unused_schemas(l);
+  return true;
+}
+
+bool vp_latest_publish(struct vp_latest *l, uint64_t timestamp_ns, const union field_value *values) {
+  const struct latest_schema *schema = l->schemas;
+  if (!l->schema_ok) {
+    return false;
+  }
+
+  struct latest_buffer *b = &l->buffers[l->back];
+  if (b->capacity < schema->n_fields) {
+    union field_value *grown = realloc(b->values, schema->n_fields * sizeof(union field_value));
+    if (!grown) {
+      return false;
+    }
+    b->values = grown;
+    b->capacity = schema->n_fields;
+  }
+  memcpy(b->values, values, schema->n_fields * sizeof(union field_value));
+  b->schema = schema;
+  b->timestamp_ns = timestamp_ns;
+  b->seq = ++l->seq;
+
+  uint32_t previous = atomic_exchange_explicit(&l->shared, l->back | LATEST_FRESH, memory_order_acq_rel);
+  l->back = previous & LATEST_INDEX;
+  if (schema->next) {
+    release_unused_schemas(l);
+  }
+  return true;
+}
+
+static void latest_feed_schema(void *userdata, size_t n_fields, const struct field_key *keys) {
+  vp_latest_set_schema(userdata, n_fields, keys);
+}
+
+static void latest_feed_frame(void *userdata, size_t n_fields, const struct field_key *keys, const union field_value *values) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  vp_latest_publish(userdata, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, values);
+}
+
+bool vp_latest_attach(struct vp_latest *l, struct protocol *p) {
+  l->listener = (struct feed_listener){
+    .schema = latest_feed_schema,
+    .frame = latest_feed_frame,
+    .userdata = l,
+  };
+  if (!viaems_add_feed_listener(p, &l->listener)) {
+    return false;
+  }
+  l->proto = p;
+  return true;
+}
+
+bool vp_latest_get(struct vp_latest *l, struct vp_latest_frame *dest) {
+  if (atomic_load_explicit(&l->shared, memory_order_relaxed) & LATEST_FRESH) {
+    uint32_t previous = atomic_exchange_explicit(&l->shared, l->front, memory_order_acq_rel);
+    l->front = previous & LATEST_INDEX;
+  }
+
+  const struct latest_buffer *b = &l->buffers[l->front];
+  if (b->seq == 0) {
+    return false;
+  }
+  *dest = (struct vp_latest_frame){
+    .seq = b->seq,
+    .timestamp_ns = b->timestamp_ns,
+    .n_fields = b->schema->n_fields,
+    .keys = b->schema->keys,
+    .values = b->values,
+  };
+  return true;
+}
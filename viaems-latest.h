@@ -0,0 +1,50 @@
+#ifndef VIAEMS_LATEST_H
+#define VIAEMS_LATEST_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Latest feed frame, for readers that only want the newest one (a UI
+ * rendering at 60 Hz while the feed runs at several kHz).
+ *
+ * Frames are published into a triple buffer: the writer always has a
+ * buffer of its own to fill, and swaps it with the shared one when done;
+ * the reader swaps its buffer with the shared one only when that holds a
+ * newer frame. Neither side waits on the other, and the reader always sees
+ * a whole frame. There is one writer thread (normally the receive thread,
+ * via vp_latest_attach) and one reader thread.
+ */
+
+struct vp_latest_frame {
+  uint64_t seq; /* Increments with every published frame */
+  uint64_t timestamp_ns;
+  size_t n_fields;
+  const struct field_key *keys;
+  const union field_value *values;
+};
+
+struct vp_latest;
+
+struct vp_latest *vp_latest_create(void);
+void vp_latest_destroy(struct vp_latest *);
+
+/* A schema equal to the current one is ignored. Until one is set, or after
+ * setting one fails, publish returns false */
+bool vp_latest_set_schema(struct vp_latest *, size_t n_fields, const struct field_key *keys);
+bool vp_latest_publish(struct vp_latest *, uint64_t timestamp_ns, const union field_value *values);
+
+/* Publish a live feed, timestamped with CLOCK_MONOTONIC on arrival */
+bool vp_latest_attach(struct vp_latest *, struct protocol *);
+
+/* Newest frame, false if none has been published yet. The frame stays valid
+ * until the next call; compare seq to skip frames already seen */
+bool vp_latest_get(struct vp_latest *, struct vp_latest_frame *dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
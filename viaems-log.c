@@ -0,0 +1,1005 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "viaems-log.h"
+
+/* File layout, all integers little endian:
+ *
+ *   "VEMSLOG1"
+ *   chunk data, each chunk being its timestamp column then field columns
+ *   footer:
+ *     u32 n_schemas
+ *       u32 n_fields, then per field: u8 type, u16 name length, name
+ *     u32 n_chunks
+ *       u64 offset, u32 schema, u32 n_rows, u64 first_ns, u64 last_ns,
+ *       u32 timestamps length, then per field: u32 length, u32 min, u32 max
+ *   u64 footer offset
+ *   "VEMSEND1"
+ */
+#define LOG_MAGIC "VEMSLOG1"
+#define LOG_END_MAGIC "VEMSEND1"
+#define LOG_MAGIC_LEN 8
+#define LOG_TRAILER_LEN (8 + LOG_MAGIC_LEN)
+#define MAX_PENDING_CHUNKS 8
+
+static void check_thrd(int val) {
+  assert(val == thrd_success);
+}
+
+struct log_schema {
+  size_t n_fields;
+  struct field_key *keys;
+};
+
+struct log_column_index {
+  uint32_t len;
+  union field_value min;
+  union field_value max;
+};
+
+struct log_chunk_index {
+  uint64_t offset;
+  uint32_t schema;
+  uint32_t n_rows;
+  uint64_t first_ns;
+  uint64_t last_ns;
+  uint32_t timestamps_len;
+  struct log_column_index *columns;
+};
+
+/* Rows are stored column-major while a chunk fills */
+struct log_chunk {
+  struct log_chunk *next;
+  uint32_t schema;
+  size_t n_fields;
+  size_t n_rows;
+  size_t fields_capacity;
+  uint64_t timestamps[VP_LOG_CHUNK_ROWS];
+  union field_value *columns;
+};
+
+/* Growable byte buffer, used for encoding and for the footer */
+struct log_buf {
+  uint8_t *data;
+  size_t len;
+  size_t capacity;
+  bool failed;
+};
+
+struct vp_log_writer {
+  FILE *file;
+  uint64_t offset;
+
+  struct protocol *proto;
+  struct feed_listener listener;
+
+  /* Appending side */
+  struct log_chunk *current;
+
+  mtx_t mtx; /* Protects everything below */
+  cnd_t cnd;
+  cnd_t space_cnd; /* Signalled when a pending chunk is taken */
+  thrd_t thrd;
+  bool closing;
+  bool failed;
+  bool blocking;
+  struct log_chunk *pending_head;
+  struct log_chunk *pending_tail;
+  size_t n_pending;
+  struct log_chunk *free_chunks;
+
+  size_t n_schemas;
+  struct log_schema *schemas;
+
+  /* Only touched by the writer thread until it has exited */
+  size_t n_chunks;
+  struct log_chunk_index *chunks;
+
+  _Atomic uint64_t dropped_rows;
+};
+
+static void buf_reserve(struct log_buf *b, size_t extra) {
+  if (b->failed || b->len + extra <= b->capacity) {
+    return;
+  }
+  size_t capacity = b->capacity ? b->capacity : 4096;
+  while (capacity < b->len + extra) {
+    capacity *= 2;
+  }
+  uint8_t *data = realloc(b->data, capacity);
+  if (!data) {
+    b->failed = true;
+    return;
+  }
+  b->data = data;
+  b->capacity = capacity;
+}
+
+static void buf_put(struct log_buf *b, const void *bytes, size_t len) {
+  buf_reserve(b, len);
+  if (b->failed) {
+    return;
+  }
+  memcpy(b->data + b->len, bytes, len);
+  b->len += len;
+}
+
+static void buf_put_le(struct log_buf *b, uint64_t value, size_t len) {
+  uint8_t bytes[8];
+  for (int i = 0; i < len; i++) {
+    bytes[i] = value >> (8 * i);
+  }
+  buf_put(b, bytes, len);
+}
+
+static void buf_put_varint(struct log_buf *b, uint64_t value) {
+  uint8_t bytes[10];
+  size_t len = 0;
+  do {
+    bytes[len] = value & 0x7f;
+    value >>= 7;
+    if (value) {
+      bytes[len] |= 0x80;
+    }
+    len++;
+  } while (value);
+  buf_put(b, bytes, len);
+}
+
+static uint64_t zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* MSB-first bit writer for the XOR float columns */
+struct bit_writer {
+  struct log_buf *buf;
+  uint64_t bits;
+  int n_bits;
+};
+
+static void bits_put(struct bit_writer *w, uint32_t value, int n_bits) {
+  for (int i = n_bits - 1; i >= 0; i--) {
+    w->bits = (w->bits << 1) | ((value >> i) & 1);
+    w->n_bits++;
+    if (w->n_bits == 8) {
+      uint8_t byte = w->bits;
+      buf_put(w->buf, &byte, 1);
+      w->bits = 0;
+      w->n_bits = 0;
+    }
+  }
+}
+
+static void bits_flush(struct bit_writer *w) {
+  if (w->n_bits > 0) {
+    bits_put(w, 0, 8 - w->n_bits);
+  }
+}
+
+struct bit_reader {
+  const uint8_t *data;
+  size_t len;
+  size_t pos; /* In bits */
+  bool overrun;
+};
+
+static uint32_t bits_get(struct bit_reader *r, int n_bits) {
+  uint32_t value = 0;
+  for (int i = 0; i < n_bits; i++) {
+    if (r->pos >= r->len * 8) {
+      r->overrun = true;
+      return 0;
+    }
+    value = (value << 1) | ((r->data[r->pos / 8] >> (7 - r->pos % 8)) & 1);
+    r->pos++;
+  }
+  return value;
+}
+
+static void encode_timestamps(struct log_buf *b, const uint64_t *ts, size_t n_rows) {
+  int64_t prev_delta = 0;
+  for (size_t i = 0; i < n_rows; i++) {
+    if (i == 0) {
+      buf_put_varint(b, ts[0]);
+      continue;
+    }
+    int64_t delta = ts[i] - ts[i - 1];
+    buf_put_varint(b, zigzag(delta - prev_delta));
+    prev_delta = delta;
+  }
+}
+
+static void encode_uint32_column(struct log_buf *b, const union field_value *values, size_t n_rows) {
+  uint32_t prev = 0;
+  for (size_t i = 0; i < n_rows; i++) {
+    buf_put_varint(b, zigzag((int64_t)values[i].as_uint32 - prev));
+    prev = values[i].as_uint32;
+  }
+}
+
+/* Gorilla style: unchanged values cost one bit, and changes that fit in the
+ * previous leading/trailing zero window skip the window header */
+static void encode_float_column(struct log_buf *b, const union field_value *values, size_t n_rows) {
+  struct bit_writer w = { .buf = b };
+  uint32_t prev = 0;
+  int prev_lead = -1;
+  int prev_trail = 0;
+  for (size_t i = 0; i < n_rows; i++) {
+    uint32_t cur = values[i].as_uint32;
+    if (i == 0) {
+      bits_put(&w, cur, 32);
+      prev = cur;
+      continue;
+    }
+    uint32_t x = cur ^ prev;
+    prev = cur;
+    if (x == 0) {
+      bits_put(&w, 0, 1);
+      continue;
+    }
+    bits_put(&w, 1, 1);
+    int lead = __builtin_clz(x);
+    int trail = __builtin_ctz(x);
+    if (prev_lead >= 0 && lead >= prev_lead && trail >= prev_trail) {
+      bits_put(&w, 0, 1);
+      bits_put(&w, x >> prev_trail, 32 - prev_lead - prev_trail);
+    } else {
+      int significant = 32 - lead - trail;
+      bits_put(&w, 1, 1);
+      bits_put(&w, lead, 5);
+      bits_put(&w, significant - 1, 5);
+      bits_put(&w, x >> trail, significant);
+      prev_lead = lead;
+      prev_trail = trail;
+    }
+  }
+  bits_flush(&w);
+}
+
+static void column_range(const union field_value *values, size_t n_rows, feed_field_type type, union field_value *min, union field_value *max) {
+  *min = values[0];
+  *max = values[0];
+  for (size_t i = 1; i < n_rows; i++) {
+    if (type == FIELD_FLOAT) {
+      if (values[i].as_float < min->as_float) {
+        min->as_float = values[i].as_float;
+      }
+      if (values[i].as_float > max->as_float) {
+        max->as_float = values[i].as_float;
+      }
+    } else {
+      if (values[i].as_uint32 < min->as_uint32) {
+        min->as_uint32 = values[i].as_uint32;
+      }
+      if (values[i].as_uint32 > max->as_uint32) {
+        max->as_uint32 = values[i].as_uint32;
+      }
+    }
+  }
+}
+
+/* Runs on the writer thread, without the writer mutex held except for the
+ * schema lookup: schemas are never modified once added */
+static bool write_chunk(struct vp_log_writer *w, struct log_chunk *chunk, struct log_buf *out) {
+  check_thrd(mtx_lock(&w->mtx));
+  const struct log_schema *schema = &w->schemas[chunk->schema];
+  const struct field_key *keys = schema->keys;
+  check_thrd(mtx_unlock(&w->mtx));
+
+  struct log_chunk_index index = {
+    .offset = w->offset,
+    .schema = chunk->schema,
+    .n_rows = chunk->n_rows,
+    .first_ns = chunk->timestamps[0],
+    .last_ns = chunk->timestamps[chunk->n_rows - 1],
+    .columns = calloc(chunk->n_fields ? chunk->n_fields : 1, sizeof(struct log_column_index)),
+  };
+  struct log_chunk_index *chunks = realloc(w->chunks, (w->n_chunks + 1) * sizeof(struct log_chunk_index));
+  if (!index.columns || !chunks) {
+    free(index.columns);
+    return false;
+  }
+  w->chunks = chunks;
+
+  out->len = 0;
+  encode_timestamps(out, chunk->timestamps, chunk->n_rows);
+  index.timestamps_len = out->len;
+  for (size_t f = 0; f < chunk->n_fields; f++) {
+    const union field_value *column = &chunk->columns[f * VP_LOG_CHUNK_ROWS];
+    size_t start = out->len;
+    if (keys[f].type == FIELD_FLOAT) {
+      encode_float_column(out, column, chunk->n_rows);
+    } else {
+      encode_uint32_column(out, column, chunk->n_rows);
+    }
+    index.columns[f].len = out->len - start;
+    column_range(column, chunk->n_rows, keys[f].type, &index.columns[f].min, &index.columns[f].max);
+  }
+  if (out->failed || fwrite(out->data, 1, out->len, w->file) != out->len) {
+    free(index.columns);
+    return false;
+  }
+  w->offset += out->len;
+  w->chunks[w->n_chunks++] = index;
+  return true;
+}
+
+static int writer_loop(void *ptr) {
+  struct vp_log_writer *w = ptr;
+  struct log_buf out = { 0 };
+
+  check_thrd(mtx_lock(&w->mtx));
+  while (true) {
+    if (!w->pending_head) {
+      if (w->closing) {
+        break;
+      }
+      check_thrd(cnd_wait(&w->cnd, &w->mtx));
+      continue;
+    }
+    struct log_chunk *chunk = w->pending_head;
+    w->pending_head = chunk->next;
+    if (!w->pending_head) {
+      w->pending_tail = NULL;
+    }
+    w->n_pending -= 1;
+    check_thrd(cnd_signal(&w->space_cnd));
+    check_thrd(mtx_unlock(&w->mtx));
+
+    bool success = write_chunk(w, chunk, &out);
+
+    check_thrd(mtx_lock(&w->mtx));
+    if (!success) {
+      w->failed = true;
+    }
+    chunk->next = w->free_chunks;
+    w->free_chunks = chunk;
+  }
+  check_thrd(mtx_unlock(&w->mtx));
+  free(out.data);
+  return 0;
+}
+
+struct vp_log_writer *vp_log_writer_create(const char *path) {
+  struct vp_log_writer *w = malloc(sizeof(struct vp_log_writer));
+  if (!w) {
+    return NULL;
+  }
+  memset(w, 0, sizeof(struct vp_log_writer));
+
+  w->file = fopen(path, "wb");
+  if (!w->file) {
+    free(w);
+    return NULL;
+  }
+  if (fwrite(LOG_MAGIC, 1, LOG_MAGIC_LEN, w->file) != LOG_MAGIC_LEN) {
+    fclose(w->file);
+    free(w);
+    return NULL;
+  }
+  w->offset = LOG_MAGIC_LEN;
+
+  mtx_init(&w->mtx, mtx_plain);
+  cnd_init(&w->cnd);
+  cnd_init(&w->space_cnd);
+  if (thrd_create(&w->thrd, writer_loop, w) != thrd_success) {
+    cnd_destroy(&w->space_cnd);
+    cnd_destroy(&w->cnd);
+    mtx_destroy(&w->mtx);
+    fclose(w->file);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+/* Hands the current chunk to the writer thread */
+static void flush_current(struct vp_log_writer *w) {
+  struct log_chunk *chunk = w->current;
+  w->current = NULL;
+  if (!chunk) {
+    return;
+  }
+
+  check_thrd(mtx_lock(&w->mtx));
+  while (w->blocking && chunk->n_rows > 0 && w->n_pending >= MAX_PENDING_CHUNKS) {
+    check_thrd(cnd_wait(&w->space_cnd, &w->mtx));
+  }
+  if (chunk->n_rows == 0) {
+    chunk->next = w->free_chunks;
+    w->free_chunks = chunk;
+  } else if (w->n_pending >= MAX_PENDING_CHUNKS) {
+    atomic_fetch_add_explicit(&w->dropped_rows, chunk->n_rows, memory_order_relaxed);
+    chunk->next = w->free_chunks;
+    w->free_chunks = chunk;
+  } else {
+    chunk->next = NULL;
+    if (w->pending_tail) {
+      w->pending_tail->next = chunk;
+    } else {
+      w->pending_head = chunk;
+    }
+    w->pending_tail = chunk;
+    w->n_pending += 1;
+    check_thrd(cnd_signal(&w->cnd));
+  }
+  check_thrd(mtx_unlock(&w->mtx));
+}
+
+/* Takes a recycled chunk if one is available, only allocating while the
+ * pool warms up or when the schema grows */
+static struct log_chunk *take_chunk(struct vp_log_writer *w) {
+  check_thrd(mtx_lock(&w->mtx));
+  struct log_chunk *chunk = w->free_chunks;
+  if (chunk) {
+    w->free_chunks = chunk->next;
+  }
+  uint32_t schema = w->n_schemas - 1;
+  size_t n_fields = w->schemas[schema].n_fields;
+  check_thrd(mtx_unlock(&w->mtx));
+
+  if (!chunk) {
+    chunk = calloc(1, sizeof(struct log_chunk));
+    if (!chunk) {
+      return NULL;
+    }
+  }
+  if (chunk->fields_capacity < n_fields) {
+    union field_value *columns = realloc(chunk->columns, n_fields * VP_LOG_CHUNK_ROWS * sizeof(union field_value));
+    if (!columns) {
+      free(chunk->columns);
+      free(chunk);
+      return NULL;
+    }
+    chunk->columns = columns;
+    chunk->fields_capacity = n_fields;
+  }
+  chunk->next = NULL;
+  chunk->schema = schema;
+  chunk->n_fields = n_fields;
+  chunk->n_rows = 0;
+  return chunk;
+}
+
+static bool schema_equals(const struct log_schema *schema, size_t n_fields, const struct field_key *keys) {
+  if (schema->n_fields != n_fields) {
+    return false;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    if (schema->keys[i].type != keys[i].type || strcmp(schema->keys[i].name, keys[i].name) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool vp_log_writer_set_schema(struct vp_log_writer *w, size_t n_fields, const struct field_key *keys) {
+  check_thrd(mtx_lock(&w->mtx));
+  bool unchanged = w->n_schemas > 0 && schema_equals(&w->schemas[w->n_schemas - 1], n_fields, keys);
+  check_thrd(mtx_unlock(&w->mtx));
+  if (unchanged) {
+    return true;
+  }
+
+  flush_current(w);
+
+  struct field_key *copy = calloc(n_fields ? n_fields : 1, sizeof(struct field_key));
+  if (!copy) {
+    return false;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    copy[i].type = keys[i].type;
+    copy[i].name = strdup(keys[i].name);
+    if (!copy[i].name) {
+      for (size_t j = 0; j < i; j++) {
+        free(copy[j].name);
+      }
+      free(copy);
+      return false;
+    }
+  }
+
+  check_thrd(mtx_lock(&w->mtx));
+  struct log_schema *schemas = realloc(w->schemas, (w->n_schemas + 1) * sizeof(struct log_schema));
+  if (schemas) {
+    w->schemas = schemas;
+    w->schemas[w->n_schemas++] = (struct log_schema){ .n_fields = n_fields, .keys = copy };
+  }
+  check_thrd(mtx_unlock(&w->mtx));
+  if (!schemas) {
+    for (size_t i = 0; i < n_fields; i++) {
+      free(copy[i].name);
+    }
+    free(copy);
+    return false;
+  }
+  return true;
+}
+
+bool vp_log_writer_append(struct vp_log_writer *w, uint64_t timestamp_ns, const union field_value *values) {
+  if (w->n_schemas == 0) {
+    return false;
+  }
+  if (!w->current) {
+    w->current = take_chunk(w);
+    if (!w->current) {
+      atomic_fetch_add_explicit(&w->dropped_rows, 1, memory_order_relaxed);
+      return false;
+    }
+  }
+
+  struct log_chunk *chunk = w->current;
+  size_t row = chunk->n_rows++;
+  chunk->timestamps[row] = timestamp_ns;
+  for (size_t f = 0; f < chunk->n_fields; f++) {
+    chunk->columns[f * VP_LOG_CHUNK_ROWS + row] = values[f];
+  }
+  if (chunk->n_rows == VP_LOG_CHUNK_ROWS) {
+    flush_current(w);
+  }
+  return true;
+}
+
+void vp_log_writer_set_blocking(struct vp_log_writer *w, bool blocking) {
+  check_thrd(mtx_lock(&w->mtx));
+  w->blocking = blocking;
+  check_thrd(mtx_unlock(&w->mtx));
+}
+
+uint64_t vp_log_writer_dropped_rows(struct vp_log_writer *w) {
+  return atomic_load_explicit(&w->dropped_rows, memory_order_relaxed);
+}
+
+static void log_feed_schema(void *userdata, size_t n_fields, const struct field_key *keys) {
+  vp_log_writer_set_schema(userdata, n_fields, keys);
+}
+
+static void log_feed_frame(void *userdata, size_t n_fields, const struct field_key *keys, const union field_value *values) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  vp_log_writer_append(userdata, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, values);
+}
+
+bool vp_log_writer_attach(struct vp_log_writer *w, struct protocol *p) {
+  w->listener = (struct feed_listener){
+    .schema = log_feed_schema,
+    .frame = log_feed_frame,
+    .userdata = w,
+  };
+  if (!viaems_add_feed_listener(p, &w->listener)) {
+    return false;
+  }
+  w->proto = p;
+  return true;
+}
+
+static void write_footer(struct vp_log_writer *w, struct log_buf *b) {
+  uint64_t footer_offset = w->offset;
+
+  buf_put_le(b, w->n_schemas, 4);
+  for (size_t s = 0; s < w->n_schemas; s++) {
+    const struct log_schema *schema = &w->schemas[s];
+    buf_put_le(b, schema->n_fields, 4);
+    for (size_t f = 0; f < schema->n_fields; f++) {
+      size_t name_len = strlen(schema->keys[f].name);
+      buf_put_le(b, schema->keys[f].type, 1);
+      buf_put_le(b, name_len, 2);
+      buf_put(b, schema->keys[f].name, name_len);
+    }
+  }
+
+  buf_put_le(b, w->n_chunks, 4);
+  for (size_t c = 0; c < w->n_chunks; c++) {
+    const struct log_chunk_index *index = &w->chunks[c];
+    buf_put_le(b, index->offset, 8);
+    buf_put_le(b, index->schema, 4);
+    buf_put_le(b, index->n_rows, 4);
+    buf_put_le(b, index->first_ns, 8);
+    buf_put_le(b, index->last_ns, 8);
+    buf_put_le(b, index->timestamps_len, 4);
+    for (size_t f = 0; f < w->schemas[index->schema].n_fields; f++) {
+      buf_put_le(b, index->columns[f].len, 4);
+      buf_put_le(b, index->columns[f].min.as_uint32, 4);
+      buf_put_le(b, index->columns[f].max.as_uint32, 4);
+    }
+  }
+
+  buf_put_le(b, footer_offset, 8);
+  buf_put(b, LOG_END_MAGIC, LOG_MAGIC_LEN);
+}
+
+bool vp_log_writer_close(struct vp_log_writer *w) {
+  if (w->proto) {
+    viaems_remove_feed_listener(w->proto, &w->listener);
+  }
+  flush_current(w);
+
+  check_thrd(mtx_lock(&w->mtx));
+  w->closing = true;
+  check_thrd(cnd_signal(&w->cnd));
+  check_thrd(mtx_unlock(&w->mtx));
+  thrd_join(w->thrd, NULL);
+
+  struct log_buf footer = { 0 };
+  write_footer(w, &footer);
+  bool success = !w->failed && !footer.failed &&
+                 fwrite(footer.data, 1, footer.len, w->file) == footer.len;
+  free(footer.data);
+  if (fclose(w->file) != 0) {
+    success = false;
+  }
+
+  while (w->free_chunks) {
+    struct log_chunk *chunk = w->free_chunks;
+    w->free_chunks = chunk->next;
+    free(chunk->columns);
+    free(chunk);
+  }
+  for (size_t c = 0; c < w->n_chunks; c++) {
+    free(w->chunks[c].columns);
+  }
+  for (size_t s = 0; s < w->n_schemas; s++) {
+    for (size_t f = 0; f < w->schemas[s].n_fields; f++) {
+      free(w->schemas[s].keys[f].name);
+    }
+    free(w->schemas[s].keys);
+  }
+  free(w->chunks);
+  free(w->schemas);
+  cnd_destroy(&w->cnd);
+  cnd_destroy(&w->space_cnd);
+  mtx_destroy(&w->mtx);
+  free(w);
+  return success;
+}
+
+struct vp_log_reader {
+  int fd;
+  size_t n_schemas;
+  struct log_schema *schemas;
+  size_t n_chunks;
+  struct log_chunk_index *chunks;
+};
+
+/* Bounds checked cursor over the footer */
+struct log_cursor {
+  const uint8_t *data;
+  size_t len;
+  size_t pos;
+  bool overrun;
+};
+
+static uint64_t cursor_le(struct log_cursor *c, size_t len) {
+  if (c->pos + len > c->len) {
+    c->overrun = true;
+    return 0;
+  }
+  uint64_t value = 0;
+  for (int i = len - 1; i >= 0; i--) {
+    value = (value << 8) | c->data[c->pos + i];
+  }
+  c->pos += len;
+  return value;
+}
+
+static bool read_exact(int fd, void *dest, size_t len, uint64_t offset) {
+  uint8_t *d = dest;
+  while (len > 0) {
+    ssize_t amt = pread(fd, d, len, offset);
+    if (amt <= 0) {
+      return false;
+    }
+    d += amt;
+    len -= amt;
+    offset += amt;
+  }
+  return true;
+}
+
+static bool parse_footer(struct vp_log_reader *r, struct log_cursor *c) {
+  r->n_schemas = cursor_le(c, 4);
+  if (c->overrun || r->n_schemas > c->len) {
+    return false;
+  }
+  r->schemas = calloc(r->n_schemas ? r->n_schemas : 1, sizeof(struct log_schema));
+  if (!r->schemas) {
+    return false;
+  }
+  for (size_t s = 0; s < r->n_schemas; s++) {
+    size_t n_fields = cursor_le(c, 4);
+    if (c->overrun || n_fields > c->len) {
+      return false;
+    }
+    r->schemas[s].keys = calloc(n_fields ? n_fields : 1, sizeof(struct field_key));
+    if (!r->schemas[s].keys) {
+      return false;
+    }
+    r->schemas[s].n_fields = n_fields;
+    for (size_t f = 0; f < n_fields; f++) {
+      r->schemas[s].keys[f].type = cursor_le(c, 1);
+      size_t name_len = cursor_le(c, 2);
+      if (c->overrun || c->pos + name_len > c->len) {
+        return false;
+      }
+      r->schemas[s].keys[f].name = strndup((const char *)c->data + c->pos, name_len);
+      if (!r->schemas[s].keys[f].name) {
+        return false;
+      }
+      c->pos += name_len;
+    }
+  }
+
+  r->n_chunks = cursor_le(c, 4);
+  if (c->overrun || r->n_chunks > c->len) {
+    return false;
+  }
+  r->chunks = calloc(r->n_chunks ? r->n_chunks : 1, sizeof(struct log_chunk_index));
+  if (!r->chunks) {
+    return false;
+  }
+  for (size_t i = 0; i < r->n_chunks; i++) {
+    struct log_chunk_index *index = &r->chunks[i];
+    index->offset = cursor_le(c, 8);
+    index->schema = cursor_le(c, 4);
+    index->n_rows = cursor_le(c, 4);
+    index->first_ns = cursor_le(c, 8);
+    index->last_ns = cursor_le(c, 8);
+    index->timestamps_len = cursor_le(c, 4);
+    if (c->overrun || index->schema >= r->n_schemas) {
+      return false;
+    }
+    size_t n_fields = r->schemas[index->schema].n_fields;
+    index->columns = calloc(n_fields ? n_fields : 1, sizeof(struct log_column_index));
+    if (!index->columns) {
+      return false;
+    }
+    for (size_t f = 0; f < n_fields; f++) {
+      index->columns[f].len = cursor_le(c, 4);
+      index->columns[f].min.as_uint32 = cursor_le(c, 4);
+      index->columns[f].max.as_uint32 = cursor_le(c, 4);
+    }
+  }
+  return !c->overrun;
+}
+
+struct vp_log_reader *vp_log_reader_open(const char *path) {
+  struct vp_log_reader *r = malloc(sizeof(struct vp_log_reader));
+  if (!r) {
+    return NULL;
+  }
+  memset(r, 0, sizeof(struct vp_log_reader));
+  r->fd = open(path, O_RDONLY);
+  if (r->fd < 0) {
+    free(r);
+    return NULL;
+  }
+
+  off_t size = lseek(r->fd, 0, SEEK_END);
+  uint8_t trailer[LOG_TRAILER_LEN];
+  if (size < LOG_MAGIC_LEN + LOG_TRAILER_LEN ||
+      !read_exact(r->fd, trailer, sizeof(trailer), size - LOG_TRAILER_LEN) ||
+      memcmp(trailer + 8, LOG_END_MAGIC, LOG_MAGIC_LEN) != 0) {
+    vp_log_reader_close(r);
+    return NULL;
+  }
+  struct log_cursor tc = { .data = trailer, .len = 8 };
+  uint64_t footer_offset = cursor_le(&tc, 8);
+  if (footer_offset < LOG_MAGIC_LEN || footer_offset > size - LOG_TRAILER_LEN) {
+    vp_log_reader_close(r);
+    return NULL;
+  }
+
+  size_t footer_len = size - LOG_TRAILER_LEN - footer_offset;
+  uint8_t *footer = malloc(footer_len ? footer_len : 1);
+  struct log_cursor c = { .data = footer, .len = footer_len };
+  if (!footer || !read_exact(r->fd, footer, footer_len, footer_offset) || !parse_footer(r, &c)) {
+    free(footer);
+    vp_log_reader_close(r);
+    return NULL;
+  }
+  free(footer);
+  return r;
+}
+
+void vp_log_reader_close(struct vp_log_reader *r) {
+  for (size_t s = 0; s < r->n_schemas && r->schemas; s++) {
+    for (size_t f = 0; f < r->schemas[s].n_fields; f++) {
+      free(r->schemas[s].keys[f].name);
+    }
+    free(r->schemas[s].keys);
+  }
+  for (size_t c = 0; c < r->n_chunks && r->chunks; c++) {
+    free(r->chunks[c].columns);
+  }
+  free(r->schemas);
+  free(r->chunks);
+  if (r->fd >= 0) {
+    close(r->fd);
+  }
+  free(r);
+}
+
+size_t vp_log_reader_n_schemas(struct vp_log_reader *r) {
+  return r->n_schemas;
+}
+
+size_t vp_log_reader_n_fields(struct vp_log_reader *r, size_t schema) {
+  return r->schemas[schema].n_fields;
+}
+
+const struct field_key *vp_log_reader_fields(struct vp_log_reader *r, size_t schema) {
+  return r->schemas[schema].keys;
+}
+
+int vp_log_reader_find_field(struct vp_log_reader *r, size_t schema, const char *name) {
+  for (int f = 0; f < r->schemas[schema].n_fields; f++) {
+    if (strcmp(r->schemas[schema].keys[f].name, name) == 0) {
+      return f;
+    }
+  }
+  return -1;
+}
+
+size_t vp_log_reader_n_chunks(struct vp_log_reader *r) {
+  return r->n_chunks;
+}
+
+bool vp_log_reader_chunk_info(struct vp_log_reader *r, size_t chunk, struct vp_log_chunk_info *info) {
+  if (chunk >= r->n_chunks) {
+    return false;
+  }
+  *info = (struct vp_log_chunk_info){
+    .schema = r->chunks[chunk].schema,
+    .n_rows = r->chunks[chunk].n_rows,
+    .first_ns = r->chunks[chunk].first_ns,
+    .last_ns = r->chunks[chunk].last_ns,
+  };
+  return true;
+}
+
+size_t vp_log_reader_seek(struct vp_log_reader *r, uint64_t timestamp_ns) {
+  size_t lo = 0;
+  size_t hi = r->n_chunks;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (r->chunks[mid].last_ns < timestamp_ns) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+bool vp_log_reader_field_range(struct vp_log_reader *r, size_t chunk, size_t field, union field_value *min, union field_value *max) {
+  if (chunk >= r->n_chunks || field >= r->schemas[r->chunks[chunk].schema].n_fields) {
+    return false;
+  }
+  *min = r->chunks[chunk].columns[field].min;
+  *max = r->chunks[chunk].columns[field].max;
+  return true;
+}
+
+static uint8_t *read_column(struct vp_log_reader *r, uint64_t offset, size_t len) {
+  uint8_t *data = malloc(len ? len : 1);
+  if (!data) {
+    return NULL;
+  }
+  if (!read_exact(r->fd, data, len, offset)) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+static bool get_varint(struct log_cursor *c, uint64_t *dest) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (c->pos >= c->len) {
+      return false;
+    }
+    uint8_t byte = c->data[c->pos++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *dest = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool vp_log_reader_read_timestamps(struct vp_log_reader *r, size_t chunk, uint64_t *dest) {
+  if (chunk >= r->n_chunks) {
+    return false;
+  }
+  const struct log_chunk_index *index = &r->chunks[chunk];
+  uint8_t *data = read_column(r, index->offset, index->timestamps_len);
+  if (!data) {
+    return false;
+  }
+
+  struct log_cursor c = { .data = data, .len = index->timestamps_len };
+  int64_t delta = 0;
+  bool success = true;
+  for (size_t i = 0; i < index->n_rows && success; i++) {
+    uint64_t raw;
+    success = get_varint(&c, &raw);
+    if (i == 0) {
+      dest[0] = raw;
+    } else {
+      delta += unzigzag(raw);
+      dest[i] = dest[i - 1] + delta;
+    }
+  }
+  free(data);
+  return success;
+}
+
+static bool decode_float_column(const uint8_t *data, size_t len, size_t n_rows, union field_value *dest) {
+  struct bit_reader br = { .data = data, .len = len };
+  uint32_t prev = 0;
+  int lead = 0;
+  int trail = 0;
+  for (size_t i = 0; i < n_rows; i++) {
+    if (i == 0) {
+      prev = bits_get(&br, 32);
+    } else if (bits_get(&br, 1)) {
+      if (bits_get(&br, 1)) {
+        lead = bits_get(&br, 5);
+        int significant = bits_get(&br, 5) + 1;
+        trail = 32 - lead - significant;
+      }
+      prev ^= bits_get(&br, 32 - lead - trail) << trail;
+    }
+    dest[i].as_uint32 = prev;
+  }
+  return !br.overrun;
+}
+
+bool vp_log_reader_read_field(struct vp_log_reader *r, size_t chunk, size_t field, union field_value *dest) {
+  if (chunk >= r->n_chunks) {
+    return false;
+  }
+  const struct log_chunk_index *index = &r->chunks[chunk];
+  const struct log_schema *schema = &r->schemas[index->schema];
+  if (field >= schema->n_fields) {
+    return false;
+  }
+
+  uint64_t offset = index->offset + index->timestamps_len;
+  for (size_t f = 0; f < field; f++) {
+    offset += index->columns[f].len;
+  }
+  size_t len = index->columns[field].len;
+  uint8_t *data = read_column(r, offset, len);
+  if (!data) {
+    return false;
+  }
+
+  bool success = true;
+  if (schema->keys[field].type == FIELD_FLOAT) {
+    success = decode_float_column(data, len, index->n_rows, dest);
+  } else {
+    struct log_cursor c = { .data = data, .len = len };
+    uint32_t prev = 0;
+    for (size_t i = 0; i < index->n_rows && success; i++) {
+      uint64_t raw;
+      success = get_varint(&c, &raw);
+      prev += unzigzag(raw);
+      dest[i].as_uint32 = prev;
+    }
+  }
+  free(data);
+  return success;
+}
@@ -0,0 +1,80 @@
+#ifndef VIAEMS_LOG_H
+#define VIAEMS_LOG_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Columnar telemetry log.
+ *
+ * Rows are collected into chunks of up to VP_LOG_CHUNK_ROWS and each chunk
+ * is stored column by column: timestamps as delta-of-delta varints, uint32
+ * fields as zigzag delta varints, float fields XOR compressed. Every chunk
+ * records the min and max of each column. A footer indexes all chunks, so a
+ * reader can fetch one channel over a time range with a binary search and
+ * one read per chunk.
+ *
+ * A file may hold several schemas, for example across a reflash during a
+ * live capture; each chunk refers to the schema that was active for it.
+ */
+
+#define VP_LOG_CHUNK_ROWS 2048
+
+struct vp_log_writer;
+
+/* Encoding and file I/O happen on a thread owned by the writer, so append
+ * only copies the row. If the writer falls behind by more than a few chunks
+ * rows are dropped rather than blocking the caller */
+struct vp_log_writer *vp_log_writer_create(const char *path);
+bool vp_log_writer_set_schema(struct vp_log_writer *, size_t n_fields, const struct field_key *keys);
+bool vp_log_writer_append(struct vp_log_writer *, uint64_t timestamp_ns, const union field_value *values);
+uint64_t vp_log_writer_dropped_rows(struct vp_log_writer *);
+
+/* Make append wait for the writer instead of dropping rows, for callers
+ * that are not on the receive path */
+void vp_log_writer_set_blocking(struct vp_log_writer *, bool blocking);
+
+/* Record a live feed, timestamped with CLOCK_REALTIME on arrival */
+bool vp_log_writer_attach(struct vp_log_writer *, struct protocol *);
+
+/* Detaches, flushes, writes the footer, and frees the writer. Returns false
+ * if any write failed */
+bool vp_log_writer_close(struct vp_log_writer *);
+
+struct vp_log_reader;
+
+struct vp_log_chunk_info {
+  size_t schema;
+  uint32_t n_rows;
+  uint64_t first_ns;
+  uint64_t last_ns;
+};
+
+struct vp_log_reader *vp_log_reader_open(const char *path);
+void vp_log_reader_close(struct vp_log_reader *);
+
+size_t vp_log_reader_n_schemas(struct vp_log_reader *);
+size_t vp_log_reader_n_fields(struct vp_log_reader *, size_t schema);
+const struct field_key *vp_log_reader_fields(struct vp_log_reader *, size_t schema);
+int vp_log_reader_find_field(struct vp_log_reader *, size_t schema, const char *name);
+
+size_t vp_log_reader_n_chunks(struct vp_log_reader *);
+bool vp_log_reader_chunk_info(struct vp_log_reader *, size_t chunk, struct vp_log_chunk_info *);
+
+/* First chunk whose last timestamp is at or after timestamp_ns, or
+ * vp_log_reader_n_chunks() if there is none */
+size_t vp_log_reader_seek(struct vp_log_reader *, uint64_t timestamp_ns);
+
+bool vp_log_reader_field_range(struct vp_log_reader *, size_t chunk, size_t field, union field_value *min, union field_value *max);
+
+/* Decode one column of a chunk; dest must hold n_rows entries */
+bool vp_log_reader_read_timestamps(struct vp_log_reader *, size_t chunk, uint64_t *dest);
+bool vp_log_reader_read_field(struct vp_log_reader *, size_t chunk, size_t field, union field_value *dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
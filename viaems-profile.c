@@ -0,0 +1,179 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <threads.h>
+
+#include "viaems-profile.h"
+
+static void check_thrd(int val) {
+  assert(val == thrd_success);
+}
+
+/* Requests in a pipeline complete into their own slot in ops. The issuing
+ * thread waits whenever VP_PROFILE_WINDOW are outstanding */
+struct profile_op {
+  struct profile_pipeline *pipeline;
+  struct vp_profile_result *result;
+  request_status status;
+  struct config_value value;
+};
+
+struct profile_pipeline {
+  mtx_t mtx;
+  cnd_t cnd;
+  size_t outstanding;
+};
+
+static void profile_callback(request_status status, struct config_value value, void *userdata) {
+  struct profile_op *op = userdata;
+  struct profile_pipeline *pl = op->pipeline;
+  check_thrd(mtx_lock(&pl->mtx));
+  op->status = status;
+  op->value = value;
+  pl->outstanding -= 1;
+  check_thrd(cnd_signal(&pl->cnd));
+  check_thrd(mtx_unlock(&pl->mtx));
+}
+
+/* Gets every op's leaf, or sets it to its profile value if values is not
+ * NULL, and waits for all of them */
+static void run_pipeline(struct protocol *p, struct profile_pipeline *pl, size_t n_ops,
+    struct profile_op *ops, const struct config_value *values) {
+  for (size_t i = 0; i < n_ops; i++) {
+    check_thrd(mtx_lock(&pl->mtx));
+    while (pl->outstanding >= VP_PROFILE_WINDOW) {
+      check_thrd(cnd_wait(&pl->cnd, &pl->mtx));
+    }
+    pl->outstanding += 1;
+    check_thrd(mtx_unlock(&pl->mtx));
+
+    struct profile_op *op = &ops[i];
+    uint32_t id = values ?
+      viaems_send_set_async(p, op->result->node, values[i], profile_callback, op) :
+      viaems_send_get_async(p, op->result->node, profile_callback, op);
+    if (id == 0) {
+      check_thrd(mtx_lock(&pl->mtx));
+      op->status = REQUEST_FAILED;
+      pl->outstanding -= 1;
+      check_thrd(mtx_unlock(&pl->mtx));
+    }
+  }
+
+  check_thrd(mtx_lock(&pl->mtx));
+  while (pl->outstanding > 0) {
+    check_thrd(cnd_wait(&pl->cnd, &pl->mtx));
+  }
+  check_thrd(mtx_unlock(&pl->mtx));
+}
+
+bool vp_profile_apply(struct protocol *p, struct structure_node *root, size_t n_entries,
+    const struct vp_profile_entry *entries, bool dry_run, struct vp_profile_report *report) {
+  *report = (struct vp_profile_report){ 0 };
+  /* Paths are resolved up front on this thread, but result nodes are handed
+   * back, so leave no lazy part of the tree for another reader to expand */
+  if (!structure_expand_all(root)) {
+    return false;
+  }
+  size_t n = n_entries ? n_entries : 1;
+  report->results = calloc(n, sizeof(struct vp_profile_result));
+  struct profile_op *ops = calloc(n, sizeof(struct profile_op));
+  struct config_value *values = calloc(n, sizeof(struct config_value));
+  if (!report->results || !ops || !values) {
+    free(report->results);
+    report->results = NULL;
+    free(ops);
+    free(values);
+    return false;
+  }
+  report->n_results = n_entries;
+
+  struct profile_pipeline pl = { .outstanding = 0 };
+  check_thrd(mtx_init(&pl.mtx, mtx_plain));
+  check_thrd(cnd_init(&pl.cnd));
+
+  /* Resolve paths, and read every leaf that exists */
+  size_t n_ops = 0;
+  for (size_t i = 0; i < n_entries; i++) {
+    struct vp_profile_result *r = &report->results[i];
+    r->before = (struct config_value){ .type = VALUE_INVALID };
+    r->after = (struct config_value){ .type = VALUE_INVALID };
+    r->node = structure_find_node(root, entries[i].path);
+    if (!r->node || !structure_node_is_leaf(r->node)) {
+      r->node = NULL;
+      r->status = VP_PROFILE_NOT_FOUND;
+    } else if (r->node->leaf.type != entries[i].value.type ||
+        (entries[i].value.type == VALUE_STRING && !entries[i].value.as_string)) {
+      r->status = VP_PROFILE_TYPE_MISMATCH;
+    } else {
+      ops[n_ops++] = (struct profile_op){ .pipeline = &pl, .result = r };
+    }
+  }
+  run_pipeline(p, &pl, n_ops, ops, NULL);
+
+  /* Compare, keeping only the leaves that differ for the sets */
+  size_t n_sets = 0;
+  for (size_t i = 0; i < n_ops; i++) {
+    struct vp_profile_result *r = ops[i].result;
+    const struct config_value *want = &entries[r - report->results].value;
+    if (ops[i].status != REQUEST_OK) {
+      r->status = VP_PROFILE_FAILED;
+      continue;
+    }
+    r->before = ops[i].value;
+    if (config_value_equal(&r->before, want)) {
+      r->status = VP_PROFILE_UNCHANGED;
+      continue;
+    }
+    r->status = VP_PROFILE_CHANGED;
+    if (!dry_run) {
+      values[n_sets] = *want;
+      ops[n_sets++] = (struct profile_op){ .pipeline = &pl, .result = r };
+    }
+  }
+  run_pipeline(p, &pl, n_sets, ops, values);
+
+  for (size_t i = 0; i < n_sets; i++) {
+    struct vp_profile_result *r = ops[i].result;
+    if (ops[i].status != REQUEST_OK) {
+      r->status = VP_PROFILE_FAILED;
+      continue;
+    }
+    r->after = ops[i].value;
+    if (!config_value_equal(&r->after, &values[i])) {
+      r->status = VP_PROFILE_MISMATCH;
+    }
+  }
+
+  for (size_t i = 0; i < n_entries; i++) {
+    switch (report->results[i].status) {
+      case VP_PROFILE_UNCHANGED:
+        report->n_unchanged += 1;
+        break;
+      case VP_PROFILE_CHANGED:
+        report->n_changed += 1;
+        break;
+      default:
+        report->n_failed += 1;
+        break;
+    }
+  }
+
+  cnd_destroy(&pl.cnd);
+  mtx_destroy(&pl.mtx);
+  free(ops);
+  free(values);
+  return true;
+}
+
+void vp_profile_report_free(struct vp_profile_report *report) {
+  for (size_t i = 0; i < report->n_results; i++) {
+    struct vp_profile_result *r = &report->results[i];
+    if (r->before.type == VALUE_STRING) {
+      free(r->before.as_string);
+    }
+    if (r->after.type == VALUE_STRING) {
+      free(r->after.as_string);
+    }
+  }
+  free(report->results);
+  *report = (struct vp_profile_report){ 0 };
+}
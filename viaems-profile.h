@@ -0,0 +1,63 @@
+#ifndef VIAEMS_PROFILE_H
+#define VIAEMS_PROFILE_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Applying a stored configuration profile with as few writes as possible.
+ *
+ * Every leaf named in the profile is read back, with up to
+ * VP_PROFILE_WINDOW requests outstanding at once, and compared with the
+ * profile value by config_value_equal. Only leaves that differ are then
+ * set, pipelined the same way, and the value each set settled on is checked
+ * against the profile.
+ */
+
+#define VP_PROFILE_WINDOW 64
+
+struct vp_profile_entry {
+  const char *path; /* Like "outputs/3/pin", see structure_find_node */
+  struct config_value value;
+};
+
+typedef enum {
+  VP_PROFILE_UNCHANGED,     /* Already held the profile value */
+  VP_PROFILE_CHANGED,       /* Differs; set unless this was a dry run */
+  VP_PROFILE_MISMATCH,      /* Set, but the ECU settled on another value */
+  VP_PROFILE_NOT_FOUND,     /* No leaf at the path */
+  VP_PROFILE_TYPE_MISMATCH, /* The leaf holds another type of value */
+  VP_PROFILE_FAILED,        /* The get or set did not complete */
+} vp_profile_status;
+
+struct vp_profile_result {
+  vp_profile_status status;
+  struct structure_node *node; /* NULL if not found */
+  struct config_value before;  /* As read, VALUE_INVALID if the read failed */
+  struct config_value after;   /* As settled by the set, VALUE_INVALID if none was sent */
+};
+
+/* One result per profile entry, in profile order. Strings are owned by the
+ * report */
+struct vp_profile_report {
+  size_t n_results;
+  struct vp_profile_result *results;
+  size_t n_unchanged;
+  size_t n_changed;
+  size_t n_failed; /* Any other status */
+};
+
+/* With dry_run, only reads and compares. A lazy tree is fully expanded
+ * first. Returns false if the tree could not be expanded or the report could
+ * not be allocated; per leaf failures are in the report */
+bool vp_profile_apply(struct protocol *, struct structure_node *root, size_t n_entries,
+    const struct vp_profile_entry *entries, bool dry_run, struct vp_profile_report *report);
+void vp_profile_report_free(struct vp_profile_report *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,262 @@
+/* viaems-schemagen: generate a typed feed header from a captured session
+ *
+ * usage: viaems-schemagen <capture.cbor> <prefix> > prefix-schema.h
+ *
+ * The capture is a file of concatenated protocol messages as received from
+ * the ECU. The first description message names the fields and the first feed
+ * message after it fixes their types. The generated header contains index
+ * constants, a packed frame struct, and a struct feed_schema to pass to
+ * viaems_set_typed_feed_cb.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cbor.h"
+#include "viaems-c.h"
+
+static void die(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static size_t captured_n_fields = 0;
+static struct field_key *captured_keys = NULL;
+
+static void capture_feed(size_t n_fields, const struct field_key *keys, const union field_value *values) {
+  if (captured_keys) {
+    return;
+  }
+  captured_keys = calloc(n_fields, sizeof(struct field_key));
+  if (!captured_keys) {
+    die("out of memory");
+  }
+  for (int i = 0; i < n_fields; i++) {
+    captured_keys[i].name = strdup(keys[i].name);
+    captured_keys[i].type = keys[i].type;
+  }
+  captured_n_fields = n_fields;
+}
+
+static uint8_t *read_file(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *buf = malloc(size > 0 ? size : 1);
+  if (!buf || fread(buf, 1, size, f) != size) {
+    free(buf);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *len = size;
+  return buf;
+}
+
+/* Length of the complete CBOR item at the start of buf, 0 if truncated */
+static size_t message_length(const uint8_t *buf, size_t len) {
+  CborParser parser;
+  CborValue root;
+  if (cbor_parser_init(buf, len, 0, &parser, &root) != CborNoError) {
+    return 0;
+  }
+  if (cbor_value_advance(&root) != CborNoError) {
+    return 0;
+  }
+  return cbor_value_get_next_byte(&root) - buf;
+}
+
+/* Lowercase member name for a field. Constants use the same name in
+ * uppercase after the prefix; only members need a leading underscore to
+ * keep a name starting with a digit legal */
+static char *make_identifier(const char *name) {
+  size_t len = strlen(name);
+  char *ident = malloc(len + 2);
+  if (!ident) {
+    die("out of memory");
+  }
+  char *out = ident;
+  if (len == 0 || isdigit((unsigned char)name[0])) {
+    *out++ = '_';
+  }
+  for (const char *c = name; *c; c++) {
+    *out++ = isalnum((unsigned char)*c) ? tolower((unsigned char)*c) : '_';
+  }
+  *out = '\0';
+  return ident;
+}
+
+/* Distinct field names can map to one identifier ("a.b" and "a_b"), so
+ * later ones get a numeric suffix */
+static char **make_unique_identifiers(void) {
+  char **idents = calloc(captured_n_fields ? captured_n_fields : 1, sizeof(char *));
+  if (!idents) {
+    die("out of memory");
+  }
+  for (size_t i = 0; i < captured_n_fields; i++) {
+    char *base = make_identifier(captured_keys[i].name);
+    char *candidate = strdup(base);
+    if (!candidate) {
+      die("out of memory");
+    }
+    for (int suffix = 2; ; suffix++) {
+      bool taken = false;
+      for (size_t j = 0; j < i; j++) {
+        if (strcmp(idents[j], candidate) == 0) {
+          taken = true;
+          break;
+        }
+      }
+      if (!taken) {
+        break;
+      }
+      free(candidate);
+      candidate = malloc(strlen(base) + 16);
+      if (!candidate) {
+        die("out of memory");
+      }
+      sprintf(candidate, "%s_%d", base, suffix);
+    }
+    if (strcmp(candidate, base) != 0) {
+      fprintf(stderr, "viaems-schemagen: field \"%s\" collides with an earlier field, named %s\n",
+          captured_keys[i].name, candidate);
+    }
+    free(base);
+    idents[i] = candidate;
+  }
+  return idents;
+}
+
+/* Drops the underscore a member needs before a digit, the prefix already
+ * keeps the constant legal */
+static void print_constant(const char *ident) {
+  if (ident[0] == '_' && (ident[1] == '\0' || isdigit((unsigned char)ident[1]))) {
+    ident++;
+  }
+  for (const char *c = ident; *c; c++) {
+    putchar(toupper((unsigned char)*c));
+  }
+}
+
+/* Field names come from the ECU, escape anything that could end or break
+ * the literal */
+static void print_string_literal(const char *str) {
+  putchar('"');
+  for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    } else if (isprint(*c) && *c != '?') {
+      putchar(*c);
+    } else {
+      /* Octal, and for '?' so no trigraph can form */
+      printf("\\%03o", *c);
+    }
+  }
+  putchar('"');
+}
+
+static bool is_identifier(const char *str) {
+  if (!isalpha((unsigned char)str[0]) && str[0] != '_') {
+    return false;
+  }
+  for (const char *c = str; *c; c++) {
+    if (!isalnum((unsigned char)*c) && *c != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void generate(const char *source, const char *prefix) {
+  char *upper_prefix = strdup(prefix);
+  for (char *c = upper_prefix; *c; c++) {
+    *c = toupper((unsigned char)*c);
+  }
+  char **idents = make_unique_identifiers();
+
+  printf("/* Generated by viaems-schemagen from %s, do not edit */\n", source);
+  printf("#ifndef %s_SCHEMA_H\n", upper_prefix);
+  printf("#define %s_SCHEMA_H\n\n", upper_prefix);
+  printf("#include \"viaems-c.h\"\n\n");
+
+  printf("#define %s_N_FIELDS %zu\n\n", upper_prefix, captured_n_fields);
+  printf("enum {\n");
+  for (int i = 0; i < captured_n_fields; i++) {
+    printf("  %s_", upper_prefix);
+    print_constant(idents[i]);
+    printf(" = %d,\n", i);
+  }
+  printf("};\n\n");
+
+  printf("struct %s_frame {\n", prefix);
+  for (int i = 0; i < captured_n_fields; i++) {
+    printf("  %s %s;\n", captured_keys[i].type == FIELD_FLOAT ? "float" : "uint32_t", idents[i]);
+  }
+  printf("} __attribute__((packed));\n\n");
+  printf("_Static_assert(sizeof(struct %s_frame) == %s_N_FIELDS * sizeof(union field_value),\n",
+      prefix, upper_prefix);
+  printf("    \"frame must match the decoded value layout\");\n\n");
+
+  printf("static const struct feed_schema_field %s_schema_fields[] = {\n", prefix);
+  for (int i = 0; i < captured_n_fields; i++) {
+    printf("  { ");
+    print_string_literal(captured_keys[i].name);
+    printf(", %s },\n", captured_keys[i].type == FIELD_FLOAT ? "FIELD_FLOAT" : "FIELD_UINT32");
+  }
+  printf("};\n\n");
+
+  printf("static const struct feed_schema %s_schema = {\n", prefix);
+  printf("  .n_fields = %s_N_FIELDS,\n", upper_prefix);
+  printf("  .fields = %s_schema_fields,\n", prefix);
+  printf("};\n\n");
+  printf("#endif\n");
+  for (int i = 0; i < captured_n_fields; i++) {
+    free(idents[i]);
+  }
+  free(idents);
+  free(upper_prefix);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    die("usage: viaems-schemagen <capture.cbor> <prefix>");
+  }
+  if (!is_identifier(argv[2])) {
+    die("prefix must be a C identifier");
+  }
+
+  size_t len;
+  uint8_t *capture = read_file(argv[1], &len);
+  if (!capture) {
+    die("unable to read capture");
+  }
+
+  struct protocol *p;
+  if (!viaems_create_protocol(&p)) {
+    die("viaems_create_protocol");
+  }
+  viaems_set_feed_cb(p, capture_feed);
+
+  size_t pos = 0;
+  while (pos < len && !captured_keys) {
+    size_t msglen = message_length(capture + pos, len - pos);
+    if (msglen == 0) {
+      break;
+    }
+    viaems_new_data(p, capture + pos, msglen);
+    pos += msglen;
+  }
+  viaems_destroy_protocol(&p);
+  free(capture);
+
+  if (!captured_keys) {
+    die("capture has no description followed by a feed message");
+  }
+  generate(argv[1], argv[2]);
+  return 0;
+}
@@ -0,0 +1,402 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "viaems-shm.h"
+
+#define SHM_MAGIC 0x76706673 /* "vpfs" */
+#define SHM_VERSION 1
+#define SHM_ALIGN 64
+
+/* The segment is mapped at a different address in every process, so it
+ * only holds offsets. Sequence numbers are 64 bit atomics, which only work
+ * across processes if they are lock free */
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64 bit atomics must be lock free to share across processes");
+
+struct shm_header {
+  _Atomic uint32_t magic; /* Stored last, once the segment is set up */
+  uint32_t version;
+  uint32_t n_slots;
+  uint32_t max_fields;
+  uint64_t schema_offset;
+  uint64_t slots_offset;
+  uint64_t slot_size;
+  _Atomic uint32_t closed;
+  uint32_t n_fields;             /* Of the current schema */
+  _Atomic uint64_t schema_seq;   /* Odd while the schema is being rewritten */
+  _Atomic uint64_t write_seq;    /* Last frame published */
+};
+
+struct shm_field {
+  char name[VP_SHM_NAME_LEN];
+  uint32_t type;
+};
+
+struct shm_slot {
+  _Atomic uint64_t seq; /* Twice the frame seq once written, odd while writing */
+  uint64_t schema_seq;
+  uint64_t timestamp_ns;
+  uint32_t n_fields;
+  uint32_t reserved;
+  union field_value values[];
+};
+
+static size_t align_up(size_t size) {
+  return (size + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+}
+
+static struct shm_field *segment_fields(const struct shm_header *h) {
+  return (struct shm_field *)((uint8_t *)h + h->schema_offset);
+}
+
+static struct shm_slot *segment_slot(const struct shm_header *h, uint64_t seq) {
+  return (struct shm_slot *)((uint8_t *)h + h->slots_offset + (seq % h->n_slots) * h->slot_size);
+}
+
+struct vp_shm_writer {
+  char *name;
+  struct shm_header *header;
+  size_t size;
+  uint64_t seq;
+  uint64_t schema_seq;
+  bool schema_ok; /* The current schema fit in the segment */
+
+  struct protocol *proto;
+  struct feed_listener listener;
+};
+
+struct vp_shm_writer *vp_shm_writer_create(const char *name, size_t n_slots, size_t max_fields) {
+  if (n_slots == 0 || n_slots > UINT32_MAX || max_fields > UINT32_MAX) {
+    return NULL;
+  }
+  struct vp_shm_writer *w = malloc(sizeof(struct vp_shm_writer));
+  if (!w) {
+    return NULL;
+  }
+  memset(w, 0, sizeof(struct vp_shm_writer));
+  w->name = strdup(name);
+  if (!w->name) {
+    free(w);
+    return NULL;
+  }
+
+  size_t schema_offset = align_up(sizeof(struct shm_header));
+  size_t slots_offset = schema_offset + align_up(max_fields * sizeof(struct shm_field));
+  size_t slot_size = align_up(sizeof(struct shm_slot) + max_fields * sizeof(union field_value));
+  w->size = slots_offset + n_slots * slot_size;
+
+  /* Readers still mapping a previous segment keep it until they close */
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    free(w->name);
+    free(w);
+    return NULL;
+  }
+  void *mapping = MAP_FAILED;
+  if (ftruncate(fd, w->size) == 0) {
+    mapping = mmap(NULL, w->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    shm_unlink(name);
+    free(w->name);
+    free(w);
+    return NULL;
+  }
+
+  /* A new segment is zero filled, so every slot starts out unwritten */
+  struct shm_header *h = mapping;
+  h->version = SHM_VERSION;
+  h->n_slots = n_slots;
+  h->max_fields = max_fields;
+  h->schema_offset = schema_offset;
+  h->slots_offset = slots_offset;
+  h->slot_size = slot_size;
+  atomic_store_explicit(&h->magic, SHM_MAGIC, memory_order_release);
+  w->header = h;
+  return w;
+}
+
+void vp_shm_writer_destroy(struct vp_shm_writer *w) {
+  if (w->proto) {
+    viaems_remove_feed_listener(w->proto, &w->listener);
+  }
+  atomic_store_explicit(&w->header->closed, 1, memory_order_release);
+  munmap(w->header, w->size);
+  shm_unlink(w->name);
+  free(w->name);
+  free(w);
+}
+
+/* Only the writer changes the segment's schema, so it can read it back
+ * without the seqlock */
+static bool schema_equals(const struct shm_header *h, size_t n_fields, const struct field_key *keys) {
+  if (h->n_fields != n_fields) {
+    return false;
+  }
+  const struct shm_field *fields = segment_fields(h);
+  for (size_t i = 0; i < n_fields; i++) {
+    if (fields[i].type != keys[i].type || strcmp(fields[i].name, keys[i].name) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool vp_shm_writer_set_schema(struct vp_shm_writer *w, size_t n_fields, const struct field_key *keys) {
+  struct shm_header *h = w->header;
+  /* Readers only reload the schema when it really changed */
+  if (w->schema_ok && schema_equals(h, n_fields, keys)) {
+    return true;
+  }
+  w->schema_ok = false;
+  if (n_fields > h->max_fields) {
+    return false;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    if (strlen(keys[i].name) >= VP_SHM_NAME_LEN) {
+      return false;
+    }
+  }
+
+  atomic_store_explicit(&h->schema_seq, w->schema_seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  struct shm_field *fields = segment_fields(h);
+  for (size_t i = 0; i < n_fields; i++) {
+    memset(fields[i].name, 0, VP_SHM_NAME_LEN);
+    strcpy(fields[i].name, keys[i].name);
+    fields[i].type = keys[i].type;
+  }
+  h->n_fields = n_fields;
+  w->schema_seq += 2;
+  atomic_store_explicit(&h->schema_seq, w->schema_seq, memory_order_release);
+  w->schema_ok = true;
+  return true;
+}
+
+bool vp_shm_writer_publish(struct vp_shm_writer *w, uint64_t timestamp_ns, const union field_value *values) {
+  if (!w->schema_ok) {
+    return false;
+  }
+  struct shm_header *h = w->header;
+  uint64_t seq = ++w->seq;
+  struct shm_slot *slot = segment_slot(h, seq);
+
+  atomic_store_explicit(&slot->seq, 2 * seq - 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->schema_seq = w->schema_seq;
+  slot->timestamp_ns = timestamp_ns;
+  slot->n_fields = h->n_fields;
+  memcpy(slot->values, values, h->n_fields * sizeof(union field_value));
+  atomic_store_explicit(&slot->seq, 2 * seq, memory_order_release);
+  atomic_store_explicit(&h->write_seq, seq, memory_order_release);
+  return true;
+}
+
+static void shm_feed_schema(void *userdata, size_t n_fields, const struct field_key *keys) {
+  vp_shm_writer_set_schema(userdata, n_fields, keys);
+}
+
+static void shm_feed_frame(void *userdata, size_t n_fields, const struct field_key *keys, const union field_value *values) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  vp_shm_writer_publish(userdata, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, values);
+}
+
+bool vp_shm_writer_attach(struct vp_shm_writer *w, struct protocol *p) {
+  w->listener = (struct feed_listener){
+    .schema = shm_feed_schema,
+    .frame = shm_feed_frame,
+    .userdata = w,
+  };
+  if (!viaems_add_feed_listener(p, &w->listener)) {
+    return false;
+  }
+  w->proto = p;
+  return true;
+}
+
+struct vp_shm_reader {
+  struct shm_header *header;
+  size_t size;
+  uint64_t next; /* Seq of the next frame to return */
+  uint64_t overruns;
+
+  /* Local copy of the schema, taken when a frame first uses it */
+  uint64_t schema_seq;
+  size_t n_fields;
+  struct field_key *keys;
+  char (*names)[VP_SHM_NAME_LEN];
+
+  /* Schema being loaded, swapped in only once a frame is returned with it */
+  size_t load_n_fields;
+  struct field_key *load_keys;
+  char (*load_names)[VP_SHM_NAME_LEN];
+};
+
+struct vp_shm_reader *vp_shm_reader_open(const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct shm_header)) {
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  struct shm_header *h = mapping;
+  if (atomic_load_explicit(&h->magic, memory_order_acquire) != SHM_MAGIC ||
+      h->version != SHM_VERSION || h->n_slots == 0 ||
+      h->slots_offset + (uint64_t)h->n_slots * h->slot_size > (uint64_t)st.st_size) {
+    munmap(mapping, st.st_size);
+    return NULL;
+  }
+
+  struct vp_shm_reader *r = malloc(sizeof(struct vp_shm_reader));
+  if (!r) {
+    munmap(mapping, st.st_size);
+    return NULL;
+  }
+  memset(r, 0, sizeof(struct vp_shm_reader));
+  r->header = h;
+  r->size = st.st_size;
+  size_t max_fields = h->max_fields ? h->max_fields : 1;
+  r->keys = calloc(max_fields, sizeof(struct field_key));
+  r->names = calloc(max_fields, VP_SHM_NAME_LEN);
+  r->load_keys = calloc(max_fields, sizeof(struct field_key));
+  r->load_names = calloc(max_fields, VP_SHM_NAME_LEN);
+  if (!r->keys || !r->names || !r->load_keys || !r->load_names) {
+    vp_shm_reader_close(r);
+    return NULL;
+  }
+  r->next = atomic_load_explicit(&h->write_seq, memory_order_acquire) + 1;
+  return r;
+}
+
+void vp_shm_reader_close(struct vp_shm_reader *r) {
+  munmap(r->header, r->size);
+  free(r->keys);
+  free(r->names);
+  free(r->load_keys);
+  free(r->load_names);
+  free(r);
+}
+
+size_t vp_shm_reader_n_fields(struct vp_shm_reader *r) {
+  return r->n_fields;
+}
+
+const struct field_key *vp_shm_reader_fields(struct vp_shm_reader *r) {
+  return r->keys;
+}
+
+uint64_t vp_shm_reader_overruns(struct vp_shm_reader *r) {
+  return r->overruns;
+}
+
+/* Copies the schema currently in the segment into the load buffers,
+ * returning its seq */
+static uint64_t load_schema(struct vp_shm_reader *r) {
+  struct shm_header *h = r->header;
+  const struct shm_field *fields = segment_fields(h);
+  while (true) {
+    uint64_t before = atomic_load_explicit(&h->schema_seq, memory_order_acquire);
+    if (before & 1) {
+      continue;
+    }
+    size_t n_fields = h->n_fields <= h->max_fields ? h->n_fields : h->max_fields;
+    for (size_t i = 0; i < n_fields; i++) {
+      memcpy(r->load_names[i], fields[i].name, VP_SHM_NAME_LEN);
+      r->load_names[i][VP_SHM_NAME_LEN - 1] = '\0';
+      r->load_keys[i] = (struct field_key){
+        .name = r->load_names[i],
+        .type = fields[i].type,
+      };
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&h->schema_seq, memory_order_relaxed) == before) {
+      r->load_n_fields = n_fields;
+      return before;
+    }
+  }
+}
+
+/* Makes the loaded schema current. The keys point into their own names, so
+ * the buffers swap in pairs */
+static void commit_schema(struct vp_shm_reader *r, uint64_t schema_seq) {
+  struct field_key *keys = r->keys;
+  char (*names)[VP_SHM_NAME_LEN] = r->names;
+  r->keys = r->load_keys;
+  r->names = r->load_names;
+  r->load_keys = keys;
+  r->load_names = names;
+  r->n_fields = r->load_n_fields;
+  r->schema_seq = schema_seq;
+}
+
+vp_shm_status vp_shm_reader_next(struct vp_shm_reader *r, struct vp_shm_frame *dest) {
+  struct shm_header *h = r->header;
+  while (true) {
+    bool closed = atomic_load_explicit(&h->closed, memory_order_acquire);
+    uint64_t written = atomic_load_explicit(&h->write_seq, memory_order_acquire);
+    if (written < r->next) {
+      return closed ? VP_SHM_CLOSED : VP_SHM_EMPTY;
+    }
+    if (written - r->next >= h->n_slots) {
+      /* Lapped, skip to the oldest frame that may still be in the ring */
+      uint64_t oldest = written - h->n_slots + 1;
+      r->overruns += oldest - r->next;
+      r->next = oldest;
+    }
+
+    struct shm_slot *slot = segment_slot(h, r->next);
+    uint64_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    uint64_t schema_seq = slot->schema_seq;
+    uint64_t timestamp_ns = slot->timestamp_ns;
+    size_t n_fields = slot->n_fields;
+    atomic_thread_fence(memory_order_acquire);
+    if (before != 2 * r->next || atomic_load_explicit(&slot->seq, memory_order_relaxed) != before) {
+      r->overruns += 1;
+      r->next += 1;
+      continue;
+    }
+
+    vp_shm_status status = VP_SHM_FRAME;
+    if (schema_seq != r->schema_seq) {
+      if (load_schema(r) != schema_seq) {
+        /* The schema this frame was published with is already replaced */
+        r->overruns += 1;
+        r->next += 1;
+        continue;
+      }
+      commit_schema(r, schema_seq);
+      status = VP_SHM_SCHEMA_CHANGED;
+    }
+    *dest = (struct vp_shm_frame){
+      .seq = r->next,
+      .timestamp_ns = timestamp_ns,
+      .n_fields = n_fields <= r->n_fields ? n_fields : r->n_fields,
+      .values = slot->values,
+    };
+    r->next += 1;
+    return status;
+  }
+}
+
+bool vp_shm_reader_frame_valid(struct vp_shm_reader *r, const struct vp_shm_frame *frame) {
+  struct shm_slot *slot = segment_slot(r->header, frame->seq);
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&slot->seq, memory_order_relaxed) == 2 * frame->seq;
+}
@@ -0,0 +1,80 @@
+#ifndef VIAEMS_SHM_H
+#define VIAEMS_SHM_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shared memory feed, for several local processes reading one live feed.
+ *
+ * One writer publishes frames into a POSIX shared memory segment (under
+ * /dev/shm) that any number of reader processes map read-only. The segment
+ * holds the current schema and a ring of fixed size frame slots. Every slot
+ * carries a sequence number that is odd while the writer is filling it, so
+ * readers read frames in place without locks and notice when the writer has
+ * lapped them. The writer never waits on readers.
+ *
+ * The schema is versioned the same way. Each frame records the schema it was
+ * published with, and a reader picks up a new schema before returning the
+ * first frame that uses it.
+ */
+
+#define VP_SHM_NAME_LEN 64 /* Longest field name, including the null byte */
+
+struct vp_shm_writer;
+
+/* name is a shared memory object name like "/viaems-feed". An existing
+ * segment of that name is replaced. n_slots frames are kept; a schema of
+ * more than max_fields fields cannot be published */
+struct vp_shm_writer *vp_shm_writer_create(const char *name, size_t n_slots, size_t max_fields);
+
+/* Marks the segment closed for readers, unlinks it and frees the writer */
+void vp_shm_writer_destroy(struct vp_shm_writer *);
+
+bool vp_shm_writer_set_schema(struct vp_shm_writer *, size_t n_fields, const struct field_key *keys);
+bool vp_shm_writer_publish(struct vp_shm_writer *, uint64_t timestamp_ns, const union field_value *values);
+
+/* Publish a live feed, timestamped with CLOCK_REALTIME on arrival */
+bool vp_shm_writer_attach(struct vp_shm_writer *, struct protocol *);
+
+typedef enum {
+  VP_SHM_FRAME,          /* dest holds the next frame */
+  VP_SHM_SCHEMA_CHANGED, /* dest holds the next frame, which uses a new schema */
+  VP_SHM_EMPTY,          /* No frame newer than the last one read */
+  VP_SHM_CLOSED,         /* The writer has gone away */
+} vp_shm_status;
+
+/* values points into the segment and is not copied. A slow reader may see
+ * it overwritten; vp_shm_reader_frame_valid tells whether it still held
+ * this frame once the reader was done with it */
+struct vp_shm_frame {
+  uint64_t seq; /* Increments with every published frame */
+  uint64_t timestamp_ns;
+  size_t n_fields;
+  const union field_value *values;
+};
+
+struct vp_shm_reader;
+
+/* Frames published before the reader opened are not returned */
+struct vp_shm_reader *vp_shm_reader_open(const char *name);
+void vp_shm_reader_close(struct vp_shm_reader *);
+
+/* Schema of the frames most recently returned. Stays valid until the next
+ * VP_SHM_SCHEMA_CHANGED */
+size_t vp_shm_reader_n_fields(struct vp_shm_reader *);
+const struct field_key *vp_shm_reader_fields(struct vp_shm_reader *);
+
+vp_shm_status vp_shm_reader_next(struct vp_shm_reader *, struct vp_shm_frame *dest);
+bool vp_shm_reader_frame_valid(struct vp_shm_reader *, const struct vp_shm_frame *);
+
+/* Frames skipped because the writer overwrote them before they were read */
+uint64_t vp_shm_reader_overruns(struct vp_shm_reader *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
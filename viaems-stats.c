@@ -0,0 +1,377 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "viaems-stats.h"
+
+static const uint64_t window_slot_ns[VP_STATS_N_WINDOWS] = {
+  [VP_STATS_WINDOW_1S] = 1000000000ull / VP_STATS_SLOTS,
+  [VP_STATS_WINDOW_10S] = 10000000000ull / VP_STATS_SLOTS,
+  [VP_STATS_WINDOW_60S] = 60000000000ull / VP_STATS_SLOTS,
+};
+
+struct stats_slot {
+  uint64_t index; /* timestamp / slot length */
+  uint32_t count;
+  float min;
+  float max;
+  double sum;
+  double sum_sq;
+  /* Histogram covers [lo, lo + VP_STATS_BINS * width). Double, so that
+   * widening around values near FLT_MAX cannot overflow */
+  double lo;
+  double width;
+  uint32_t bins[VP_STATS_BINS];
+};
+
+struct stats_window {
+  struct stats_slot slots[VP_STATS_SLOTS];
+};
+
+/* Everything readers look at. Replaced as a whole on a schema change */
+struct stats_state {
+  _Atomic uint32_t seq; /* Odd while the writer is updating */
+  uint64_t last_ns;
+  size_t n_channels;
+  struct field_key *keys;
+  struct stats_window *windows; /* n_channels * VP_STATS_N_WINDOWS */
+  uint64_t *rejected; /* Per channel, non-finite samples */
+  struct stats_state *retired_next;
+};
+
+struct vp_stats {
+  struct stats_state *_Atomic state;
+  /* Snapshots in progress, held across loading and using the state. A
+   * replaced state is retired, and freed by the writer once it sees no
+   * snapshot in progress, since any later snapshot loads the current one */
+  _Atomic uint32_t readers;
+  struct stats_state *retired; /* Writer only */
+  struct protocol *proto;
+  struct feed_listener listener;
+};
+
+static void state_destroy(struct stats_state *state) {
+  if (!state) {
+    return;
+  }
+  for (size_t i = 0; i < state->n_channels; i++) {
+    free(state->keys[i].name);
+  }
+  free(state->keys);
+  free(state->windows);
+  free(state->rejected);
+  free(state);
+}
+
+static struct stats_state *state_create(size_t n_fields, const struct field_key *keys) {
+  struct stats_state *state = calloc(1, sizeof(struct stats_state));
+  if (!state) {
+    return NULL;
+  }
+  state->keys = calloc(n_fields ? n_fields : 1, sizeof(struct field_key));
+  state->windows = calloc(n_fields ? n_fields * VP_STATS_N_WINDOWS : 1, sizeof(struct stats_window));
+  state->rejected = calloc(n_fields ? n_fields : 1, sizeof(uint64_t));
+  if (!state->keys || !state->windows || !state->rejected) {
+    state_destroy(state);
+    return NULL;
+  }
+  state->n_channels = n_fields;
+  for (size_t i = 0; i < n_fields; i++) {
+    state->keys[i].type = keys[i].type;
+    state->keys[i].name = strdup(keys[i].name);
+    if (!state->keys[i].name) {
+      state_destroy(state);
+      return NULL;
+    }
+  }
+  return state;
+}
+
+static bool state_keys_equal(const struct stats_state *state, size_t n_fields, const struct field_key *keys) {
+  if (state->n_channels != n_fields) {
+    return false;
+  }
+  for (size_t i = 0; i < n_fields; i++) {
+    if (state->keys[i].type != keys[i].type || strcmp(state->keys[i].name, keys[i].name) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct vp_stats *vp_stats_create(void) {
+  struct vp_stats *s = malloc(sizeof(struct vp_stats));
+  if (!s) {
+    return NULL;
+  }
+  memset(s, 0, sizeof(struct vp_stats));
+  return s;
+}
+
+static void free_retired(struct vp_stats *s, bool force) {
+  if (!s->retired || (!force && atomic_load(&s->readers) > 0)) {
+    return;
+  }
+  while (s->retired) {
+    struct stats_state *next = s->retired->retired_next;
+    state_destroy(s->retired);
+    s->retired = next;
+  }
+}
+
+void vp_stats_destroy(struct vp_stats *s) {
+  if (s->proto) {
+    viaems_remove_feed_listener(s->proto, &s->listener);
+  }
+  free_retired(s, true);
+  state_destroy(atomic_load(&s->state));
+  free(s);
+}
+
+bool vp_stats_set_schema(struct vp_stats *s, size_t n_fields, const struct field_key *keys) {
+  /* The same channels keep their statistics. Only the writer replaces the
+   * state, so it can read the current one without a snapshot */
+  struct stats_state *current = atomic_load_explicit(&s->state, memory_order_relaxed);
+  if (current && state_keys_equal(current, n_fields, keys)) {
+    return true;
+  }
+  struct stats_state *state = state_create(n_fields, keys);
+  if (!state) {
+    return false;
+  }
+  struct stats_state *old = atomic_exchange(&s->state, state);
+  if (old) {
+    old->retired_next = s->retired;
+    s->retired = old;
+  }
+  free_retired(s, false);
+  return true;
+}
+
+/* A new slot takes its histogram range from the previous one, or starts
+ * narrow around its first sample. Samples outside the range double it,
+ * merging bins pairwise, which happens at most a few times per slot.
+ * Widening stops after MAX_WIDEN doublings, and a sample still outside
+ * lands in the edge bin */
+#define MAX_WIDEN 64
+
+static void slot_reset(struct stats_slot *slot, uint64_t index, const struct stats_slot *prev, float x) {
+  double lo = x - fmax(fabs(x), 1.0) / 16;
+  double hi = x + fmax(fabs(x), 1.0) / 16;
+  if (prev->index + 1 == index && prev->count > 0 && prev->max > prev->min) {
+    lo = prev->min;
+    hi = (double)prev->max + ((double)prev->max - prev->min) / VP_STATS_BINS;
+  }
+  *slot = (struct stats_slot){
+    .index = index,
+    .min = x,
+    .max = x,
+    .lo = lo,
+    .width = (hi - lo) / VP_STATS_BINS,
+  };
+}
+
+static void slot_widen(struct stats_slot *slot, bool downwards) {
+  uint32_t merged[VP_STATS_BINS / 2];
+  for (int i = 0; i < VP_STATS_BINS / 2; i++) {
+    merged[i] = slot->bins[2 * i] + slot->bins[2 * i + 1];
+  }
+  memset(slot->bins, 0, sizeof(slot->bins));
+  if (downwards) {
+    memcpy(&slot->bins[VP_STATS_BINS / 2], merged, sizeof(merged));
+    slot->lo -= VP_STATS_BINS * slot->width;
+  } else {
+    memcpy(slot->bins, merged, sizeof(merged));
+  }
+  slot->width *= 2;
+}
+
+static void slot_add(struct stats_slot *slot, float x) {
+  slot->count += 1;
+  slot->sum += x;
+  slot->sum_sq += (double)x * x;
+  if (x < slot->min) {
+    slot->min = x;
+  }
+  if (x > slot->max) {
+    slot->max = x;
+  }
+  for (int i = 0; i < MAX_WIDEN && x < slot->lo; i++) {
+    slot_widen(slot, true);
+  }
+  for (int i = 0; i < MAX_WIDEN && x >= slot->lo + VP_STATS_BINS * slot->width; i++) {
+    slot_widen(slot, false);
+  }
+  double pos = (x - slot->lo) / slot->width;
+  int bin = pos < 0 ? 0 : pos < VP_STATS_BINS ? (int)pos : VP_STATS_BINS - 1;
+  slot->bins[bin] += 1;
+}
+
+void vp_stats_push(struct vp_stats *s, uint64_t timestamp_ns, const union field_value *values) {
+  free_retired(s, false);
+  struct stats_state *state = atomic_load_explicit(&s->state, memory_order_relaxed);
+  if (!state) {
+    return;
+  }
+
+  uint32_t seq = atomic_load_explicit(&state->seq, memory_order_relaxed);
+  atomic_store_explicit(&state->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  uint64_t slot_index[VP_STATS_N_WINDOWS];
+  for (int w = 0; w < VP_STATS_N_WINDOWS; w++) {
+    slot_index[w] = timestamp_ns / window_slot_ns[w];
+  }
+  for (size_t c = 0; c < state->n_channels; c++) {
+    float x = state->keys[c].type == FIELD_FLOAT ? values[c].as_float : (float)values[c].as_uint32;
+    if (!isfinite(x)) {
+      state->rejected[c] += 1;
+      continue;
+    }
+    for (int w = 0; w < VP_STATS_N_WINDOWS; w++) {
+      struct stats_window *window = &state->windows[c * VP_STATS_N_WINDOWS + w];
+      uint64_t index = slot_index[w];
+      struct stats_slot *slot = &window->slots[index % VP_STATS_SLOTS];
+      if (slot->index != index || slot->count == 0) {
+        slot_reset(slot, index, &window->slots[(index - 1) % VP_STATS_SLOTS], x);
+      }
+      slot_add(slot, x);
+    }
+  }
+  state->last_ns = timestamp_ns;
+
+  atomic_store_explicit(&state->seq, seq + 2, memory_order_release);
+}
+
+static void stats_feed_schema(void *userdata, size_t n_fields, const struct field_key *keys) {
+  vp_stats_set_schema(userdata, n_fields, keys);
+}
+
+static void stats_feed_frame(void *userdata, size_t n_fields, const struct field_key *keys, const union field_value *values) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  vp_stats_push(userdata, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, values);
+}
+
+bool vp_stats_attach(struct vp_stats *s, struct protocol *p) {
+  s->listener = (struct feed_listener){
+    .schema = stats_feed_schema,
+    .frame = stats_feed_frame,
+    .userdata = s,
+  };
+  if (!viaems_add_feed_listener(p, &s->listener)) {
+    return false;
+  }
+  s->proto = p;
+  return true;
+}
+
+struct bin_sample {
+  float value;
+  uint32_t count;
+};
+
+static int compare_bin_samples(const void *a, const void *b) {
+  float x = ((const struct bin_sample *)a)->value;
+  float y = ((const struct bin_sample *)b)->value;
+  return (x > y) - (x < y);
+}
+
+static float percentile(const struct bin_sample *samples, size_t n_samples, uint64_t count, double q) {
+  uint64_t rank = (uint64_t)ceil(q * count);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < n_samples; i++) {
+    seen += samples[i].count;
+    if (seen >= rank) {
+      return samples[i].value;
+    }
+  }
+  return samples[n_samples - 1].value;
+}
+
+static void summarize(const struct stats_window *window, uint64_t last_ns, vp_stats_window w, struct vp_stats_summary *dest) {
+  uint64_t current = last_ns / window_slot_ns[w];
+  uint64_t count = 0;
+  double sum = 0;
+  double sum_sq = 0;
+  float min = INFINITY;
+  float max = -INFINITY;
+  struct bin_sample samples[VP_STATS_SLOTS * VP_STATS_BINS];
+  size_t n_samples = 0;
+
+  for (int i = 0; i < VP_STATS_SLOTS; i++) {
+    const struct stats_slot *slot = &window->slots[i];
+    if (slot->count == 0 || slot->index > current || slot->index + VP_STATS_SLOTS <= current) {
+      continue;
+    }
+    count += slot->count;
+    sum += slot->sum;
+    sum_sq += slot->sum_sq;
+    min = slot->min < min ? slot->min : min;
+    max = slot->max > max ? slot->max : max;
+    for (int b = 0; b < VP_STATS_BINS; b++) {
+      if (slot->bins[b] > 0) {
+        float mid = slot->lo + (b + 0.5) * slot->width;
+        samples[n_samples++] = (struct bin_sample){ .value = mid, .count = slot->bins[b] };
+      }
+    }
+  }
+
+  *dest = (struct vp_stats_summary){ .count = count };
+  if (count == 0) {
+    return;
+  }
+  double mean = sum / count;
+  double variance = sum_sq / count - mean * mean;
+  dest->min = min;
+  dest->max = max;
+  dest->mean = mean;
+  dest->stddev = variance > 0 ? sqrt(variance) : 0;
+
+  /* Bin midpoints can fall outside the exact range near the edges */
+  for (size_t i = 0; i < n_samples; i++) {
+    samples[i].value = samples[i].value < min ? min : samples[i].value > max ? max : samples[i].value;
+  }
+  qsort(samples, n_samples, sizeof(struct bin_sample), compare_bin_samples);
+  dest->p50 = percentile(samples, n_samples, count, 0.50);
+  dest->p90 = percentile(samples, n_samples, count, 0.90);
+  dest->p99 = percentile(samples, n_samples, count, 0.99);
+}
+
+bool vp_stats_snapshot(struct vp_stats *s, const char *channel, vp_stats_window w, struct vp_stats_summary *dest) {
+  if (w >= VP_STATS_N_WINDOWS) {
+    return false;
+  }
+
+  atomic_fetch_add(&s->readers, 1);
+  struct stats_state *state = atomic_load(&s->state);
+  size_t c = 0;
+  while (state && c < state->n_channels && strcmp(state->keys[c].name, channel) != 0) {
+    c++;
+  }
+  if (!state || c == state->n_channels) {
+    atomic_fetch_sub(&s->readers, 1);
+    return false;
+  }
+
+  struct stats_window copy;
+  uint64_t last_ns;
+  uint64_t rejected;
+  uint32_t before;
+  uint32_t after;
+  do {
+    before = atomic_load_explicit(&state->seq, memory_order_acquire);
+    memcpy(&copy, &state->windows[c * VP_STATS_N_WINDOWS + w], sizeof(copy));
+    last_ns = state->last_ns;
+    rejected = state->rejected[c];
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&state->seq, memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  atomic_fetch_sub(&s->readers, 1);
+
+  summarize(&copy, last_ns, w, dest);
+  dest->rejected = rejected;
+  return true;
+}
@@ -0,0 +1,68 @@
+#ifndef VIAEMS_STATS_H
+#define VIAEMS_STATS_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Rolling per-channel statistics over several windows.
+ *
+ * Each window is a ring of VP_STATS_SLOTS time slots, so a window covers
+ * between (VP_STATS_SLOTS - 1) / VP_STATS_SLOTS of its length and its full
+ * length, ending at the most recent frame. A slot keeps count, sum, sum of
+ * squares, min, max, and a small histogram whose range adapts to the data;
+ * percentiles are read from the histograms and are approximate. Updates are
+ * O(1) per sample.
+ *
+ * Samples are pushed, and schemas set, from a single thread, normally the
+ * receive thread via vp_stats_attach. Snapshots may be taken from any
+ * thread; they never block the writer, and retry if a frame lands while
+ * they copy. Non-finite samples (NaN or infinity) are not aggregated, only
+ * counted.
+ */
+
+#define VP_STATS_SLOTS 8
+#define VP_STATS_BINS 32
+
+typedef enum {
+  VP_STATS_WINDOW_1S,
+  VP_STATS_WINDOW_10S,
+  VP_STATS_WINDOW_60S,
+  VP_STATS_N_WINDOWS,
+} vp_stats_window;
+
+struct vp_stats_summary {
+  uint64_t count;
+  float min;
+  float max;
+  float mean;
+  float stddev;
+  float p50;
+  float p90;
+  float p99;
+  uint64_t rejected; /* Non-finite samples since the schema was set, over all time */
+};
+
+struct vp_stats;
+
+struct vp_stats *vp_stats_create(void);
+void vp_stats_destroy(struct vp_stats *);
+
+/* A schema with different names or types resets all statistics; the same
+ * schema again keeps them */
+bool vp_stats_set_schema(struct vp_stats *, size_t n_fields, const struct field_key *keys);
+void vp_stats_push(struct vp_stats *, uint64_t timestamp_ns, const union field_value *values);
+
+/* Aggregate a live feed, timestamped with CLOCK_MONOTONIC on arrival */
+bool vp_stats_attach(struct vp_stats *, struct protocol *);
+
+/* False if the channel is not in the current schema */
+bool vp_stats_snapshot(struct vp_stats *, const char *channel, vp_stats_window, struct vp_stats_summary *dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,137 +3,427 @@
 #include <stdatomic.h>
 #include <string.h>
 #include <threads.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 #include "viaems-usb.h"
 
+#define VIAEMS_VID 0x1209
+#define VIAEMS_PID 0x2041
+#define N_TRANSFERS 4
+
+#define EVENT_POLL_MS 10
+#define WRITE_TIMEOUT_MS 100
+#define MAX_WRITE_TIMEOUTS 10 /* In a row, before the link is declared lost */
+#define CONTROL_TIMEOUT_MS 100
+#define RETRY_HOTPLUG_MS 250 /* Backstop for a missed arrival */
+#define DEFAULT_MIN_STALL_MS 100
+#define DEFAULT_STALL_FACTOR 20
+
 struct vp_usb {
   thrd_t receive_thrd;
   struct protocol *proto;
   _Atomic bool alive;
   bool connected;
+  libusb_context *ctx;
+  bool has_hotplug;
+  libusb_hotplug_callback_handle hotplug;
+
+  mtx_t devh_mtx; /* Serializes writers against each other and reconnection */
   struct libusb_device_handle *devh;
+
+  /* Link state, owned by receive_thrd. Writers and callbacks only raise
+   * link_lost, hotplug raises device_arrived */
+  _Atomic bool link_up;
+  _Atomic bool link_lost;
+  _Atomic bool device_arrived;
+  uint64_t lost_ns;
+  uint64_t next_attempt_ns;
+  int n_active_transfers;
+
+  /* Feed inter-arrival tracking, on receive_thrd */
+  struct feed_listener listener;
+  uint64_t last_frame_ns;
+  uint64_t mean_interval_ns;
+  _Atomic uint32_t min_stall_ms;
+  _Atomic uint32_t stall_factor;
+
+  _Atomic uint64_t disconnects;
+  _Atomic uint64_t stalls;
+  _Atomic uint64_t reconnects;
+  _Atomic uint64_t last_recovery_ns;
+
   struct {
     struct libusb_transfer *xfer;
+    bool active;
     uint8_t buffer[16384];
-  } transfers[4];
+  } transfers[N_TRANSFERS];
 };
 
-static int usb_loop(void *ptr) {
-  struct vp_usb *usb = ptr;
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  while (atomic_load_explicit(&usb->alive, memory_order_relaxed) == true) {
-    libusb_handle_events(NULL);
+static void read_callback(struct libusb_transfer *xfer);
+
+static int transfer_index(struct vp_usb *usb, struct libusb_transfer *xfer) {
+  for (int i = 0; i < N_TRANSFERS; i++) {
+    if (usb->transfers[i].xfer == xfer) {
+      return i;
+    }
   }
+  return -1;
+}
 
-  libusb_free_transfer(usb->transfers[0].xfer);
-  libusb_free_transfer(usb->transfers[1].xfer);
-  libusb_free_transfer(usb->transfers[2].xfer);
-  libusb_free_transfer(usb->transfers[3].xfer);
-  libusb_close(usb->devh);
-  libusb_exit(NULL);
-  return 0;
+static bool submit_read(struct vp_usb *usb, int i) {
+  libusb_fill_bulk_transfer(usb->transfers[i].xfer, usb->devh, 0x81,
+      usb->transfers[i].buffer, sizeof(usb->transfers[i].buffer),
+      read_callback, usb, 1000);
+  if (libusb_submit_transfer(usb->transfers[i].xfer) != 0) {
+    return false;
+  }
+  usb->transfers[i].active = true;
+  usb->n_active_transfers += 1;
+  return true;
 }
 
 static void read_callback(struct libusb_transfer *xfer) {
   const uint8_t *rxbuf = xfer->buffer;
   const size_t length = xfer->actual_length;
   struct vp_usb *usb = xfer->user_data;
+  int i = transfer_index(usb, xfer);
+
+  usb->transfers[i].active = false;
+  usb->n_active_transfers -= 1;
+
+  /* A timed out transfer may still carry data */
+  if (xfer->status != LIBUSB_TRANSFER_COMPLETED &&
+      xfer->status != LIBUSB_TRANSFER_TIMED_OUT) {
+    if (xfer->status != LIBUSB_TRANSFER_CANCELLED) {
+      atomic_store(&usb->link_lost, true);
+    }
+    return;
+  }
 
-  if (usb->proto) {
+  if (usb->proto && length > 0) {
     if (!viaems_new_data(usb->proto, rxbuf, length)) {
       fprintf(stderr, "failed parse\n");
     }
   }
 
-  libusb_fill_bulk_transfer(xfer, usb->devh, 0x81, xfer->buffer, xfer->length, read_callback, usb, 1000);
-  libusb_submit_transfer(xfer);
+  if (atomic_load(&usb->link_up) && !atomic_load(&usb->link_lost) &&
+      !submit_read(usb, i)) {
+    atomic_store(&usb->link_lost, true);
+  }
 }
 
-static void usb_write(void *userdata, uint8_t *bytes, size_t len) {
+static void on_feed_frame(void *userdata, size_t n_fields, const struct field_key *keys, const union field_value *values) {
   struct vp_usb *usb = userdata;
-  int actual_length;
-  while (libusb_bulk_transfer(usb->devh, 0x1, bytes, len,
-        &actual_length, 0) < 0);
+  uint64_t now = monotonic_ns();
+  if (usb->last_frame_ns) {
+    uint64_t interval = now - usb->last_frame_ns;
+    usb->mean_interval_ns = usb->mean_interval_ns
+                                ? usb->mean_interval_ns - usb->mean_interval_ns / 8 + interval / 8
+                                : interval;
+  }
+  usb->last_frame_ns = now;
 }
 
-bool vp_usb_connect(struct vp_usb *usb, struct protocol *p) {
-   const uint16_t vid = 0x1209;
-   const uint16_t pid = 0x2041;
-   usb->proto = p;
+/* Only armed once a frame has arrived on the current link, so an ECU that
+ * is not streaming is never taken for a stalled one */
+static bool feed_stalled(struct vp_usb *usb, uint64_t now) {
+  uint32_t min_ms = atomic_load_explicit(&usb->min_stall_ms, memory_order_relaxed);
+  uint32_t factor = atomic_load_explicit(&usb->stall_factor, memory_order_relaxed);
+  if (min_ms == 0 || usb->last_frame_ns == 0 || usb->mean_interval_ns == 0) {
+    return false;
+  }
+  uint64_t limit = usb->mean_interval_ns * factor;
+  if (limit < (uint64_t)min_ms * 1000000) {
+    limit = (uint64_t)min_ms * 1000000;
+  }
+  return now - usb->last_frame_ns > limit;
+}
 
-    int rc = libusb_init(NULL);
-    if (rc < 0) {
+/* Runs with devh_mtx held, so a device that stops accepting data must not
+ * keep it forever: timeouts give up once the link is lost, and a run of
+ * timeouts without progress loses it */
+static bool usb_bulk_write(struct vp_usb *usb, uint8_t *bytes, size_t len) {
+  int timeouts = 0;
+  while (len > 0) {
+    int actual_length = 0;
+    int rc = libusb_bulk_transfer(usb->devh, 0x1, bytes, len,
+        &actual_length, WRITE_TIMEOUT_MS);
+    bytes += actual_length;
+    len -= actual_length;
+    if (rc != 0 && rc != LIBUSB_ERROR_TIMEOUT) {
+      atomic_store(&usb->link_lost, true);
       return false;
     }
+    if (rc == LIBUSB_ERROR_TIMEOUT) {
+      timeouts = actual_length > 0 ? 1 : timeouts + 1;
+      if (timeouts >= MAX_WRITE_TIMEOUTS) {
+        atomic_store(&usb->link_lost, true);
+      }
+      if (!atomic_load(&usb->alive) || atomic_load(&usb->link_lost)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
 
-    usb->devh = libusb_open_device_with_vid_pid(NULL, vid, pid);
-    if (!usb->devh) {
-      return false;
+/* libusb has no vectored bulk transfer. Small pieces are gathered into
+ * one transfer, pieces at least as large as the gather buffer are sent
+ * straight from the caller's memory. While the link is down the message is
+ * dropped; its request is replayed on reconnection */
+static void usb_writev(void *userdata, const struct iovec *iov, int iovcnt) {
+  struct vp_usb *usb = userdata;
+  uint8_t gather[512];
+  size_t gathered = 0;
+  mtx_lock(&usb->devh_mtx);
+  if (!usb->devh || !atomic_load(&usb->link_up) || atomic_load(&usb->link_lost)) {
+    mtx_unlock(&usb->devh_mtx);
+    return;
+  }
+  bool ok = true;
+  for (int i = 0; ok && i < iovcnt; i++) {
+    if (iov[i].iov_len >= sizeof(gather)) {
+      if (gathered > 0) {
+        ok = usb_bulk_write(usb, gather, gathered);
+        gathered = 0;
+      }
+      ok = ok && usb_bulk_write(usb, iov[i].iov_base, iov[i].iov_len);
+      continue;
+    }
+    if (gathered + iov[i].iov_len > sizeof(gather)) {
+      ok = usb_bulk_write(usb, gather, gathered);
+      gathered = 0;
     }
+    memcpy(gather + gathered, iov[i].iov_base, iov[i].iov_len);
+    gathered += iov[i].iov_len;
+  }
+  if (ok && gathered > 0) {
+    usb_bulk_write(usb, gather, gathered);
+  }
+  mtx_unlock(&usb->devh_mtx);
+}
 
-    for (int if_num = 0; if_num < 2; if_num++) {
-        if (libusb_kernel_driver_active(usb->devh, if_num)) {
-            libusb_detach_kernel_driver(usb->devh, if_num);
-        }
-        rc = libusb_claim_interface(usb->devh, if_num);
-        if (rc < 0) {
-            return false;
-        }
+static int usb_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *userdata) {
+  struct vp_usb *usb = userdata;
+  /* Runs inside event handling, so only flag the change for usb_loop */
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+    atomic_store(&usb->device_arrived, true);
+  } else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+    atomic_store(&usb->link_lost, true);
+  }
+  return 0;
+}
+
+static bool open_link(struct vp_usb *usb) {
+  libusb_device_handle *devh = libusb_open_device_with_vid_pid(usb->ctx, VIAEMS_VID, VIAEMS_PID);
+  if (!devh) {
+    return false;
+  }
+
+  int if_num = 0;
+  for (; if_num < 2; if_num++) {
+    if (libusb_kernel_driver_active(devh, if_num)) {
+      libusb_detach_kernel_driver(devh, if_num);
     }
-    /* Start configuring the device:
-     * - set line state
-     */
-    const uint32_t ACM_CTRL_DTR = 0x01;
-    const uint32_t ACM_CTRL_RTS = 0x02;
-    rc = libusb_control_transfer(usb->devh, 0x21, 0x22, ACM_CTRL_DTR | ACM_CTRL_RTS,
-                                0, NULL, 0, 0);
-    if (rc < 0) {
-      return false;
+    if (libusb_claim_interface(devh, if_num) < 0) {
+      break;
     }
+  }
 
-    /* - set line encoding: here 9600 8N1
-     * 9600 = 0x2580 ~> 0x80, 0x25 in little endian
-     */
-    unsigned char encoding[] = { 0x80, 0x25, 0x00, 0x00, 0x00, 0x00, 0x08 };
-    rc = libusb_control_transfer(usb->devh, 0x21, 0x20, 0, 0, encoding,
-                                sizeof(encoding), 0);
-    if (rc < 0) {
-      return false;
+  /* Start configuring the device:
+   * - set line state
+   * - set line encoding: here 9600 8N1
+   *   9600 = 0x2580 ~> 0x80, 0x25 in little endian
+   */
+  const uint32_t ACM_CTRL_DTR = 0x01;
+  const uint32_t ACM_CTRL_RTS = 0x02;
+  unsigned char encoding[] = { 0x80, 0x25, 0x00, 0x00, 0x00, 0x00, 0x08 };
+  if (if_num < 2 ||
+      libusb_control_transfer(devh, 0x21, 0x22, ACM_CTRL_DTR | ACM_CTRL_RTS,
+                              0, NULL, 0, CONTROL_TIMEOUT_MS) < 0 ||
+      libusb_control_transfer(devh, 0x21, 0x20, 0, 0, encoding,
+                              sizeof(encoding), CONTROL_TIMEOUT_MS) < 0) {
+    while (if_num-- > 0) {
+      libusb_release_interface(devh, if_num);
+    }
+    libusb_close(devh);
+    return false;
+  }
+  /* A reset mid-transfer can leave an endpoint halted */
+  libusb_clear_halt(devh, 0x81);
+  libusb_clear_halt(devh, 0x01);
+
+  mtx_lock(&usb->devh_mtx);
+  usb->devh = devh;
+  atomic_store(&usb->link_lost, false);
+  mtx_unlock(&usb->devh_mtx);
+
+  for (int i = 0; i < N_TRANSFERS; i++) {
+    if (!submit_read(usb, i)) {
+      atomic_store(&usb->link_lost, true);
+      break;
+    }
+  }
+  usb->last_frame_ns = 0;
+  atomic_store(&usb->link_up, true);
+  return true;
+}
+
+static void close_link(struct vp_usb *usb) {
+  atomic_store(&usb->link_up, false);
+  for (int i = 0; i < N_TRANSFERS; i++) {
+    if (usb->transfers[i].active) {
+      libusb_cancel_transfer(usb->transfers[i].xfer);
     }
+  }
+  /* Cancellation completes through the callbacks; a vanished device
+   * completes them promptly, so the bound is only a safeguard */
+  for (int tries = 0; usb->n_active_transfers > 0 && tries < 100; tries++) {
+    struct timeval tv = { .tv_sec = 0, .tv_usec = EVENT_POLL_MS * 1000 };
+    libusb_handle_events_timeout_completed(usb->ctx, &tv, NULL);
+  }
+
+  mtx_lock(&usb->devh_mtx);
+  if (usb->devh) {
+    libusb_release_interface(usb->devh, 0);
+    libusb_release_interface(usb->devh, 1);
+    libusb_close(usb->devh);
+    usb->devh = NULL;
+  }
+  mtx_unlock(&usb->devh_mtx);
+}
 
-     for (int i = 0; i < 4; i++) {
-       usb->transfers[i].xfer = libusb_alloc_transfer(0);
-       if (!usb->transfers[i].xfer) {
-         return false;
-       }
-       libusb_fill_bulk_transfer(usb->transfers[i].xfer, usb->devh, 0x81, usb->transfers[i].buffer, sizeof(usb->transfers[i].buffer), read_callback, p, 1000);
+static void supervise_link(struct vp_usb *usb) {
+  uint64_t now = monotonic_ns();
+  if (atomic_load(&usb->link_up)) {
+    if (feed_stalled(usb, now)) {
+      atomic_fetch_add(&usb->stalls, 1);
+      atomic_store(&usb->link_lost, true);
+    }
+    if (!atomic_load(&usb->link_lost)) {
+      return;
+    }
+    close_link(usb);
+    atomic_fetch_add(&usb->disconnects, 1);
+    usb->lost_ns = now;
+    usb->next_attempt_ns = now; /* The device may still be there */
+  }
 
-       int rc = libusb_submit_transfer(usb->transfers[i].xfer);
-       if (rc != 0) {
-         return false;
-       }
-     }
-     // Start thread
-     usb->connected = true;
-     viaems_set_write_fn(usb->proto, usb_write, usb);
-     thrd_create(&usb->receive_thrd, usb_loop, usb);
-     return true;
+  if (!atomic_exchange(&usb->device_arrived, false) && now < usb->next_attempt_ns) {
+    return;
+  }
+  usb->next_attempt_ns = now + (uint64_t)(usb->has_hotplug ? RETRY_HOTPLUG_MS : EVENT_POLL_MS) * 1000000;
+  if (!open_link(usb)) {
+    return;
+  }
+  atomic_fetch_add(&usb->reconnects, 1);
+  atomic_store(&usb->last_recovery_ns, monotonic_ns() - usb->lost_ns);
+  /* Requests sent into the dead link never arrived, or their responses
+   * were lost with it */
+  viaems_replay_requests(usb->proto);
 }
 
+static int usb_loop(void *ptr) {
+  struct vp_usb *usb = ptr;
+
+  while (atomic_load_explicit(&usb->alive, memory_order_relaxed) == true) {
+    struct timeval tv = { .tv_sec = 0, .tv_usec = EVENT_POLL_MS * 1000 };
+    libusb_handle_events_timeout_completed(usb->ctx, &tv, NULL);
+    supervise_link(usb);
+  }
+
+  if (atomic_load(&usb->link_up)) {
+    close_link(usb);
+  }
+  if (usb->has_hotplug) {
+    libusb_hotplug_deregister_callback(usb->ctx, usb->hotplug);
+  }
+  for (int i = 0; i < N_TRANSFERS; i++) {
+    libusb_free_transfer(usb->transfers[i].xfer);
+  }
+  libusb_exit(usb->ctx);
+  return 0;
+}
+
+bool vp_usb_connect(struct vp_usb *usb, struct protocol *p) {
+  usb->proto = p;
+
+  int rc = libusb_init(&usb->ctx);
+  if (rc < 0) {
+    return false;
+  }
+
+  bool ok = true;
+  for (int i = 0; i < N_TRANSFERS; i++) {
+    usb->transfers[i].xfer = libusb_alloc_transfer(0);
+    ok = ok && usb->transfers[i].xfer;
+  }
+  if (!ok || !open_link(usb)) {
+    for (int i = 0; i < N_TRANSFERS; i++) {
+      libusb_free_transfer(usb->transfers[i].xfer);
+      usb->transfers[i].xfer = NULL;
+    }
+    libusb_exit(usb->ctx);
+    return false;
+  }
+
+  usb->has_hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+    libusb_hotplug_register_callback(usb->ctx,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_NO_FLAGS, VIAEMS_VID, VIAEMS_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+        usb_hotplug, usb, &usb->hotplug) == LIBUSB_SUCCESS;
+
+  usb->listener = (struct feed_listener){
+    .frame = on_feed_frame,
+    .userdata = usb,
+  };
+  viaems_add_feed_listener(p, &usb->listener);
+
+  // Start thread
+  usb->connected = true;
+  atomic_store(&usb->alive, true);
+  viaems_set_writev_fn(usb->proto, usb_writev, usb);
+  thrd_create(&usb->receive_thrd, usb_loop, usb);
+  return true;
+}
+
+void vp_usb_set_stall_detection(struct vp_usb *usb, uint32_t min_stall_ms, uint32_t factor) {
+  atomic_store(&usb->min_stall_ms, min_stall_ms);
+  atomic_store(&usb->stall_factor, factor);
+}
+
+void vp_usb_get_link_stats(struct vp_usb *usb, struct vp_usb_link_stats *stats) {
+  *stats = (struct vp_usb_link_stats){
+    .connected = atomic_load(&usb->link_up),
+    .disconnects = atomic_load(&usb->disconnects),
+    .stalls = atomic_load(&usb->stalls),
+    .reconnects = atomic_load(&usb->reconnects),
+    .last_recovery_ns = atomic_load(&usb->last_recovery_ns),
+  };
+}
 
 struct vp_usb *vp_create_usb() {
   struct vp_usb *usb = malloc(sizeof(struct vp_usb));
   memset(usb, 0, sizeof(struct vp_usb));
+  mtx_init(&usb->devh_mtx, mtx_plain);
+  usb->min_stall_ms = DEFAULT_MIN_STALL_MS;
+  usb->stall_factor = DEFAULT_STALL_FACTOR;
   return usb;
 }
 
 void vp_destroy_usb(struct vp_usb *usb) {
   if (usb->connected) {
+    viaems_set_writev_fn(usb->proto, NULL, NULL);
+    viaems_remove_feed_listener(usb->proto, &usb->listener);
     usb->alive = false;
     thrd_join(usb->receive_thrd, NULL);
   }
+  mtx_destroy(&usb->devh_mtx);
   free(usb);
 }
-
-
-
@@ -3,6 +3,10 @@
 
 #include "viaems-c.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct vp_usb;
 struct vp_usb *vp_create_usb();
 void vp_destroy_usb(struct vp_usb *usb);
@@ -10,4 +14,30 @@ void vp_destroy_usb(struct vp_usb *usb);
 struct protocol;
 bool vp_usb_connect(struct vp_usb *usb, struct protocol *p);
 
+/* Once connected the link is supervised. A failed transfer, the device
+ * leaving, or a feed stall drops the link; the device arriving again (or,
+ * without hotplug support, polling) brings it back. Reconnection reclaims
+ * the interfaces, re-arms the receive transfers and replays outstanding
+ * requests, leaving the protocol and any fetched structure in place.
+ *
+ * The feed counts as stalled when no frame has arrived for factor times
+ * its mean inter-arrival time, and at least min_stall_ms. Detection is
+ * only armed after a frame has arrived on the current link. Defaults are
+ * 100 ms and 20; a min_stall_ms of 0 disables it */
+void vp_usb_set_stall_detection(struct vp_usb *usb, uint32_t min_stall_ms, uint32_t factor);
+
+struct vp_usb_link_stats {
+  bool connected;
+  uint64_t disconnects;
+  uint64_t stalls;
+  uint64_t reconnects;
+  uint64_t last_recovery_ns; /* From losing the link to having it back */
+};
+
+void vp_usb_get_link_stats(struct vp_usb *usb, struct vp_usb_link_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,422 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include "viaems-watch.h"
+
+/* Leaves due within this long of a wakeup are polled with it, so leaves
+ * with nearby deadlines share one batch */
+#define WATCH_BATCH_WINDOW_NS 2000000
+
+static void check_thrd(int val) {
+  assert(val == thrd_success);
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* cnd_timedwait takes a TIME_UTC deadline, see deadline_loop in viaems-c.c */
+static struct timespec time_ns_from_now(uint64_t ns) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ns / 1000000000;
+  ts.tv_nsec += ns % 1000000000;
+  while (ts.tv_nsec >= 1000000000) {
+    ts.tv_nsec -= 1000000000;
+    ts.tv_sec += 1;
+  }
+  return ts;
+}
+
+struct watch_subscriber {
+  uint64_t interval_ns;
+  vp_watch_callback cb;
+  void *userdata;
+  bool notified; /* Has been given a value */
+};
+
+/* A leaf outlives its removal while a request for it is outstanding, and is
+ * freed when that completes */
+struct watch_leaf {
+  struct vp_watch *watch;
+  struct structure_node *node;
+  uint64_t interval_ns; /* Shortest of the subscribers' */
+  uint64_t next_due_ns;
+  bool in_flight; /* Until the request's callback has finished */
+  bool issuing;   /* Inside viaems_send_get_async, which may complete at once */
+  uint32_t request_id;
+  bool removed;
+
+  bool has_value;
+  struct config_value value; /* A string is owned by the leaf */
+
+  size_t n_subscribers;
+  size_t subscribers_capacity;
+  struct watch_subscriber *subscribers;
+};
+
+struct watch_poll {
+  struct watch_leaf *leaf;
+  uint32_t request_id;
+};
+
+struct vp_watch {
+  struct protocol *proto;
+
+  /* Recursive, so that callbacks, which run with it held, can add and
+   * remove watches */
+  mtx_t mtx;
+  cnd_t cnd; /* Wakes the poll thread */
+  thrd_t thrd;
+  bool running;
+
+  size_t n_leaves;
+  size_t leaves_capacity;
+  struct watch_leaf **leaves;
+
+  /* Scratch for poll_due_leaves, only touched by the poll thread */
+  size_t batch_capacity;
+  struct watch_poll *batch;
+
+  size_t n_in_flight;
+  cnd_t idle_cnd; /* Signalled as outstanding polls complete */
+
+  struct vp_watch_stats stats;
+};
+
+static void release_value(struct config_value *v) {
+  if (v->type == VALUE_STRING) {
+    free(v->as_string);
+  }
+  *v = (struct config_value){ .type = VALUE_INVALID };
+}
+
+static void leaf_free(struct watch_leaf *leaf) {
+  release_value(&leaf->value);
+  free(leaf->subscribers);
+  free(leaf);
+}
+
+/* Must hold mtx */
+static void leaf_free_if_unused(struct watch_leaf *leaf) {
+  if (leaf->removed && !leaf->in_flight && !leaf->issuing) {
+    leaf_free(leaf);
+  }
+}
+
+static void watch_get_callback(request_status status, struct config_value value, void *userdata) {
+  struct watch_leaf *leaf = userdata;
+  struct vp_watch *w = leaf->watch;
+  check_thrd(mtx_lock(&w->mtx));
+
+  if (status != REQUEST_OK) {
+    if (status != REQUEST_CANCELLED) {
+      w->stats.failures += 1;
+    }
+    release_value(&value);
+  } else if (leaf->removed) {
+    release_value(&value);
+  } else {
+    bool changed = !leaf->has_value || !config_value_equal(&leaf->value, &value);
+    if (changed) {
+      release_value(&leaf->value);
+      leaf->value = value;
+      leaf->has_value = true;
+      w->stats.changes += 1;
+    } else {
+      release_value(&value);
+    }
+    /* Still in flight, so a callback that removes the watch cannot free
+     * the leaf under this loop */
+    for (size_t i = 0; i < leaf->n_subscribers && !leaf->removed; i++) {
+      struct watch_subscriber *s = &leaf->subscribers[i];
+      if (changed || !s->notified) {
+        s->notified = true;
+        s->cb(leaf->node, leaf->value, s->userdata);
+      }
+    }
+  }
+
+  leaf->in_flight = false;
+  leaf->request_id = 0;
+  w->n_in_flight -= 1;
+  check_thrd(cnd_broadcast(&w->idle_cnd));
+  leaf_free_if_unused(leaf);
+  check_thrd(mtx_unlock(&w->mtx));
+}
+
+/* Must hold mtx, which is released while the requests are issued. Issues a
+ * request for every leaf that is due, or nearly due, and returns when the
+ * next one will be. A leaf stays allocated while issuing is set, and its
+ * request may complete, and its callback change the watch set, before
+ * viaems_send_get_async returns */
+static uint64_t poll_due_leaves(struct vp_watch *w) {
+  if (w->batch_capacity < w->n_leaves) {
+    struct watch_poll *batch = realloc(w->batch, w->leaves_capacity * sizeof(struct watch_poll));
+    if (batch) {
+      w->batch = batch;
+      w->batch_capacity = w->leaves_capacity;
+    }
+  }
+
+  uint64_t now = monotonic_ns();
+  uint64_t next_ns = UINT64_MAX;
+  size_t n_batch = 0;
+  for (size_t i = 0; i < w->n_leaves; i++) {
+    struct watch_leaf *leaf = w->leaves[i];
+    if (leaf->next_due_ns <= now + WATCH_BATCH_WINDOW_NS && n_batch < w->batch_capacity) {
+      leaf->next_due_ns += leaf->interval_ns;
+      if (leaf->next_due_ns <= now) {
+        leaf->next_due_ns = now + leaf->interval_ns;
+      }
+      if (leaf->in_flight) {
+        w->stats.skipped += 1;
+      } else {
+        leaf->in_flight = true;
+        leaf->issuing = true;
+        w->n_in_flight += 1;
+        w->batch[n_batch++].leaf = leaf;
+      }
+    }
+    if (leaf->next_due_ns < next_ns) {
+      next_ns = leaf->next_due_ns;
+    }
+  }
+  if (n_batch == 0) {
+    return next_ns;
+  }
+
+  check_thrd(mtx_unlock(&w->mtx));
+  for (size_t i = 0; i < n_batch; i++) {
+    struct watch_poll *poll = &w->batch[i];
+    poll->request_id = viaems_send_get_async(w->proto, poll->leaf->node, watch_get_callback, poll->leaf);
+  }
+  check_thrd(mtx_lock(&w->mtx));
+
+  for (size_t i = 0; i < n_batch; i++) {
+    struct watch_leaf *leaf = w->batch[i].leaf;
+    uint32_t id = w->batch[i].request_id;
+    w->stats.polls += 1;
+    leaf->issuing = false;
+    if (id == 0) {
+      w->stats.failures += 1;
+      leaf->in_flight = false;
+      w->n_in_flight -= 1;
+    } else if (leaf->in_flight) {
+      leaf->request_id = id;
+      if (leaf->removed) {
+        /* Removed while the request was issued, when it could not yet be
+         * cancelled */
+        viaems_cancel_request(w->proto, id);
+        continue;
+      }
+    }
+    leaf_free_if_unused(leaf);
+  }
+  return next_ns;
+}
+
+static int watch_loop(void *ptr) {
+  struct vp_watch *w = ptr;
+  check_thrd(mtx_lock(&w->mtx));
+  while (w->running) {
+    uint64_t next_ns = poll_due_leaves(w);
+    if (next_ns == UINT64_MAX) {
+      check_thrd(cnd_wait(&w->cnd, &w->mtx));
+      continue;
+    }
+    uint64_t now = monotonic_ns();
+    if (next_ns > now) {
+      struct timespec ts = time_ns_from_now(next_ns - now);
+      cnd_timedwait(&w->cnd, &w->mtx, &ts);
+    }
+  }
+  check_thrd(mtx_unlock(&w->mtx));
+  return 0;
+}
+
+struct vp_watch *vp_watch_create(struct protocol *p) {
+  struct vp_watch *w = malloc(sizeof(struct vp_watch));
+  if (!w) {
+    return NULL;
+  }
+  memset(w, 0, sizeof(struct vp_watch));
+  w->proto = p;
+  mtx_init(&w->mtx, mtx_plain | mtx_recursive);
+  cnd_init(&w->cnd);
+  cnd_init(&w->idle_cnd);
+  w->running = true;
+  if (thrd_create(&w->thrd, watch_loop, w) != thrd_success) {
+    cnd_destroy(&w->idle_cnd);
+    cnd_destroy(&w->cnd);
+    mtx_destroy(&w->mtx);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+void vp_watch_destroy(struct vp_watch *w) {
+  check_thrd(mtx_lock(&w->mtx));
+  w->running = false;
+  check_thrd(cnd_broadcast(&w->cnd));
+  check_thrd(mtx_unlock(&w->mtx));
+  thrd_join(w->thrd, NULL);
+
+  check_thrd(mtx_lock(&w->mtx));
+  for (size_t i = 0; i < w->n_leaves; i++) {
+    struct watch_leaf *leaf = w->leaves[i];
+    leaf->removed = true;
+    if (leaf->in_flight) {
+      /* The callback frees the leaf, maybe before cancel returns */
+      viaems_cancel_request(w->proto, leaf->request_id);
+    } else {
+      leaf_free(leaf);
+    }
+  }
+  w->n_leaves = 0;
+  while (w->n_in_flight > 0) {
+    check_thrd(cnd_wait(&w->idle_cnd, &w->mtx));
+  }
+  check_thrd(mtx_unlock(&w->mtx));
+
+  free(w->leaves);
+  free(w->batch);
+  cnd_destroy(&w->idle_cnd);
+  cnd_destroy(&w->cnd);
+  mtx_destroy(&w->mtx);
+  free(w);
+}
+
+/* Must hold mtx */
+static struct watch_leaf *find_leaf(struct vp_watch *w, struct structure_node *node, size_t *index) {
+  for (size_t i = 0; i < w->n_leaves; i++) {
+    if (w->leaves[i]->node == node) {
+      *index = i;
+      return w->leaves[i];
+    }
+  }
+  return NULL;
+}
+
+static void update_interval(struct watch_leaf *leaf) {
+  leaf->interval_ns = UINT64_MAX;
+  for (size_t i = 0; i < leaf->n_subscribers; i++) {
+    if (leaf->subscribers[i].interval_ns < leaf->interval_ns) {
+      leaf->interval_ns = leaf->subscribers[i].interval_ns;
+    }
+  }
+}
+
+bool vp_watch_add(struct vp_watch *w, struct structure_node *node, uint32_t interval_ms, vp_watch_callback cb, void *userdata) {
+  /* Expanded here so callbacks on the receive thread only read the leaf */
+  if (!structure_node_is_leaf(node) || !node->leaf.request || interval_ms == 0 || !cb ||
+      !structure_expand_all(node)) {
+    return false;
+  }
+
+  check_thrd(mtx_lock(&w->mtx));
+  size_t index;
+  struct watch_leaf *leaf = find_leaf(w, node, &index);
+  if (!leaf) {
+    if (w->n_leaves == w->leaves_capacity) {
+      size_t capacity = w->leaves_capacity ? w->leaves_capacity * 2 : 16;
+      struct watch_leaf **leaves = realloc(w->leaves, capacity * sizeof(struct watch_leaf *));
+      if (!leaves) {
+        check_thrd(mtx_unlock(&w->mtx));
+        return false;
+      }
+      w->leaves = leaves;
+      w->leaves_capacity = capacity;
+    }
+    leaf = calloc(1, sizeof(struct watch_leaf));
+    if (!leaf) {
+      check_thrd(mtx_unlock(&w->mtx));
+      return false;
+    }
+    leaf->watch = w;
+    leaf->node = node;
+    leaf->value = (struct config_value){ .type = VALUE_INVALID };
+    leaf->next_due_ns = monotonic_ns();
+    w->leaves[w->n_leaves++] = leaf;
+  }
+
+  if (leaf->n_subscribers == leaf->subscribers_capacity) {
+    size_t capacity = leaf->subscribers_capacity ? leaf->subscribers_capacity * 2 : 2;
+    struct watch_subscriber *subscribers = realloc(leaf->subscribers, capacity * sizeof(struct watch_subscriber));
+    if (!subscribers) {
+      if (leaf->n_subscribers == 0) {
+        w->leaves[--w->n_leaves] = NULL;
+        leaf_free(leaf);
+      }
+      check_thrd(mtx_unlock(&w->mtx));
+      return false;
+    }
+    leaf->subscribers = subscribers;
+    leaf->subscribers_capacity = capacity;
+  }
+  leaf->subscribers[leaf->n_subscribers++] = (struct watch_subscriber){
+    .interval_ns = (uint64_t)interval_ms * 1000000,
+    .cb = cb,
+    .userdata = userdata,
+  };
+
+  /* A new subscriber wants a value soon, and a shorter interval applies
+   * from now on */
+  update_interval(leaf);
+  uint64_t now = monotonic_ns();
+  if (leaf->next_due_ns > now) {
+    leaf->next_due_ns = now;
+  }
+  check_thrd(cnd_broadcast(&w->cnd));
+  check_thrd(mtx_unlock(&w->mtx));
+  return true;
+}
+
+bool vp_watch_remove(struct vp_watch *w, struct structure_node *node, vp_watch_callback cb, void *userdata) {
+  check_thrd(mtx_lock(&w->mtx));
+  size_t index;
+  struct watch_leaf *leaf = find_leaf(w, node, &index);
+  bool found = false;
+  for (size_t i = 0; leaf && i < leaf->n_subscribers; i++) {
+    struct watch_subscriber *s = &leaf->subscribers[i];
+    if (s->cb == cb && s->userdata == userdata) {
+      memmove(s, s + 1, (leaf->n_subscribers - i - 1) * sizeof(struct watch_subscriber));
+      leaf->n_subscribers -= 1;
+      found = true;
+      break;
+    }
+  }
+  if (!found) {
+    check_thrd(mtx_unlock(&w->mtx));
+    return false;
+  }
+
+  if (leaf->n_subscribers > 0) {
+    update_interval(leaf);
+  } else {
+    memmove(&w->leaves[index], &w->leaves[index + 1], (w->n_leaves - index - 1) * sizeof(struct watch_leaf *));
+    w->n_leaves -= 1;
+    leaf->removed = true;
+    if (leaf->in_flight && !leaf->issuing && leaf->request_id) {
+      /* Frees the leaf through the callback, unless the response is
+       * already being handled, in which case that frees it */
+      viaems_cancel_request(w->proto, leaf->request_id);
+    } else {
+      leaf_free_if_unused(leaf);
+    }
+  }
+  check_thrd(mtx_unlock(&w->mtx));
+  return true;
+}
+
+void vp_watch_get_stats(struct vp_watch *w, struct vp_watch_stats *dest) {
+  check_thrd(mtx_lock(&w->mtx));
+  *dest = w->stats;
+  check_thrd(mtx_unlock(&w->mtx));
+}
@@ -0,0 +1,50 @@
+#ifndef VIAEMS_WATCH_H
+#define VIAEMS_WATCH_H
+
+#include "viaems-c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Periodic polling of config leaves, for live values that are only reachable
+ * with a get (sensor state, for example) rather than as feed channels.
+ *
+ * One thread owned by the watch polls every watched leaf at its interval.
+ * Leaves that come due together are requested in one batch, back to back,
+ * and a leaf watched by several callers is requested once, at the shortest
+ * of their intervals. A leaf whose previous request is still outstanding is
+ * skipped until the next interval. Callbacks fire only when a value changes,
+ * plus once with the first value seen after a watch is added.
+ */
+
+/* Runs on the receive thread. value is only valid during the call, copy a
+ * string to keep it. The callback may add and remove watches */
+typedef void (*vp_watch_callback)(struct structure_node *leaf, struct config_value value, void *userdata);
+
+struct vp_watch_stats {
+  uint64_t polls;    /* Requests issued */
+  uint64_t changes;  /* Polls that returned a new value */
+  uint64_t failures; /* Polls that timed out or failed */
+  uint64_t skipped;  /* Polls not issued, the previous one was still outstanding */
+};
+
+struct vp_watch;
+
+struct vp_watch *vp_watch_create(struct protocol *);
+
+/* Cancels outstanding polls and waits for their callbacks */
+void vp_watch_destroy(struct vp_watch *);
+
+/* The leaf must stay alive until the watch is removed. Once remove returns,
+ * the callback is not called again for it. A lazy leaf is expanded by add */
+bool vp_watch_add(struct vp_watch *, struct structure_node *leaf, uint32_t interval_ms, vp_watch_callback, void *userdata);
+bool vp_watch_remove(struct vp_watch *, struct structure_node *leaf, vp_watch_callback, void *userdata);
+
+void vp_watch_get_stats(struct vp_watch *, struct vp_watch_stats *dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,455 @@
+#ifndef VIAEMS_HPP
+#define VIAEMS_HPP
+
+/* Header-only C++20 wrapper over viaems-c.h.
+ *
+ * Owning handles for the protocol, USB transport, structure trees and
+ * returned values, feed frames as spans over the protocol's own storage, and
+ * subscribers whose handlers are called through one trampoline per handler
+ * type, so the handler body inlines into it. Typed subscribers name their
+ * fields as template parameters; each field resolves to a fixed index at
+ * compile time and the live description is checked against them once per
+ * description, not per frame.
+ *
+ * Callbacks and resumed coroutines run on the thread that delivered the
+ * data or completed the request, as with the C API.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "viaems-c.h"
+#include "viaems-usb.h"
+
+namespace viaems {
+
+struct structure_deleter {
+  void operator()(structure_node *root) const noexcept { structure_destroy(root); }
+};
+
+using structure_tree = std::unique_ptr<structure_node, structure_deleter>;
+
+/* A config value returned by the ECU. Owns the string of a string value */
+class value {
+ public:
+  value() noexcept : v_{} {}
+  explicit value(config_value v) noexcept : v_(v) {}
+  value(value &&other) noexcept : v_(std::exchange(other.v_, config_value{})) {}
+  value &operator=(value &&other) noexcept {
+    std::swap(v_, other.v_);
+    return *this;
+  }
+  value(const value &) = delete;
+  value &operator=(const value &) = delete;
+  ~value() {
+    if (v_.type == VALUE_STRING) {
+      std::free(v_.as_string);
+    }
+  }
+
+  config_value_type type() const noexcept { return v_.type; }
+  uint32_t as_uint32() const noexcept { return v_.as_uint32; }
+  float as_float() const noexcept { return v_.as_float; }
+  bool as_bool() const noexcept { return v_.as_bool; }
+  std::string_view as_string() const noexcept { return v_.as_string ? v_.as_string : ""; }
+  const config_value &c_value() const noexcept { return v_; }
+
+ private:
+  config_value v_;
+};
+
+/* Values to set. The string is only read while the request is sent */
+inline config_value make_value(uint32_t v) noexcept {
+  config_value c{};
+  c.type = VALUE_UINT32;
+  c.as_uint32 = v;
+  return c;
+}
+
+inline config_value make_value(float v) noexcept {
+  config_value c{};
+  c.type = VALUE_FLOAT;
+  c.as_float = v;
+  return c;
+}
+
+inline config_value make_value(bool v) noexcept {
+  config_value c{};
+  c.type = VALUE_BOOL;
+  c.as_bool = v;
+  return c;
+}
+
+inline config_value make_value(const char *v) noexcept {
+  config_value c{};
+  c.type = VALUE_STRING;
+  c.as_string = const_cast<char *>(v);
+  return c;
+}
+
+struct request_result {
+  request_status status;
+  class value value;
+
+  bool ok() const noexcept { return status == REQUEST_OK; }
+};
+
+/* co_await protocol.get(node) or protocol.set(node, value). The coroutine
+ * resumes on the thread that completes the request, or inline if the
+ * request could not be issued (status REQUEST_FAILED) */
+class request_awaitable {
+ public:
+  request_awaitable(::protocol *p, structure_node *node) noexcept
+      : p_(p), node_(node), set_{} {}
+  request_awaitable(::protocol *p, structure_node *node, config_value set) noexcept
+      : p_(p), node_(node), set_(set) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept {
+    handle_ = handle;
+    uint32_t id = set_.type == VALUE_INVALID
+                      ? viaems_send_get_async(p_, node_, &request_awaitable::complete, this)
+                      : viaems_send_set_async(p_, node_, set_, &request_awaitable::complete, this);
+    if (id == 0) {
+      status_ = REQUEST_FAILED;
+      return false;
+    }
+    /* The callback may already have run; whichever side comes second
+     * resumes the coroutine */
+    return !done_.exchange(true, std::memory_order_acq_rel);
+  }
+
+  request_result await_resume() noexcept { return { status_, value(result_) }; }
+
+ private:
+  static void complete(request_status status, config_value result, void *userdata) noexcept {
+    auto *self = static_cast<request_awaitable *>(userdata);
+    self->status_ = status;
+    self->result_ = result;
+    if (self->done_.exchange(true, std::memory_order_acq_rel)) {
+      self->handle_.resume();
+    }
+  }
+
+  ::protocol *p_;
+  structure_node *node_;
+  config_value set_;
+  config_value result_{};
+  request_status status_ = REQUEST_FAILED;
+  std::coroutine_handle<> handle_;
+  std::atomic<bool> done_{ false };
+};
+
+/* One decoded feed frame, valid for the duration of the callback */
+struct frame {
+  std::span<const field_key> keys;
+  std::span<const field_value> values;
+};
+
+template <typename T>
+concept frame_handler = requires(T &h, const frame &f) { h.on_frame(f); };
+
+template <typename T>
+concept schema_handler = requires(T &h, std::span<const field_key> keys) { h.on_schema(keys); };
+
+/* A registered feed listener, removed on destruction. The handler must
+ * outlive the subscription */
+class subscription {
+ public:
+  subscription() noexcept : p_(nullptr), listener_{} {}
+  subscription(::protocol *p, const feed_listener &listener) noexcept : p_(p), listener_(listener) {}
+  subscription(subscription &&other) noexcept
+      : p_(std::exchange(other.p_, nullptr)), listener_(other.listener_) {}
+  subscription &operator=(subscription &&other) noexcept {
+    std::swap(p_, other.p_);
+    std::swap(listener_, other.listener_);
+    return *this;
+  }
+  subscription(const subscription &) = delete;
+  subscription &operator=(const subscription &) = delete;
+  ~subscription() {
+    if (p_) {
+      viaems_remove_feed_listener(p_, &listener_);
+    }
+  }
+
+  explicit operator bool() const noexcept { return p_ != nullptr; }
+
+ private:
+  ::protocol *p_;
+  feed_listener listener_;
+};
+
+/* Compile-time field access. A schema lists the leading fields of the
+ * description by name and type, in order:
+ *
+ *   using engine = viaems::schema<viaems::field<"cputime", uint32_t>,
+ *                                 viaems::field<"rpm", uint32_t>,
+ *                                 viaems::field<"map", float>>;
+ *
+ *   engine::frame f; f.get<"rpm">()   // values[1].as_uint32
+ */
+template <std::size_t N>
+struct fixed_string {
+  char chars[N];
+
+  constexpr fixed_string(const char (&s)[N]) noexcept { std::copy_n(s, N, chars); }
+  constexpr std::string_view view() const noexcept { return { chars, N - 1 }; }
+};
+
+template <fixed_string Name, typename T>
+struct field {
+  static_assert(std::is_same_v<T, uint32_t> || std::is_same_v<T, float>,
+                "feed fields are uint32_t or float");
+  using type = T;
+  static constexpr std::string_view name = Name.view();
+  static constexpr feed_field_type field_type = std::is_same_v<T, float> ? FIELD_FLOAT : FIELD_UINT32;
+};
+
+template <typename... Fields>
+class typed_frame {
+ public:
+  explicit typed_frame(const field_value *values) noexcept : values_(values) {}
+
+  template <fixed_string Name>
+  auto get() const noexcept {
+    constexpr std::size_t i = index_of(Name.view());
+    static_assert(i < sizeof...(Fields), "no such field in the schema");
+    using T = std::tuple_element_t<i, std::tuple<typename Fields::type...>>;
+    if constexpr (std::is_same_v<T, float>) {
+      return values_[i].as_float;
+    } else {
+      return values_[i].as_uint32;
+    }
+  }
+
+  static constexpr std::size_t index_of(std::string_view name) noexcept {
+    constexpr std::string_view names[] = { Fields::name... };
+    for (std::size_t i = 0; i < sizeof...(Fields); i++) {
+      if (names[i] == name) {
+        return i;
+      }
+    }
+    return sizeof...(Fields);
+  }
+
+ private:
+  const field_value *values_;
+};
+
+template <typename... Fields>
+struct schema {
+  using frame = typed_frame<Fields...>;
+  static constexpr std::size_t n_fields = sizeof...(Fields);
+
+  /* Further fields, such as derived channels, may follow */
+  static bool matches(std::span<const field_key> keys) noexcept {
+    if (keys.size() < n_fields) {
+      return false;
+    }
+    constexpr std::string_view names[] = { Fields::name... };
+    constexpr feed_field_type types[] = { Fields::field_type... };
+    for (std::size_t i = 0; i < n_fields; i++) {
+      if (keys[i].type != types[i] || names[i] != keys[i].name) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+template <typename Schema, typename Handler>
+concept typed_frame_handler = requires(Handler &h, const typename Schema::frame &f) { h(f); };
+
+/* A typed subscriber is registered at its own address, so it cannot be
+ * moved; construct it in place, for example from protocol::subscribe */
+template <typename Schema, typename Handler>
+  requires typed_frame_handler<Schema, Handler>
+class typed_subscription {
+ public:
+  typed_subscription(::protocol *p, Handler &handler) noexcept : p_(p), handler_(&handler) {
+    listener_.schema = &typed_subscription::schema;
+    listener_.frame = &typed_subscription::frame;
+    listener_.userdata = this;
+    if (!viaems_add_feed_listener(p_, &listener_)) {
+      p_ = nullptr;
+    }
+  }
+  typed_subscription(const typed_subscription &) = delete;
+  typed_subscription &operator=(const typed_subscription &) = delete;
+  ~typed_subscription() {
+    if (p_) {
+      viaems_remove_feed_listener(p_, &listener_);
+    }
+  }
+
+  explicit operator bool() const noexcept { return p_ != nullptr; }
+  bool matches() const noexcept { return matches_; }
+
+ private:
+  static void schema(void *userdata, size_t n_fields, const field_key *keys) noexcept {
+    auto *self = static_cast<typed_subscription *>(userdata);
+    self->matches_ = Schema::matches(std::span<const field_key>(keys, n_fields));
+  }
+
+  static void frame(void *userdata, size_t, const field_key *, const field_value *values) noexcept {
+    auto *self = static_cast<typed_subscription *>(userdata);
+    if (self->matches_) {
+      (*self->handler_)(typename Schema::frame(values));
+    }
+  }
+
+  ::protocol *p_;
+  Handler *handler_;
+  feed_listener listener_{};
+  bool matches_ = false;
+};
+
+class protocol {
+ public:
+  protocol() {
+    if (!viaems_create_protocol(&p_)) {
+      throw std::runtime_error("viaems_create_protocol");
+    }
+  }
+  protocol(protocol &&other) noexcept : p_(std::exchange(other.p_, nullptr)) {}
+  protocol &operator=(protocol &&other) noexcept {
+    std::swap(p_, other.p_);
+    return *this;
+  }
+  protocol(const protocol &) = delete;
+  protocol &operator=(const protocol &) = delete;
+  ~protocol() {
+    if (p_) {
+      viaems_destroy_protocol(&p_);
+    }
+  }
+
+  ::protocol *get() const noexcept { return p_; }
+
+  bool new_data(std::span<const uint8_t> data) noexcept { return viaems_new_data(p_, data.data(), data.size()); }
+
+  /* transport.writev(std::span<const iovec>) is called with each message */
+  template <typename Transport>
+    requires requires(Transport &t, std::span<const iovec> iov) { t.writev(iov); }
+  void set_transport(Transport &transport) noexcept {
+    viaems_set_writev_fn(
+        p_,
+        [](void *userdata, const iovec *iov, int iovcnt) {
+          static_cast<Transport *>(userdata)->writev(std::span<const iovec>(iov, iovcnt));
+        },
+        &transport);
+  }
+
+  void set_request_timeout(std::chrono::milliseconds timeout) noexcept {
+    viaems_set_request_timeout(p_, timeout.count());
+  }
+  void set_lazy_structure(bool lazy) noexcept { viaems_set_lazy_structure(p_, lazy); }
+  viaems_metrics metrics() const noexcept {
+    viaems_metrics m;
+    viaems_get_metrics(p_, &m);
+    return m;
+  }
+
+  /* Blocking requests; an empty result means the request failed */
+  structure_tree get_structure() noexcept {
+    structure_node *root = nullptr;
+    return structure_tree(viaems_get_structure(p_, &root) ? root : nullptr);
+  }
+
+  std::optional<value> get_value(structure_node *node) noexcept {
+    config_value v;
+    if (!viaems_send_get(p_, node, &v)) {
+      return std::nullopt;
+    }
+    return value(v);
+  }
+
+  std::optional<value> set_value(structure_node *node, config_value v) noexcept {
+    config_value result;
+    if (!viaems_send_set(p_, node, v, &result)) {
+      return std::nullopt;
+    }
+    return value(result);
+  }
+
+  request_awaitable get(structure_node *node) noexcept { return { p_, node }; }
+  request_awaitable set(structure_node *node, config_value v) noexcept { return { p_, node, v }; }
+
+  /* handler.on_frame(const frame &), and optionally
+   * handler.on_schema(std::span<const field_key>) */
+  template <frame_handler Handler>
+  [[nodiscard]] subscription subscribe(Handler &handler) noexcept {
+    feed_listener listener{};
+    if constexpr (schema_handler<Handler>) {
+      listener.schema = [](void *userdata, size_t n_fields, const field_key *keys) {
+        static_cast<Handler *>(userdata)->on_schema(std::span<const field_key>(keys, n_fields));
+      };
+    }
+    listener.frame = [](void *userdata, size_t n_fields, const field_key *keys, const field_value *values) {
+      static_cast<Handler *>(userdata)->on_frame(
+          frame{ std::span<const field_key>(keys, n_fields), std::span<const field_value>(values, n_fields) });
+    };
+    listener.userdata = &handler;
+    if (!viaems_add_feed_listener(p_, &listener)) {
+      return {};
+    }
+    return { p_, listener };
+  }
+
+  /* handler(const Schema::frame &) for every frame while the description
+   * matches Schema, see typed_subscription */
+  template <typename Schema, typename Handler>
+    requires typed_frame_handler<Schema, Handler>
+  [[nodiscard]] typed_subscription<Schema, Handler> subscribe(Handler &handler) noexcept {
+    return typed_subscription<Schema, Handler>(p_, handler);
+  }
+
+ private:
+  ::protocol *p_ = nullptr;
+};
+
+class usb {
+ public:
+  usb() : u_(vp_create_usb()) {
+    if (!u_) {
+      throw std::bad_alloc();
+    }
+  }
+  usb(usb &&other) noexcept : u_(std::exchange(other.u_, nullptr)) {}
+  usb &operator=(usb &&other) noexcept {
+    std::swap(u_, other.u_);
+    return *this;
+  }
+  usb(const usb &) = delete;
+  usb &operator=(const usb &) = delete;
+  ~usb() {
+    if (u_) {
+      vp_destroy_usb(u_);
+    }
+  }
+
+  vp_usb *get() const noexcept { return u_; }
+  bool connect(protocol &p) noexcept { return vp_usb_connect(u_, p.get()); }
+
+ private:
+  vp_usb *u_;
+};
+
+} // namespace viaems
+
+#endif